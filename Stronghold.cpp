@@ -6,6 +6,33 @@
 #include <cstdlib>
 #include <thread>
 #include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <cstring>
+#include <sstream>
+#include <iomanip>
+#include <queue>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <cctype>
+#include <new>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // Utility functions
 int getValidInt(const std::string& prompt) {
@@ -33,12 +60,543 @@ std::string getValidString(const std::string& prompt) {
     return input;
 }
 
+// Action status codes
+const char* statusMessage(ActionStatus status) {
+    return status >= 0 && status < STATUS_COUNT ? STATUS_MESSAGES[status] : "Unknown status";
+}
+
+void requireSuccess(ActionStatus status) {
+    if (status == STATUS_OK) return;
+    if (status == STATUS_AUDIT_FAILED || status == STATUS_BANK_AUDIT_FAILED) throw CorruptionException(statusMessage(status));
+    throw InsufficientResourcesException(statusMessage(status));
+}
+
+// Resource and population class registry
+bool parseResourceType(const std::string& name, ResourceType& type) {
+    for (int i = 0; i < RESOURCE_COUNT; ++i) {
+        if (name == RESOURCE_NAMES[i]) {
+            type = static_cast<ResourceType>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parsePopulationClass(const std::string& name, PopulationClass& populationClass) {
+    for (int i = 0; i < CLASS_COUNT; ++i) {
+        if (name == CLASS_NAMES[i]) {
+            populationClass = static_cast<PopulationClass>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Binary snapshot helpers
+BinaryWriter::BinaryWriter(std::string& buffer) : buffer(buffer) {}
+
+void BinaryWriter::writeBytes(const void* data, size_t size) { buffer.append(static_cast<const char*>(data), size); }
+void BinaryWriter::writeByte(uint8_t value) { buffer.push_back(static_cast<char>(value)); }
+void BinaryWriter::writeBool(bool value) { writeByte(value ? 1 : 0); }
+void BinaryWriter::writeInt(int32_t value) { writeBytes(&value, sizeof(value)); }
+void BinaryWriter::writeUInt(uint32_t value) { writeBytes(&value, sizeof(value)); }
+void BinaryWriter::writeUInt64(uint64_t value) { writeBytes(&value, sizeof(value)); }
+void BinaryWriter::writeDouble(double value) { writeBytes(&value, sizeof(value)); }
+
+void BinaryWriter::writeVarUInt(uint64_t value) {
+    while (value >= 0x80) {
+        writeByte(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    writeByte(static_cast<uint8_t>(value));
+}
+
+void BinaryWriter::writeVarInt(int64_t value) {
+    writeVarUInt((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+}
+
+void BinaryWriter::writeString(const std::string& value) {
+    writeUInt(static_cast<uint32_t>(value.size()));
+    writeBytes(value.data(), value.size());
+}
+
+size_t BinaryWriter::size() const { return buffer.size(); }
+
+BinaryReader::BinaryReader(const char* data, size_t size) : data(data), size(size), offset(0) {}
+
+void BinaryReader::readBytes(void* target, size_t count) {
+    if (count > size - offset) throw std::runtime_error("Corrupt save data: unexpected end of snapshot");
+    std::memcpy(target, data + offset, count);
+    offset += count;
+}
+
+uint8_t BinaryReader::readByte() {
+    uint8_t value;
+    readBytes(&value, sizeof(value));
+    return value;
+}
+
+bool BinaryReader::readBool() { return readByte() != 0; }
+
+int32_t BinaryReader::readInt() {
+    int32_t value;
+    readBytes(&value, sizeof(value));
+    return value;
+}
+
+uint32_t BinaryReader::readUInt() {
+    uint32_t value;
+    readBytes(&value, sizeof(value));
+    return value;
+}
+
+uint64_t BinaryReader::readUInt64() {
+    uint64_t value;
+    readBytes(&value, sizeof(value));
+    return value;
+}
+
+uint64_t BinaryReader::readVarUInt() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t byte = readByte();
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    throw std::runtime_error("Corrupt save data: varint too long");
+}
+
+int64_t BinaryReader::readVarInt() {
+    uint64_t value = readVarUInt();
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+double BinaryReader::readDouble() {
+    double value;
+    readBytes(&value, sizeof(value));
+    return value;
+}
+
+std::string BinaryReader::readString() {
+    uint32_t length = readUInt();
+    if (length > size - offset) throw std::runtime_error("Corrupt save data: string out of range");
+    std::string value(data + offset, length);
+    offset += length;
+    return value;
+}
+
+size_t BinaryReader::remaining() const { return size - offset; }
+
+// FNV-1a over the payload
+uint32_t snapshotChecksum(const char* data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<uint8_t>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool readSnapshotHeader(const char* data, size_t size, SnapshotHeader& header) {
+    if (size < SNAPSHOT_HEADER_SIZE) return false;
+    BinaryReader in(data, SNAPSHOT_HEADER_SIZE);
+    header.magic = in.readUInt();
+    header.version = in.readUInt();
+    header.payloadSize = in.readUInt64();
+    header.checksum = in.readUInt();
+    return header.magic == SAVE_FORMAT_MAGIC && header.payloadSize <= size - SNAPSHOT_HEADER_SIZE;
+}
+
+// Clock classes
+static double steadySeconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+RealTimeClock::RealTimeClock() : start(steadySeconds()) {}
+
+void RealTimeClock::wait(double seconds) {
+    if (seconds > 0) std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+}
+
+double RealTimeClock::now() const { return steadySeconds() - start; }
+
+ScaledClock::ScaledClock(double scale) : scale(scale > 0 ? scale : 1.0), start(steadySeconds()) {}
+
+void ScaledClock::wait(double seconds) {
+    if (seconds > 0) std::this_thread::sleep_for(std::chrono::duration<double>(seconds * scale));
+}
+
+double ScaledClock::now() const { return (steadySeconds() - start) / scale; }
+double ScaledClock::getScale() const { return scale; }
+
+InstantClock::InstantClock() : elapsed(0.0) {}
+
+void InstantClock::wait(double seconds) {
+    if (seconds > 0) elapsed += seconds;
+}
+
+double InstantClock::now() const { return elapsed; }
+
+static thread_local Clock* currentClock = nullptr;
+
+Clock& activeClock() {
+    static RealTimeClock realTime;
+    return currentClock ? *currentClock : realTime;
+}
+
+ClockScope::ClockScope(Clock& clock) : previous(currentClock) { currentClock = &clock; }
+ClockScope::~ClockScope() { currentClock = previous; }
+
+// Profiler class
+#ifdef STRONGHOLD_PROFILE
+void Profiler::Histogram::add(uint64_t nanoseconds) {
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && (nanoseconds >> bucket) != 0) bucket++;
+    buckets[bucket]++;
+    count++;
+    total += nanoseconds;
+    maximum = std::max(maximum, nanoseconds);
+}
+
+void Profiler::Histogram::merge(const Histogram& other) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) buckets[i] += other.buckets[i];
+    count += other.count;
+    total += other.total;
+    maximum = std::max(maximum, other.maximum);
+}
+
+uint64_t Profiler::Histogram::percentile(double fraction) const {
+    // Reports the upper edge of the bucket holding the requested rank
+    uint64_t rank = static_cast<uint64_t>(std::ceil(fraction * count));
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += buckets[i];
+        if (seen >= rank && seen > 0) return std::min(maximum, (uint64_t(1) << i));
+    }
+    return maximum;
+}
+
+Profiler::Profiler() : epoch(std::chrono::steady_clock::now()) {}
+
+Profiler& Profiler::instance() {
+    static Profiler profiler;
+    return profiler;
+}
+
+Profiler::ThreadBuffer& Profiler::localBuffer() {
+    static thread_local ThreadBuffer* buffer = nullptr;
+    if (!buffer) {
+        std::lock_guard<std::mutex> guard(lock);
+        buffers.emplace_back(new ThreadBuffer());
+        buffer = buffers.back().get();
+        buffer->id = static_cast<uint32_t>(buffers.size());
+    }
+    return *buffer;
+}
+
+uint64_t Profiler::now() const {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - epoch).count());
+}
+
+void Profiler::record(const char* name, uint64_t start, uint64_t duration) {
+    ThreadBuffer& buffer = localBuffer();
+    if (buffer.events.size() < MAX_TRACE_EVENTS) buffer.events.push_back({ name, start, duration });
+    buffer.histograms[name].add(duration);
+}
+
+void Profiler::reset() {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto& buffer : buffers) {
+        buffer->events.clear();
+        buffer->histograms.clear();
+    }
+}
+
+void Profiler::writeChromeTrace(const std::string& path) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::ofstream file(path, std::ios::trunc);
+    if (!file.is_open()) throw std::runtime_error("Cannot open " + path);
+    file << "{\"traceEvents\":[";
+    bool first = true;
+    char line[256];
+    for (const auto& buffer : buffers) {
+        for (const Event& event : buffer->events) {
+            // Trace timestamps are microseconds; keep the nanosecond part as a fraction
+            snprintf(line, sizeof(line), "%s\n{\"name\":\"%s\",\"cat\":\"stronghold\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}",
+                first ? "" : ",", event.name, event.start / 1000.0, event.duration / 1000.0, buffer->id);
+            file << line;
+            first = false;
+        }
+    }
+    file << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+void Profiler::printHistograms(std::ostream& out) {
+    std::map<std::string, Histogram> merged;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (const auto& buffer : buffers)
+            for (const auto& entry : buffer->histograms) merged[entry.first].merge(entry.second);
+    }
+    char line[160];
+    out << BOLD << "Profile (ns)                     count        mean         p50         p99         max\n" << RESET;
+    for (const auto& entry : merged) {
+        const Histogram& h = entry.second;
+        snprintf(line, sizeof(line), "%-24s %12llu %11.0f %11llu %11llu %11llu\n", entry.first.c_str(),
+            static_cast<unsigned long long>(h.count), h.count ? double(h.total) / h.count : 0.0,
+            static_cast<unsigned long long>(h.percentile(0.5)), static_cast<unsigned long long>(h.percentile(0.99)),
+            static_cast<unsigned long long>(h.maximum));
+        out << line;
+        uint64_t peak = *std::max_element(h.buckets, h.buckets + HISTOGRAM_BUCKETS);
+        for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+            if (h.buckets[i] == 0) continue;
+            snprintf(line, sizeof(line), "    < %-12llu %-40s %llu\n", static_cast<unsigned long long>(uint64_t(1) << i),
+                std::string(static_cast<size_t>(1 + 39 * h.buckets[i] / peak), '#').c_str(),
+                static_cast<unsigned long long>(h.buckets[i]));
+            out << line;
+        }
+    }
+}
+
+ProfileScope::ProfileScope(const char* scopeName) : name(scopeName), start(Profiler::instance().now()) {}
+
+ProfileScope::~ProfileScope() {
+    Profiler& profiler = Profiler::instance();
+    profiler.record(name, start, profiler.now() - start);
+}
+#endif
+
+// ResourceBundle class
+ResourceBundle::ResourceBundle() : lanes() {}
+
+ResourceBundle& ResourceBundle::with(ResourceType type, int amount) {
+    lanes[type] += amount;
+    return *this;
+}
+
+ResourceBundle& ResourceBundle::withGold(int amount) {
+    lanes[BUNDLE_GOLD] += amount;
+    return *this;
+}
+
+ResourceBundle ResourceBundle::scaled(int factor) const {
+    ResourceBundle result;
+    for (int i = 0; i < BUNDLE_LANES; ++i) result.lanes[i] = lanes[i] * factor;
+    return result;
+}
+
+int ResourceBundle::get(ResourceType type) const { return lanes[type]; }
+int ResourceBundle::getGold() const { return lanes[BUNDLE_GOLD]; }
+int ResourceBundle::lane(int index) const { return lanes[index]; }
+
+bool ResourceBundle::coveredBy(const Resource<int>* stock, const Economy* econ) const {
+    int held[BUNDLE_LANES];
+    for (int i = 0; i < RESOURCE_COUNT; ++i) held[i] = stock[i].get();
+    held[BUNDLE_GOLD] = econ ? econ->getGold() : 0;
+    // Lanes the cost leaves at zero are not checked at all
+    int shortfall = 0;
+    for (int i = 0; i < BUNDLE_LANES; ++i) shortfall |= (lanes[i] != 0) & (held[i] < lanes[i]);
+    return !shortfall;
+}
+
+void ResourceBundle::withdraw(Resource<int>* stock, Economy* econ) const {
+    // Untouched lanes are skipped so their stores are not clamped or copied needlessly
+    for (int i = 0; i < RESOURCE_COUNT; ++i) {
+        if (lanes[i] != 0) stock[i].adjust(-lanes[i]);
+    }
+    if (lanes[BUNDLE_GOLD] != 0) econ->spend(lanes[BUNDLE_GOLD]);
+}
+
+ActionStatus ResourceBundle::tryWithdraw(Resource<int>* stock, Economy* econ, ActionStatus shortfall) const {
+    if (!coveredBy(stock, econ)) return shortfall;
+    withdraw(stock, econ);
+    return STATUS_OK;
+}
+
+// SharedTreasury class
+SharedTreasury::SharedTreasury(const ResourceBundle& initial) {
+    for (int i = 0; i < BUNDLE_LANES; ++i) lanes[i].store(initial.lane(i));
+}
+
+ActionStatus SharedTreasury::tryWithdraw(const ResourceBundle& cost) {
+    for (int i = 0; i < BUNDLE_LANES; ++i) {
+        int amount = cost.lane(i);
+        if (amount <= 0) continue;
+        int held = lanes[i].load(std::memory_order_relaxed);
+        do {
+            if (held < amount) {
+                // Give back the lanes already reserved
+                for (int j = 0; j < i; ++j) {
+                    if (cost.lane(j) > 0) lanes[j].fetch_add(cost.lane(j), std::memory_order_relaxed);
+                }
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+        } while (!lanes[i].compare_exchange_weak(held, held - amount, std::memory_order_acq_rel, std::memory_order_relaxed));
+    }
+    // Negative lanes are income, credited once the whole cost is paid
+    for (int i = 0; i < BUNDLE_LANES; ++i) {
+        if (cost.lane(i) < 0) lanes[i].fetch_sub(cost.lane(i), std::memory_order_relaxed);
+    }
+    return STATUS_OK;
+}
+
+void SharedTreasury::deposit(const ResourceBundle& amount) {
+    for (int i = 0; i < BUNDLE_LANES; ++i) {
+        if (amount.lane(i) != 0) lanes[i].fetch_add(amount.lane(i), std::memory_order_relaxed);
+    }
+}
+
+ResourceBundle SharedTreasury::getBalance() const {
+    ResourceBundle balance;
+    for (int i = 0; i < RESOURCE_COUNT; ++i) balance.with(static_cast<ResourceType>(i), lanes[i].load());
+    return balance.withGold(lanes[BUNDLE_GOLD].load());
+}
+
+// MonotonicArena class
+MonotonicArena::MonotonicArena(size_t blockSize)
+    : current(-1), cursor(nullptr), remaining(0), blockSize(blockSize), bytesUsed(0) {}
+
+void MonotonicArena::nextBlock(size_t minimum) {
+    // Blocks kept by release() are reused in order before any new one is allocated
+    while (++current < static_cast<int>(blocks.size())) {
+        if (blocks[current].size >= minimum) {
+            cursor = blocks[current].memory.get();
+            remaining = blocks[current].size;
+            return;
+        }
+    }
+    size_t size = std::max(blockSize, minimum);
+    blocks.push_back(Block{ std::unique_ptr<char[]>(new char[size]), size });
+    current = static_cast<int>(blocks.size()) - 1;
+    cursor = blocks.back().memory.get();
+    remaining = size;
+}
+
+void* MonotonicArena::allocate(size_t size, size_t alignment) {
+    size_t padding = (alignment - reinterpret_cast<uintptr_t>(cursor) % alignment) % alignment;
+    if (!cursor || padding + size > remaining) {
+        nextBlock(size + alignment);
+        padding = (alignment - reinterpret_cast<uintptr_t>(cursor) % alignment) % alignment;
+    }
+    char* memory = cursor + padding;
+    cursor = memory + size;
+    remaining -= padding + size;
+    bytesUsed += size;
+    return memory;
+}
+
+void MonotonicArena::release() {
+    current = -1;
+    cursor = nullptr;
+    remaining = 0;
+    bytesUsed = 0;
+}
+
+size_t MonotonicArena::getBytesUsed() const { return bytesUsed; }
+size_t MonotonicArena::getBlockCount() const { return blocks.size(); }
+
+// AllocationCounter class
+static std::atomic<uint64_t> allocationCount(0);
+
+#ifdef STRONGHOLD_COUNT_ALLOCS
+// Every form of new and delete is replaced, so each allocation is released by its own pair. All are
+// kept out of line: GCC otherwise inlines malloc() or free() into callers and warns they do not match
+#if defined(__GNUC__)
+#define COUNT_ALLOCS_NOINLINE __attribute__((noinline))
+#else
+#define COUNT_ALLOCS_NOINLINE
+#endif
+
+static void* countedAllocate(std::size_t size) noexcept {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+COUNT_ALLOCS_NOINLINE void* operator new(std::size_t size) {
+    if (void* memory = countedAllocate(size)) return memory;
+    throw std::bad_alloc();
+}
+COUNT_ALLOCS_NOINLINE void* operator new[](std::size_t size) {
+    if (void* memory = countedAllocate(size)) return memory;
+    throw std::bad_alloc();
+}
+COUNT_ALLOCS_NOINLINE void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return countedAllocate(size); }
+COUNT_ALLOCS_NOINLINE void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return countedAllocate(size); }
+
+COUNT_ALLOCS_NOINLINE void operator delete(void* memory) noexcept { std::free(memory); }
+COUNT_ALLOCS_NOINLINE void operator delete(void* memory, std::size_t) noexcept { std::free(memory); }
+COUNT_ALLOCS_NOINLINE void operator delete[](void* memory) noexcept { std::free(memory); }
+COUNT_ALLOCS_NOINLINE void operator delete[](void* memory, std::size_t) noexcept { std::free(memory); }
+COUNT_ALLOCS_NOINLINE void operator delete(void* memory, const std::nothrow_t&) noexcept { std::free(memory); }
+COUNT_ALLOCS_NOINLINE void operator delete[](void* memory, const std::nothrow_t&) noexcept { std::free(memory); }
+#undef COUNT_ALLOCS_NOINLINE
+
+bool AllocationCounter::isEnabled() { return true; }
+#else
+bool AllocationCounter::isEnabled() { return false; }
+#endif
+
+uint64_t AllocationCounter::getCount() { return allocationCount.load(std::memory_order_relaxed); }
+
+// Random class
+Random::Random(uint64_t seed, uint64_t stream) : state(0), increment(1) {
+    this->seed(seed, stream);
+}
+
+void Random::seed(uint64_t seed, uint64_t stream) {
+    state = 0;
+    increment = (stream << 1) | 1;
+    next();
+    state += seed;
+    next();
+}
+
+uint32_t Random::next() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + increment;
+    uint32_t xorshifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+    uint32_t rot = static_cast<uint32_t>(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+
+int Random::nextInt(int bound) {
+    if (bound <= 0) return 0;
+    return static_cast<int>((static_cast<uint64_t>(next()) * static_cast<uint64_t>(bound)) >> 32);
+}
+
+double Random::nextDouble() { return next() * (1.0 / 4294967296.0); }
+
+
+void Random::serialize(BinaryWriter& out) const {
+    out.writeUInt64(state);
+    out.writeUInt64(increment);
+}
+
+void Random::deserialize(BinaryReader& in) {
+    state = in.readUInt64();
+    increment = in.readUInt64();
+}
+
 // General class
 General::General(const std::string& name, double loyalty) : name(name), loyalty(loyalty), corrupted(false) {}
 std::string General::getName() const { return name; }
 bool General::isCorrupted() const { return corrupted; }
 void General::setCorrupted(bool val) { corrupted = val; }
 
+
+void General::serialize(BinaryWriter& out) const {
+    out.writeString(name);
+    out.writeDouble(loyalty);
+    out.writeBool(corrupted);
+}
+
+void General::deserialize(BinaryReader& in) {
+    name = in.readString();
+    loyalty = in.readDouble();
+    corrupted = in.readBool();
+}
+
 // King class
 King::King(const std::string& name, double approval, const std::string& style)
     : name(name), approval(approval), style(style), corrupted(false) {
@@ -47,12 +605,26 @@ std::string King::getName() const { return name; }
 bool King::isCorrupted() const { return corrupted; }
 void King::setCorrupted(bool val) { corrupted = val; }
 
+
+void King::serialize(BinaryWriter& out) const {
+    out.writeString(name);
+    out.writeDouble(approval);
+    out.writeString(style);
+    out.writeBool(corrupted);
+}
+
+void King::deserialize(BinaryReader& in) {
+    name = in.readString();
+    approval = in.readDouble();
+    style = in.readString();
+    corrupted = in.readBool();
+}
+
 // Population class
 Population::Population() : morale(0.85) {
-    classes[0] = { "Peasants", 700, 0.75 };
-    classes[1] = { "Merchants", 200, 0.85 };
-    classes[2] = { "Nobility", 50, 0.95 };
-    classes[3] = { "Military", 50, 0.9 };
+    for (int i = 0; i < CLASS_COUNT; ++i) {
+        classes[i] = { CLASS_NAMES[i], STARTING_CLASS_SIZES[i], STARTING_SATISFACTION[i] };
+    }
 }
 
 void Population::adjustMorale(double delta) {
@@ -61,22 +633,23 @@ void Population::adjustMorale(double delta) {
     if (morale > 1.0) morale = 1.0;
 }
 
+void Population::adjustClassSize(PopulationClass populationClass, int delta) {
+    ResourcePair& target = classes[populationClass];
+    target.size += delta;
+    if (target.size < 0) target.size = 0;
+}
+
 void Population::adjustClassSize(const std::string& className, int delta) {
-    for (int i = 0; i < MAX_CLASSES; ++i) {
-        if (classes[i].name == className) {
-            classes[i].size += delta;
-            if (classes[i].size < 0) classes[i].size = 0;
-            return;
-        }
-    }
-    throw InsufficientResourcesException("Class not found");
+    PopulationClass populationClass;
+    if (!parsePopulationClass(className, populationClass)) throw InsufficientResourcesException("Class not found");
+    adjustClassSize(populationClass, delta);
 }
 
-void Population::handleClassConflict() {
-    if (morale < 0.4 && rand() % 10 < 3) {
+void Population::handleClassConflict(Random& rng) {
+    if (morale < 0.4 && rng.nextInt(10) < 3) {
         int loss = classes[0].size / 10;
-        adjustClassSize("Peasants", -loss);
-        adjustClassSize("Merchants", -loss / 2);
+        adjustClassSize(PEASANTS, -loss);
+        adjustClassSize(MERCHANTS, -loss / 2);
         adjustMorale(-0.15);
         std::cout << RED << "Class conflict! Peasants and Merchants riot, population decreases.\n" << RESET;
     }
@@ -92,15 +665,39 @@ int Population::getTotalSize() const {
 
 double Population::getMorale() const { return morale; }
 ResourcePair* Population::getClasses() { return classes; }
+const ResourcePair* Population::getClasses() const { return classes; }
+
+
+void Population::serialize(BinaryWriter& out) const {
+    out.writeDouble(morale);
+    for (int i = 0; i < MAX_CLASSES; ++i) {
+        out.writeInt(classes[i].size);
+        out.writeDouble(classes[i].satisfaction);
+    }
+}
+
+void Population::deserialize(BinaryReader& in) {
+    morale = in.readDouble();
+    for (int i = 0; i < MAX_CLASSES; ++i) {
+        classes[i].name = CLASS_NAMES[i];
+        classes[i].size = in.readInt();
+        classes[i].satisfaction = in.readDouble();
+    }
+}
 
 // Economy class
 Economy::Economy(int initialGold) : gold(initialGold), progressiveTax(false), debtReliance(0) {}
 
-void Economy::spend(int amount) {
-    if (gold.get() < amount) throw InsufficientResourcesException("Insufficient gold");
+bool Economy::canAfford(int amount) const { return gold.get() >= amount; }
+
+ActionStatus Economy::trySpend(int amount) {
+    if (!canAfford(amount)) return STATUS_INSUFFICIENT_GOLD;
     gold.adjust(-amount);
+    return STATUS_OK;
 }
 
+void Economy::spend(int amount) { requireSuccess(trySpend(amount)); }
+
 void Economy::collectTaxes(Population& pop) {
     int tax = progressiveTax ? static_cast<int>(pop.getTotalSize() * 0.1) : 100;
     gold.adjust(tax);
@@ -108,8 +705,8 @@ void Economy::collectTaxes(Population& pop) {
     std::cout << GREEN << "Collected " << tax << " gold in taxes.\n" << RESET;
 }
 
-void Economy::triggerMarketCrash(Population& pop) {
-    if (rand() % 15 == 0) {
+void Economy::triggerMarketCrash(Population& pop, Random& rng) {
+    if (rng.nextInt(15) == 0) {
         gold.adjust(-gold.get() / 3);
         pop.adjustMorale(-0.2);
         std::cout << RED << "Market crash! Gold reserves drop by a third, morale plummets.\n" << RESET;
@@ -121,68 +718,123 @@ bool Economy::isProgressiveTax() const { return progressiveTax; }
 int Economy::getDebtReliance() const { return debtReliance; }
 void Economy::increaseDebtReliance(int amount) { debtReliance += amount; }
 
+
+void Economy::serialize(BinaryWriter& out) const {
+    out.writeInt(gold.get());
+    out.writeBool(progressiveTax);
+    out.writeInt(debtReliance);
+}
+
+void Economy::deserialize(BinaryReader& in) {
+    gold = Resource<int>(in.readInt());
+    progressiveTax = in.readBool();
+    debtReliance = in.readInt();
+}
+
 // Blacksmith class
 Blacksmith::Blacksmith() : level(1), weaponsInStock(0), corrupted(false) {}
 
-void Blacksmith::upgrade(Economy& econ) {
+ActionStatus Blacksmith::tryUpgrade(Economy& econ) {
     int cost = 500 * level;
-    econ.spend(cost);
+    ActionStatus status = econ.trySpend(cost);
+    if (status != STATUS_OK) return status;
     level++;
     std::cout << GREEN << "Blacksmith upgraded to level " << level << "!\n" << RESET;
+    return STATUS_OK;
 }
 
-void Blacksmith::produceWeapons(Resource<int>& iron, Resource<int>& wood, int count) {
-    if (iron.get() < count * 10 || wood.get() < count * 5)
-        throw InsufficientResourcesException("Insufficient resources for weapon production");
-    iron.adjust(-count * 10);
-    wood.adjust(-count * 5);
+void Blacksmith::upgrade(Economy& econ) { requireSuccess(tryUpgrade(econ)); }
+
+// Materials for one weapon
+static const ResourceBundle WEAPON_COST = ResourceBundle().with(IRON, 10).with(WOOD, 5);
+
+ActionStatus Blacksmith::checkProduceWeapons(const Resource<int>* stock, int count) const {
+    return WEAPON_COST.scaled(count).coveredBy(stock, nullptr) ? STATUS_OK : STATUS_INSUFFICIENT_WEAPON_MATERIALS;
+}
+
+ActionStatus Blacksmith::tryProduceWeapons(Resource<int>* stock, int count) {
+    ActionStatus status = WEAPON_COST.scaled(count).tryWithdraw(stock, nullptr, STATUS_INSUFFICIENT_WEAPON_MATERIALS);
+    if (status != STATUS_OK) return status;
     std::cout << "Producing " << count << " weapons...\n";
-    std::this_thread::sleep_for(std::chrono::seconds(3 / level));
+    activeClock().wait(3 / level);
     weaponsInStock.adjust(count);
     std::cout << GREEN << "Produced " << count << " weapons!\n" << RESET;
+    return STATUS_OK;
 }
 
-void Blacksmith::useWeapons(int count) {
-    if (weaponsInStock.get() < count) throw InsufficientResourcesException("Not enough weapons");
+void Blacksmith::produceWeapons(Resource<int>* stock, int count) { requireSuccess(tryProduceWeapons(stock, count)); }
+
+ActionStatus Blacksmith::tryUseWeapons(int count) {
+    if (weaponsInStock.get() < count) return STATUS_NOT_ENOUGH_WEAPONS;
     weaponsInStock.adjust(-count);
+    return STATUS_OK;
 }
 
+void Blacksmith::useWeapons(int count) { requireSuccess(tryUseWeapons(count)); }
+
 int Blacksmith::getWeaponsInStock() const { return weaponsInStock.get(); }
 int Blacksmith::getLevel() const { return level; }
 bool Blacksmith::isCorrupted() const { return corrupted; }
 void Blacksmith::setCorrupted(bool val) { corrupted = val; }
 
+
+void Blacksmith::serialize(BinaryWriter& out) const {
+    out.writeInt(level);
+    out.writeInt(weaponsInStock.get());
+    out.writeBool(corrupted);
+}
+
+void Blacksmith::deserialize(BinaryReader& in) {
+    level = in.readInt();
+    weaponsInStock = Resource<int>(in.readInt());
+    corrupted = in.readBool();
+}
+
 // Army class
-Army::Army(int size, int weap) : soldiers(size), morale(0.8), weapons(weap), trainingDelay(0) {
-    general = std::make_unique<General>("General Patton", 0.85);
+Army::Army(int size, int weap)
+    : soldiers(size), morale(0.8), weapons(weap), trainingDelay(0), general("General Patton", 0.85) {}
+
+// Iron to equip one recruit
+static const ResourceBundle RECRUIT_COST = ResourceBundle().with(IRON, 10);
+
+ActionStatus Army::checkTrain(int count, const Population& pop, const Resource<int>* stock, const Blacksmith& blacksmith) const {
+    if (pop.getTotalSize() < count || !RECRUIT_COST.scaled(count).coveredBy(stock, nullptr)) return STATUS_INSUFFICIENT_RECRUITS;
+    if (blacksmith.getWeaponsInStock() < count) return STATUS_INSUFFICIENT_WEAPON_STOCK;
+    return STATUS_OK;
 }
 
-void Army::train(int count, Population& pop, Resource<int>& iron, Blacksmith& blacksmith, double efficiency) {
-    if (pop.getTotalSize() < count || iron.get() < count * 10)
-        throw InsufficientResourcesException("Insufficient population or iron");
-    if (blacksmith.getWeaponsInStock() < count)
-        throw InsufficientResourcesException("Insufficient weapons in stock");
+ActionStatus Army::tryTrain(int count, Population& pop, Resource<int>* stock, Blacksmith& blacksmith, double efficiency) {
+    ActionStatus status = checkTrain(count, pop, stock, blacksmith);
+    if (status != STATUS_OK) return status;
     if (trainingDelay > 0) {
         std::cout << YELLOW << "Training delayed by " << trainingDelay << " turns.\n" << RESET;
-        return;
+        return STATUS_OK;
     }
-    pop.adjustClassSize("Peasants", -count);
-    pop.adjustClassSize("Military", count);
-    iron.adjust(-count * 10);
+    pop.adjustClassSize(PEASANTS, -count);
+    pop.adjustClassSize(MILITARY, count);
+    RECRUIT_COST.scaled(count).withdraw(stock, nullptr);
     blacksmith.useWeapons(count);
     std::cout << "Training " << count << " soldiers...\n";
-    std::this_thread::sleep_for(std::chrono::seconds(static_cast<int>(5 * efficiency * (getGeneral().isCorrupted() ? 1.5 : 1.0))));
+    activeClock().wait(static_cast<int>(5 * efficiency * (getGeneral().isCorrupted() ? 1.5 : 1.0)));
     soldiers += count;
     morale = (morale < 1.0) ? morale + 0.05 : 1.0;
     trainingDelay = getGeneral().isCorrupted() ? 2 : 1;
     std::cout << GREEN << "Trained " << count << " soldiers!\n" << RESET;
+    return STATUS_OK;
+}
+
+void Army::train(int count, Population& pop, Resource<int>* stock, Blacksmith& blacksmith, double efficiency) {
+    requireSuccess(tryTrain(count, pop, stock, blacksmith, efficiency));
 }
 
-void Army::useSpies(int count) {
-    if (soldiers < count) throw InsufficientResourcesException("Not enough soldiers");
+ActionStatus Army::tryUseSpies(int count) {
+    if (soldiers < count) return STATUS_NOT_ENOUGH_SOLDIERS;
     soldiers -= count;
+    return STATUS_OK;
 }
 
+void Army::useSpies(int count) { requireSuccess(tryUseSpies(count)); }
+
 void Army::checkMorale(Economy& econ) {
     if (econ.getGold() < soldiers * 2) {
         morale -= 0.1;
@@ -201,28 +853,44 @@ void Army::applyTrainingDelay() {
     }
 }
 
-General& Army::getGeneral() { return *general; }
-const General& Army::getGeneral() const { return *general; }
+General& Army::getGeneral() { return general; }
+const General& Army::getGeneral() const { return general; }
 int Army::getSize() const { return soldiers; }
 int Army::getWeapons() const { return weapons; }
 double Army::getMorale() const { return morale; }
 
-// Politics class
-Politics::Politics(const std::string& kingName) : currentKing(kingName), candidateCount(3), corrupted(false) {
-    candidates[0] = std::make_unique<King>("Arthur", 0.8, "Diplomatic");
-    candidates[1] = std::make_unique<King>("Eleanor", 0.75, "Economic");
-    candidates[2] = std::make_unique<King>("Richard", 0.7, "Aggressive");
+
+void Army::serialize(BinaryWriter& out) const {
+    out.writeInt(soldiers);
+    out.writeDouble(morale);
+    out.writeInt(weapons);
+    out.writeInt(trainingDelay);
+    general.serialize(out);
+}
+
+void Army::deserialize(BinaryReader& in) {
+    soldiers = in.readInt();
+    morale = in.readDouble();
+    weapons = in.readInt();
+    trainingDelay = in.readInt();
+    general.deserialize(in);
 }
 
-void Politics::holdElection(Population& pop, Economy& econ) {
-    if (rand() % 10 == 0) {
+// Politics class
+Politics::Politics(const std::string& kingName)
+    : currentKing(kingName), candidateCount(3),
+    candidates{ { "Arthur", 0.8, "Diplomatic" }, { "Eleanor", 0.75, "Economic" }, { "Richard", 0.7, "Aggressive" } },
+    corrupted(false) {}
+
+void Politics::holdElection(Population& pop, Economy& econ, Random& rng) {
+    if (rng.nextInt(10) == 0) {
         std::cout << RED << "Assassination! Current king killed, re-election triggered!\n" << RESET;
-        currentKing = getCandidates()[rand() % getCandidateCount()]->getName();
+        currentKing = getCandidates()[rng.nextInt(getCandidateCount())].getName();
         pop.adjustMorale(-0.2);
         return;
     }
     if (corrupted) {
-        currentKing = getCandidates()[rand() % getCandidateCount()]->getName();
+        currentKing = getCandidates()[rng.nextInt(getCandidateCount())].getName();
         std::cout << RED << "Corrupt election! King chosen randomly.\n" << RESET;
         return;
     }
@@ -244,70 +912,112 @@ void Politics::holdElection(Population& pop, Economy& econ) {
             winnerIndex = j;
         }
     }
-    currentKing = getCandidates()[winnerIndex]->getName();
+    currentKing = getCandidates()[winnerIndex].getName();
     pop.adjustMorale(0.05);
     std::cout << GREEN << "Election held! New king: " << currentKing << "\n" << RESET;
 }
 
-void Politics::bribe(Economy& econ, const std::string& candidate) {
-    econ.spend(200);
+ActionStatus Politics::tryBribe(Economy& econ, const std::string& candidate) {
+    ActionStatus status = econ.trySpend(200);
+    if (status != STATUS_OK) return status;
     std::cout << YELLOW << "Bribed voters to favor " << candidate << ".\n" << RESET;
+    return STATUS_OK;
 }
 
-void Politics::blackmail(Economy& econ, const std::string& candidate) {
-    econ.spend(300);
+void Politics::bribe(Economy& econ, const std::string& candidate) { requireSuccess(tryBribe(econ, candidate)); }
+
+ActionStatus Politics::tryBlackmail(Economy& econ, const std::string& candidate) {
+    ActionStatus status = econ.trySpend(300);
+    if (status != STATUS_OK) return status;
     std::cout << YELLOW << "Blackmailed voters to favor " << candidate << ", morale drops.\n" << RESET;
     econ.increaseDebtReliance(50);
+    return STATUS_OK;
 }
 
-void Politics::triggerRebellion(Population& pop, Economy& econ) {
-    if (pop.getMorale() < 0.3 && rand() % 5 == 0) {
-        pop.adjustClassSize("Peasants", -pop.getTotalSize() / 4);
+void Politics::blackmail(Economy& econ, const std::string& candidate) { requireSuccess(tryBlackmail(econ, candidate)); }
+
+void Politics::triggerRebellion(Population& pop, Economy& econ, Random& rng) {
+    if (pop.getMorale() < 0.3 && rng.nextInt(5) == 0) {
+        pop.adjustClassSize(PEASANTS, -pop.getTotalSize() / 4);
         pop.adjustMorale(-0.2);
         econ.spend(econ.getGold() / 4);
         std::cout << RED << "Rebellion! Peasants revolt, treasury loses gold!\n" << RESET;
     }
 }
 
-std::unique_ptr<King>* Politics::getCandidates() { return candidates; }
+King* Politics::getCandidates() { return candidates; }
 int Politics::getCandidateCount() const { return candidateCount; }
 std::string Politics::getCurrentKing() const { return currentKing; }
 void Politics::setCorrupted(bool val) { corrupted = val; }
 
+
+void Politics::serialize(BinaryWriter& out) const {
+    out.writeString(currentKing);
+    out.writeInt(candidateCount);
+    for (int i = 0; i < candidateCount; ++i) {
+        candidates[i].serialize(out);
+    }
+    out.writeBool(corrupted);
+}
+
+void Politics::deserialize(BinaryReader& in) {
+    currentKing = in.readString();
+    int count = in.readInt();
+    if (count < 0 || count > MAX_CANDIDATES) throw std::runtime_error("Corrupt save data: candidate count");
+    candidateCount = count;
+    for (int i = 0; i < candidateCount; ++i) {
+        candidates[i].deserialize(in);
+    }
+    corrupted = in.readBool();
+}
+
 // Corruption class
 Corruption::Corruption() : armyCorrupted(false), politicsCorrupted(false), blacksmithCorrupted(false) {}
 
-void Corruption::checkCorruption() {
-    if (rand() % 10 == 0) armyCorrupted = true;
-    if (rand() % 15 == 0) politicsCorrupted = true;
-    if (rand() % 12 == 0) blacksmithCorrupted = true;
+void Corruption::checkCorruption(Random& rng) {
+    if (rng.nextInt(10) == 0) armyCorrupted = true;
+    if (rng.nextInt(15) == 0) politicsCorrupted = true;
+    if (rng.nextInt(12) == 0) blacksmithCorrupted = true;
 }
 
-void Corruption::audit(Economy& econ, Army& army, Politics& politics, Blacksmith& blacksmith) {
-    try {
-        econ.spend(200);
-        if (armyCorrupted) {
-            armyCorrupted = false;
-            army.getGeneral().setCorrupted(false);
-            std::cout << GREEN << "Army corruption cleared.\n" << RESET;
-        }
-        if (politicsCorrupted) {
-            politicsCorrupted = false;
-            politics.setCorrupted(false);
-            for (int i = 0; i < politics.getCandidateCount(); ++i) {
-                politics.getCandidates()[i]->setCorrupted(false);
-            }
-            std::cout << GREEN << "Politics corruption cleared.\n" << RESET;
-        }
-        if (blacksmithCorrupted) {
-            blacksmithCorrupted = false;
-            blacksmith.setCorrupted(false);
-            std::cout << GREEN << "Blacksmith corruption cleared.\n" << RESET;
+ActionStatus Corruption::tryAudit(Economy& econ, Army& army, Politics& politics, Blacksmith& blacksmith) {
+    if (econ.trySpend(200) != STATUS_OK) return STATUS_AUDIT_FAILED;
+    if (armyCorrupted) {
+        armyCorrupted = false;
+        army.getGeneral().setCorrupted(false);
+        std::cout << GREEN << "Army corruption cleared.\n" << RESET;
+    }
+    if (politicsCorrupted) {
+        politicsCorrupted = false;
+        politics.setCorrupted(false);
+        for (int i = 0; i < politics.getCandidateCount(); ++i) {
+            politics.getCandidates()[i].setCorrupted(false);
         }
+        std::cout << GREEN << "Politics corruption cleared.\n" << RESET;
     }
-    catch (const InsufficientResourcesException& e) {
-        throw CorruptionException("Audit failed: " + std::string(e.what()));
+    if (blacksmithCorrupted) {
+        blacksmithCorrupted = false;
+        blacksmith.setCorrupted(false);
+        std::cout << GREEN << "Blacksmith corruption cleared.\n" << RESET;
     }
+    return STATUS_OK;
+}
+
+void Corruption::audit(Economy& econ, Army& army, Politics& politics, Blacksmith& blacksmith) {
+    requireSuccess(tryAudit(econ, army, politics, blacksmith));
+}
+
+
+void Corruption::serialize(BinaryWriter& out) const {
+    out.writeBool(armyCorrupted);
+    out.writeBool(politicsCorrupted);
+    out.writeBool(blacksmithCorrupted);
+}
+
+void Corruption::deserialize(BinaryReader& in) {
+    armyCorrupted = in.readBool();
+    politicsCorrupted = in.readBool();
+    blacksmithCorrupted = in.readBool();
 }
 
 // Bank class
@@ -320,35 +1030,39 @@ void Bank::takeLoan(Economy& econ, int amount) {
     std::cout << GREEN << "Took loan of " << amount << " gold.\n" << RESET;
 }
 
-void Bank::repayLoan(Economy& econ, int amount) {
-    if (loan < amount) throw InsufficientResourcesException("Cannot repay more than loan");
-    econ.spend(amount);
+ActionStatus Bank::tryRepayLoan(Economy& econ, int amount) {
+    if (loan < amount) return STATUS_LOAN_EXCEEDED;
+    ActionStatus status = econ.trySpend(amount);
+    if (status != STATUS_OK) return status;
     loan -= amount;
     std::cout << GREEN << "Repaid " << amount << " gold.\n" << RESET;
+    return STATUS_OK;
 }
 
-void Bank::checkCorruption() {
-    if (rand() % 20 == 0) {
+void Bank::repayLoan(Economy& econ, int amount) { requireSuccess(tryRepayLoan(econ, amount)); }
+
+void Bank::checkCorruption(Random& rng) {
+    if (rng.nextInt(20) == 0) {
         corrupted = true;
         std::cout << RED << "Bank corruption detected!\n" << RESET;
     }
 }
 
-void Bank::audit(Economy& econ) {
-    try {
-        econ.spend(100);
-        corrupted = false;
-        std::cout << GREEN << "Bank audit cleared corruption. Detailed report generated.\n" << RESET;
-    }
-    catch (const InsufficientResourcesException& e) {
-        throw CorruptionException("Bank audit failed: " + std::string(e.what()));
-    }
+ActionStatus Bank::tryAudit(Economy& econ) {
+    if (econ.trySpend(100) != STATUS_OK) return STATUS_BANK_AUDIT_FAILED;
+    corrupted = false;
+    std::cout << GREEN << "Bank audit cleared corruption. Detailed report generated.\n" << RESET;
+    return STATUS_OK;
 }
 
-void Bank::seizeLand(Economy& econ, Map& map) {
-    if (loan > 2000 && rand() % 5 == 0) {
+void Bank::audit(Economy& econ) { requireSuccess(tryAudit(econ)); }
+
+void Bank::seizeLand(Economy& econ, Map& map, Random& rng) {
+    if (loan > 2000 && rng.nextInt(5) == 0) {
         landSeized++;
-        map.capture("Bank", rand() % GRID_SIZE, rand() % GRID_SIZE);
+        int row = rng.nextInt(map.getRows());
+        int column = rng.nextInt(map.getColumns());
+        map.capture("Bank", row, column);
         econ.spend(econ.getGold() / 5);
         std::cout << RED << "Bank seized land due to unpaid loans!\n" << RESET;
     }
@@ -358,112 +1072,384 @@ int Bank::getLoan() const { return loan; }
 int Bank::getLandSeized() const { return landSeized; }
 bool Bank::isCorrupted() const { return corrupted; }
 
+
+void Bank::serialize(BinaryWriter& out) const {
+    out.writeInt(loan);
+    out.writeDouble(interestRate);
+    out.writeBool(corrupted);
+    out.writeInt(landSeized);
+}
+
+void Bank::deserialize(BinaryReader& in) {
+    loan = in.readInt();
+    interestRate = in.readDouble();
+    corrupted = in.readBool();
+    landSeized = in.readInt();
+}
+
 // Diplomacy class
-Diplomacy::Diplomacy() : allianceCount(0) {
-    alliances[0] = { "", false, false, false };
-    alliances[1] = { "", false, false, false };
+KingdomId DiplomacyGraph::addKingdom(const std::string& name) {
+    auto existing = ids.find(name);
+    if (existing != ids.end()) return existing->second;
+    if (names.size() >= static_cast<size_t>(MAX_KINGDOMS)) throw std::runtime_error("Too many kingdoms in diplomacy graph");
+    KingdomId id = static_cast<KingdomId>(names.size());
+    names.push_back(name);
+    ids.emplace(name, id);
+    rows.emplace_back();
+    return id;
+}
+
+KingdomId DiplomacyGraph::find(const std::string& name) const {
+    auto existing = ids.find(name);
+    return existing == ids.end() ? NO_KINGDOM : existing->second;
+}
+
+bool DiplomacyGraph::contains(KingdomId id) const { return id < names.size(); }
+const std::string& DiplomacyGraph::getName(KingdomId id) const { return names[id]; }
+int DiplomacyGraph::getKingdomCount() const { return static_cast<int>(names.size()); }
+
+void DiplomacyGraph::link(Relation relation, KingdomId a, KingdomId b) {
+    rows[a].relation[relation].set(b);
+    rows[b].relation[relation].set(a);
+}
+
+void DiplomacyGraph::unlink(Relation relation, KingdomId a, KingdomId b) {
+    rows[a].relation[relation].reset(b);
+    rows[b].relation[relation].reset(a);
+}
+
+void DiplomacyGraph::unlinkAll(KingdomId a, KingdomId b) {
+    for (int r = 0; r < RELATION_COUNT; ++r) unlink(static_cast<Relation>(r), a, b);
+}
+
+bool DiplomacyGraph::has(Relation relation, KingdomId a, KingdomId b) const {
+    return a < rows.size() && b < rows.size() && rows[a].relation[relation].test(b);
+}
+
+const std::bitset<MAX_KINGDOMS>& DiplomacyGraph::neighbours(Relation relation, KingdomId id) const {
+    return rows[id].relation[relation];
+}
+
+int DiplomacyGraph::degree(Relation relation, KingdomId id) const {
+    return static_cast<int>(rows[id].relation[relation].count());
+}
+
+Diplomacy::Diplomacy(const std::string& owner) : graph(std::make_shared<DiplomacyGraph>()), forked(false), standalone(true) {
+    self = graph->addKingdom(owner);
+}
+
+Diplomacy::Diplomacy(const std::string& owner, const std::shared_ptr<DiplomacyGraph>& shared)
+    : graph(shared), forked(false), standalone(false) {
+    self = graph->addKingdom(owner);
+}
+
+DiplomacyGraph& Diplomacy::edit() {
+    if (forked) {
+        graph = std::make_shared<DiplomacyGraph>(*graph);
+        forked = false;
+    }
+    return *graph;
+}
+
+void Diplomacy::fork() { forked = true; }
+
+KingdomId Diplomacy::resolve(const std::string& kingdom) {
+    KingdomId id = graph->find(kingdom);
+    return id == NO_KINGDOM && standalone ? edit().addKingdom(kingdom) : id;
+}
+
+void Diplomacy::attach(const std::shared_ptr<DiplomacyGraph>& shared) {
+    if (shared == graph) return;
+    // Carry this kingdom's existing relations over to the shared graph, except with kingdoms it does not know
+    KingdomId id = shared->addKingdom(graph->getName(self));
+    for (int r = 0; r < RELATION_COUNT; ++r) {
+        const std::bitset<MAX_KINGDOMS>& row = graph->neighbours(static_cast<Relation>(r), self);
+        for (int other = 0; other < graph->getKingdomCount(); ++other) {
+            KingdomId target = row.test(other) ? shared->find(graph->getName(other)) : NO_KINGDOM;
+            if (target != NO_KINGDOM && target != id) shared->link(static_cast<Relation>(r), id, target);
+        }
+    }
+    graph = shared;
+    self = id;
+    forked = false;
+    standalone = false;
+}
+
+void Diplomacy::setOwner(const std::string& owner) {
+    KingdomId id = resolve(owner);
+    if (id == NO_KINGDOM) throw std::runtime_error("Kingdom " + owner + " is not part of this world");
+    self = id;
 }
 
 void Diplomacy::formAlliance(const std::string& kingdom) {
-    if (allianceCount < 2) {
-        alliances[allianceCount++] = { kingdom, true, false, false };
-        std::cout << GREEN << "Alliance formed with " << kingdom << "!\n" << RESET;
+    formAlliance(resolve(kingdom));
+}
+
+ActionStatus Diplomacy::tryFormAlliance(KingdomId other) {
+    if (!graph->contains(other) || other == self) return STATUS_INVALID_TARGET;
+    const std::string& kingdom = graph->getName(other);
+    if (graph->has(RELATION_ALLIANCE, self, other)) {
+        std::cout << YELLOW << "Already allied with " << kingdom << ".\n" << RESET;
     }
-    else {
+    else if (graph->degree(RELATION_ALLIANCE, self) >= MAX_ALLIANCES) {
         std::cout << RED << "Cannot form more alliances.\n" << RESET;
     }
+    else if (graph->degree(RELATION_ALLIANCE, other) >= MAX_ALLIANCES) {
+        std::cout << RED << kingdom << " cannot form more alliances.\n" << RESET;
+    }
+    else {
+        edit().link(RELATION_ALLIANCE, self, other);
+        std::cout << GREEN << "Alliance formed with " << kingdom << "!\n" << RESET;
+    }
+    return STATUS_OK;
 }
 
+void Diplomacy::formAlliance(KingdomId other) { requireSuccess(tryFormAlliance(other)); }
+
 void Diplomacy::breakAlliance(const std::string& kingdom) {
-    for (int i = 0; i < allianceCount; ++i) {
-        if (alliances[i].kingdom == kingdom) {
-            alliances[i].active = false;
-            alliances[i].trade = false;
-            alliances[i].secureRoute = false;
-            std::cout << YELLOW << "Alliance broken with " << kingdom << ".\n" << RESET;
-            return;
-        }
+    KingdomId other = graph->find(kingdom);
+    if (!graph->has(RELATION_ALLIANCE, self, other)) {
+        std::cout << RED << "No alliance with " << kingdom << ".\n" << RESET;
+        return;
     }
-    std::cout << RED << "No alliance with " << kingdom << ".\n" << RESET;
+    breakAlliance(other);
 }
 
-void Diplomacy::formTradeAgreement(const std::string& kingdom) {
-    for (int i = 0; i < allianceCount; ++i) {
-        if (alliances[i].kingdom == kingdom && alliances[i].active) {
-            alliances[i].trade = true;
-            std::cout << GREEN << "Trade agreement formed with " << kingdom << "!\n" << RESET;
-            return;
-        }
+ActionStatus Diplomacy::tryBreakAlliance(KingdomId other) {
+    if (!graph->contains(other)) return STATUS_INVALID_TARGET;
+    if (!graph->has(RELATION_ALLIANCE, self, other)) {
+        std::cout << RED << "No alliance with " << graph->getName(other) << ".\n" << RESET;
+        return STATUS_OK;
     }
-    throw InsufficientResourcesException("No alliance exists");
+    edit().unlinkAll(self, other);
+    std::cout << YELLOW << "Alliance broken with " << graph->getName(other) << ".\n" << RESET;
+    return STATUS_OK;
+}
+
+void Diplomacy::breakAlliance(KingdomId other) { requireSuccess(tryBreakAlliance(other)); }
+
+void Diplomacy::formTradeAgreement(const std::string& kingdom) {
+    requireSuccess(tryFormTradeAgreement(graph->find(kingdom)));
+}
+
+ActionStatus Diplomacy::tryFormTradeAgreement(KingdomId other) {
+    if (!graph->has(RELATION_ALLIANCE, self, other)) return STATUS_NO_ALLIANCE;
+    edit().link(RELATION_TRADE, self, other);
+    std::cout << GREEN << "Trade agreement formed with " << graph->getName(other) << "!\n" << RESET;
+    return STATUS_OK;
 }
 
+void Diplomacy::formTradeAgreement(KingdomId other) { requireSuccess(tryFormTradeAgreement(other)); }
+
 void Diplomacy::establishSecureRoute(const std::string& kingdom) {
-    for (int i = 0; i < allianceCount; ++i) {
-        if (alliances[i].kingdom == kingdom && alliances[i].active) {
-            alliances[i].secureRoute = true;
-            std::cout << GREEN << "Secure trade route established with " << kingdom << "!\n" << RESET;
-            return;
-        }
-    }
-    throw InsufficientResourcesException("No alliance exists");
+    requireSuccess(tryEstablishSecureRoute(graph->find(kingdom)));
 }
 
+ActionStatus Diplomacy::tryEstablishSecureRoute(KingdomId other) {
+    if (!graph->has(RELATION_ALLIANCE, self, other)) return STATUS_NO_ALLIANCE;
+    edit().link(RELATION_SECURE_ROUTE, self, other);
+    std::cout << GREEN << "Secure trade route established with " << graph->getName(other) << "!\n" << RESET;
+    return STATUS_OK;
+}
+
+void Diplomacy::establishSecureRoute(KingdomId other) { requireSuccess(tryEstablishSecureRoute(other)); }
+
 void Diplomacy::handleEspionageFailure(const std::string& sourceKingdom) {
-    for (int i = 0; i < allianceCount; ++i) {
-        if (alliances[i].kingdom == sourceKingdom) {
-            alliances[i].active = false;
-            alliances[i].trade = false;
-            alliances[i].secureRoute = false;
-            std::cout << RED << "Espionage detected! All alliances and trade agreements with "
-                << sourceKingdom << " are broken!\n" << RESET;
-            return;
-        }
+    handleEspionageFailure(graph->find(sourceKingdom));
+}
+
+void Diplomacy::handleEspionageFailure(KingdomId source) {
+    if (!graph->contains(source) || source == self) return;
+    bool related = false;
+    for (int r = 0; r < RELATION_COUNT; ++r) related = related || graph->has(static_cast<Relation>(r), self, source);
+    if (!related) return;
+    edit().unlinkAll(self, source);
+    std::cout << RED << "Espionage detected! All alliances and trade agreements with "
+        << graph->getName(source) << " are broken!\n" << RESET;
+}
+
+bool Diplomacy::hasAlliance(const std::string& kingdom) const { return hasAlliance(graph->find(kingdom)); }
+bool Diplomacy::hasAlliance(KingdomId other) const {
+    return graph->contains(other) && graph->has(RELATION_ALLIANCE, self, other);
+}
+
+bool Diplomacy::hasSecureRoute(const std::string& kingdom) const { return hasSecureRoute(graph->find(kingdom)); }
+bool Diplomacy::hasSecureRoute(KingdomId other) const {
+    return graph->contains(other) && graph->has(RELATION_SECURE_ROUTE, self, other);
+}
+
+int Diplomacy::getAllianceCount() const { return graph->degree(RELATION_ALLIANCE, self); }
+const std::bitset<MAX_KINGDOMS>& Diplomacy::getAllies() const { return graph->neighbours(RELATION_ALLIANCE, self); }
+DiplomacyGraph& Diplomacy::getGraph() { return edit(); }
+const DiplomacyGraph& Diplomacy::getGraph() const { return *graph; }
+KingdomId Diplomacy::getId() const { return self; }
+
+void Diplomacy::serialize(BinaryWriter& out) const {
+    // Same layout as the old alliance table: one entry per related kingdom
+    std::bitset<MAX_KINGDOMS> related;
+    for (int r = 0; r < RELATION_COUNT; ++r) related |= graph->neighbours(static_cast<Relation>(r), self);
+    out.writeInt(static_cast<int>(related.count()));
+    for (int other = 0; other < graph->getKingdomCount(); ++other) {
+        if (!related.test(other)) continue;
+        out.writeString(graph->getName(other));
+        out.writeBool(graph->has(RELATION_ALLIANCE, self, other));
+        out.writeBool(graph->has(RELATION_TRADE, self, other));
+        out.writeBool(graph->has(RELATION_SECURE_ROUTE, self, other));
     }
 }
 
-bool Diplomacy::hasAlliance(const std::string& kingdom) const {
-    for (int i = 0; i < allianceCount; ++i) {
-        if (alliances[i].kingdom == kingdom && alliances[i].active) return true;
+void Diplomacy::deserialize(BinaryReader& in) {
+    int count = in.readInt();
+    if (count < 0 || count > MAX_KINGDOMS) throw std::runtime_error("Corrupt save data: alliance count");
+    // Every saved kingdom is resolved before any relation changes, so a rejected name changes nothing
+    struct Saved {
+        KingdomId other;
+        bool alliance;
+        bool trade;
+        bool secureRoute;
+    };
+    std::vector<Saved> saved(count);
+    for (Saved& entry : saved) {
+        std::string name = in.readString();
+        entry.alliance = in.readBool();
+        entry.trade = in.readBool();
+        entry.secureRoute = in.readBool();
+        entry.other = resolve(name);
+        if (entry.other == NO_KINGDOM) throw std::runtime_error("Saved relations name a kingdom not in this world: " + name);
+    }
+    for (int other = 0; other < graph->getKingdomCount(); ++other) {
+        if (other != self) edit().unlinkAll(self, static_cast<KingdomId>(other));
+    }
+    for (const Saved& entry : saved) {
+        if (entry.other == self) continue;
+        if (entry.alliance) edit().link(RELATION_ALLIANCE, self, entry.other);
+        if (entry.trade) edit().link(RELATION_TRADE, self, entry.other);
+        if (entry.secureRoute) edit().link(RELATION_SECURE_ROUTE, self, entry.other);
     }
-    return false;
 }
 
-bool Diplomacy::hasSecureRoute(const std::string& kingdom) const {
-    for (int i = 0; i < allianceCount; ++i) {
-        if (alliances[i].kingdom == kingdom && alliances[i].secureRoute) return true;
+// Communication class
+Mailbox::Mailbox(size_t capacity) : slots(std::max<size_t>(capacity, 1)), start(0), count(0), dropped(0) {}
+
+bool Mailbox::push(const Message& message) {
+    if (count < slots.size()) {
+        slots[(start + count++) % slots.size()] = message;
+        return true;
     }
+    slots[start] = message;
+    start = (start + 1) % slots.size();
+    dropped++;
     return false;
 }
 
-int Diplomacy::getAllianceCount() const {
-    int count = 0;
-    for (int i = 0; i < allianceCount; ++i) {
-        if (alliances[i].active) count++;
+const Message& Mailbox::at(size_t index) const { return slots[(start + index) % slots.size()]; }
+size_t Mailbox::size() const { return count; }
+size_t Mailbox::capacity() const { return slots.size(); }
+uint64_t Mailbox::getDropped() const { return dropped; }
+void Mailbox::setDropped(uint64_t count) { dropped = count; }
+
+PostOffice::PostOffice(size_t capacity) : capacity(capacity) {}
+
+KingdomId PostOffice::registerRecipient(const std::string& name) {
+    auto existing = ids.find(name);
+    if (existing != ids.end()) return existing->second;
+    if (names.size() >= static_cast<size_t>(MAX_KINGDOMS)) throw std::runtime_error("Too many post office recipients");
+    KingdomId id = static_cast<KingdomId>(names.size());
+    inboxes.push_back(std::make_unique<MpscQueue<Message>>(capacity));
+    names.push_back(name);
+    ids.emplace(name, id);
+    return id;
+}
+
+KingdomId PostOffice::find(const std::string& name) const {
+    auto existing = ids.find(name);
+    return existing == ids.end() ? NO_KINGDOM : existing->second;
+}
+
+bool PostOffice::knows(const std::string& name) const { return ids.find(name) != ids.end(); }
+bool PostOffice::knows(KingdomId recipient) const { return recipient < inboxes.size(); }
+const std::string& PostOffice::getName(KingdomId recipient) const { return names[recipient]; }
+
+bool PostOffice::post(const Message& message) { return post(find(message.recipient), message); }
+
+bool PostOffice::post(KingdomId recipient, const Message& message) {
+    return knows(recipient) && inboxes[recipient]->tryPush(message);
+}
+
+int PostOffice::collect(const std::string& recipient, Communication& into) { return collect(find(recipient), into); }
+
+int PostOffice::collect(KingdomId recipient, Communication& into) {
+    if (!knows(recipient)) return 0;
+    int collected = 0;
+    Message message;
+    while (inboxes[recipient]->tryPop(message)) {
+        into.receive(message);
+        collected++;
     }
-    return count;
+    return collected;
 }
 
-// Communication class
-Communication::Communication() : messageCount(0) {}
+Communication::Communication(size_t capacity)
+    : capacity(capacity), postOffice(nullptr), isolated(false) {}
+
+void Communication::attach(PostOffice* office) {
+    postOffice = office;
+    isolated = false;
+}
+
+void Communication::isolate() { isolated = true; }
+
+Mailbox& Communication::mailboxFor(const std::string& recipient) {
+    // The table is made on the first message, so a kingdom that never hears from anyone costs nothing
+    if (!mailboxes) mailboxes = std::make_shared<std::unordered_map<std::string, Mailbox>>();
+    auto mailbox = mailboxes->find(recipient);
+    if (mailbox == mailboxes->end()) mailbox = mailboxes->emplace(recipient, Mailbox(capacity)).first;
+    return mailbox->second;
+}
 
 void Communication::sendMessage(const std::string& recipient, const std::string& message, bool isFake) {
-    if (messageCount < MAX_MESSAGES) {
-        messages[messageCount++] = { recipient, message, isFake };
-        std::cout << GREEN << "Message sent to " << recipient << ": " << message
-            << (isFake ? " (fake)" : "") << "\n" << RESET;
+    Message letter = { recipient, message, isFake };
+    deliver(letter, postOffice && !isolated ? postOffice->find(recipient) : NO_KINGDOM);
+}
+
+ActionStatus Communication::trySendMessage(KingdomId recipient, const std::string& message, bool isFake) {
+    if (!postOffice || !postOffice->knows(recipient)) return STATUS_UNKNOWN_RECIPIENT;
+    Message letter = { postOffice->getName(recipient), message, isFake };
+    deliver(letter, isolated ? NO_KINGDOM : recipient);
+    return STATUS_OK;
+}
+
+void Communication::sendMessage(KingdomId recipient, const std::string& message, bool isFake) {
+    requireSuccess(trySendMessage(recipient, message, isFake));
+}
+
+void Communication::deliver(const Message& letter, KingdomId recipient) {
+    if (recipient != NO_KINGDOM) {
+        // Another kingdom: hand it to the shared post office, the recipient collects it when reading
+        if (!postOffice->post(recipient, letter)) {
+            std::cout << RED << "Mailbox for " << letter.recipient << " is full.\n" << RESET;
+            return;
+        }
     }
-    else {
-        std::cout << RED << "Message limit reached.\n" << RESET;
+    else if (!receive(letter)) {
+        std::cout << YELLOW << "Mailbox for " << letter.recipient << " is full; oldest message dropped.\n" << RESET;
     }
+    std::cout << GREEN << "Message sent to " << letter.recipient << ": " << letter.content
+        << (letter.isFake ? " (fake)" : "") << "\n" << RESET;
+}
+
+bool Communication::receive(const Message& message) {
+    return mailboxFor(message.recipient).push(message);
 }
 
 void Communication::viewMessages(const std::string& kingdom) {
+    if (postOffice && !isolated) postOffice->collect(kingdom, *this);
     std::cout << YELLOW << "Messages for " << kingdom << ":\n" << RESET;
-    for (int i = 0; i < messageCount; ++i) {
-        if (messages[i].recipient == kingdom) {
-            std::cout << messages[i].content << (messages[i].isFake ? " (FAKE)" : "") << "\n";
-        }
+    const Mailbox* mailbox = getMailbox(kingdom);
+    if (!mailbox) return;
+    for (size_t i = 0; i < mailbox->size(); ++i) {
+        const Message& message = mailbox->at(i);
+        std::cout << message.content << (message.isFake ? " (FAKE)" : "") << "\n";
     }
 }
 
@@ -471,113 +1457,274 @@ void Communication::sendFakeTradeRequest(const std::string& recipient) {
     sendMessage(recipient, "Trade Request: 100 Iron for 200 Gold", true);
 }
 
+ActionStatus Communication::trySendFakeTradeRequest(KingdomId recipient) {
+    return trySendMessage(recipient, "Trade Request: 100 Iron for 200 Gold", true);
+}
+
+void Communication::sendFakeTradeRequest(KingdomId recipient) { requireSuccess(trySendFakeTradeRequest(recipient)); }
+
+const Mailbox* Communication::getMailbox(const std::string& recipient) const {
+    if (!mailboxes) return nullptr;
+    auto mailbox = mailboxes->find(recipient);
+    return mailbox == mailboxes->end() ? nullptr : &mailbox->second;
+}
+
+void Communication::serialize(BinaryWriter& out) const {
+    // Mailboxes are written in name order so identical states give identical bytes
+    std::vector<const std::string*> names;
+    if (mailboxes) {
+        for (const auto& entry : *mailboxes) names.push_back(&entry.first);
+    }
+    std::sort(names.begin(), names.end(), [](const std::string* a, const std::string* b) { return *a < *b; });
+    out.writeUInt(static_cast<uint32_t>(capacity));
+    out.writeUInt(static_cast<uint32_t>(names.size()));
+    for (const std::string* name : names) {
+        const Mailbox& mailbox = mailboxes->at(*name);
+        out.writeString(*name);
+        out.writeUInt64(mailbox.getDropped());
+        out.writeUInt(static_cast<uint32_t>(mailbox.size()));
+        for (size_t i = 0; i < mailbox.size(); ++i) {
+            out.writeString(mailbox.at(i).content);
+            out.writeBool(mailbox.at(i).isFake);
+        }
+    }
+}
+
+void Communication::deserialize(BinaryReader& in, uint32_t version) {
+    mailboxes.reset();
+    if (version < 2) {
+        // Version 1 stored a flat array of up to MAX_MESSAGES messages
+        int count = in.readInt();
+        if (count < 0 || count > MAX_MESSAGES) throw std::runtime_error("Corrupt save data: message count");
+        for (int i = 0; i < count; ++i) {
+            Message message;
+            message.recipient = in.readString();
+            message.content = in.readString();
+            message.isFake = in.readBool();
+            receive(message);
+        }
+        return;
+    }
+    uint32_t savedCapacity = in.readUInt();
+    if (savedCapacity == 0 || savedCapacity > (1u << 20)) throw std::runtime_error("Corrupt save data: mailbox capacity");
+    capacity = savedCapacity;
+    uint32_t mailboxCount = in.readUInt();
+    for (uint32_t m = 0; m < mailboxCount; ++m) {
+        std::string recipient = in.readString();
+        uint64_t dropped = in.readUInt64();
+        uint32_t count = in.readUInt();
+        if (count > capacity) throw std::runtime_error("Corrupt save data: message count");
+        Mailbox& mailbox = mailboxFor(recipient);
+        for (uint32_t i = 0; i < count; ++i) {
+            Message message;
+            message.recipient = recipient;
+            message.content = in.readString();
+            message.isFake = in.readBool();
+            mailbox.push(message);
+        }
+        mailbox.setDropped(dropped);
+    }
+}
+
 // Healthcare class
 Healthcare::Healthcare() : level(1), isBuilding(false), satisfactionBoost(0.05), plagueReduction(0.1) {}
 
-void Healthcare::build(Economy& econ, Resource<int>& wood, Resource<int>& stone) {
-    if (isBuilding) throw InsufficientResourcesException("Hospital already under construction");
-    if (econ.getGold() < 500 || wood.get() < 100 || stone.get() < 100)
-        throw InsufficientResourcesException("Insufficient resources");
-    econ.spend(500);
-    wood.adjust(-100);
-    stone.adjust(-100);
+static const ResourceBundle HOSPITAL_COST = ResourceBundle().withGold(500).with(WOOD, 100).with(STONE, 100);
+
+ActionStatus Healthcare::checkBuild(const Economy& econ, const Resource<int>* stock) const {
+    if (isBuilding) return STATUS_HOSPITAL_UNDER_CONSTRUCTION;
+    return HOSPITAL_COST.coveredBy(stock, &econ) ? STATUS_OK : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+ActionStatus Healthcare::tryBuild(Economy& econ, Resource<int>* stock) {
+    if (isBuilding) return STATUS_HOSPITAL_UNDER_CONSTRUCTION;
+    ActionStatus status = HOSPITAL_COST.tryWithdraw(stock, &econ);
+    if (status != STATUS_OK) return status;
     isBuilding = true;
     std::cout << "Building hospital...\n";
-    std::this_thread::sleep_for(std::chrono::seconds(5));
+    activeClock().wait(5);
     level++;
     satisfactionBoost += 0.02;
     plagueReduction += 0.05;
     isBuilding = false;
     std::cout << GREEN << "Hospital built! Level: " << level << RESET << "\n";
+    return STATUS_OK;
 }
 
+void Healthcare::build(Economy& econ, Resource<int>* stock) { requireSuccess(tryBuild(econ, stock)); }
+
 void Healthcare::provideServices(Population& pop) {
     pop.adjustMorale(satisfactionBoost);
     std::cout << GREEN << "Healthcare services boosted morale by " << satisfactionBoost << RESET << "\n";
 }
 
-void Healthcare::manageHealthcare(int choice, Economy& econ, Resource<int>& wood, Resource<int>& stone, Population& pop) {
-    if (choice == 1) {
-        build(econ, wood, stone);
-    }
-    else if (choice == 2) {
-        provideServices(pop);
-    }
-    else {
-        throw InsufficientResourcesException("Invalid healthcare choice");
-    }
+ActionStatus Healthcare::tryManageHealthcare(int choice, Economy& econ, Resource<int>* stock, Population& pop) {
+    if (choice == 1) return tryBuild(econ, stock);
+    if (choice != 2) return STATUS_INVALID_HEALTHCARE_CHOICE;
+    provideServices(pop);
+    return STATUS_OK;
+}
+
+void Healthcare::manageHealthcare(int choice, Economy& econ, Resource<int>* stock, Population& pop) {
+    requireSuccess(tryManageHealthcare(choice, econ, stock, pop));
 }
 
 int Healthcare::getLevel() const { return level; }
 double Healthcare::getPlagueReduction() const { return plagueReduction; }
 
+
+void Healthcare::serialize(BinaryWriter& out) const {
+    out.writeInt(level);
+    out.writeBool(isBuilding);
+    out.writeDouble(satisfactionBoost);
+    out.writeDouble(plagueReduction);
+}
+
+void Healthcare::deserialize(BinaryReader& in) {
+    level = in.readInt();
+    isBuilding = in.readBool();
+    satisfactionBoost = in.readDouble();
+    plagueReduction = in.readDouble();
+}
+
 // Buildings class
 Buildings::Buildings() : barracksLevel(0), isBuilding(false), trainingEfficiency(1.0) {}
 
-void Buildings::buildBarracks(Economy& econ, Resource<int>& wood, Resource<int>& stone) {
-    if (isBuilding) throw InsufficientResourcesException("Barracks already under construction");
-    if (econ.getGold() < 400 || wood.get() < 150 || stone.get() < 150)
-        throw InsufficientResourcesException("Insufficient resources");
-    econ.spend(400);
-    wood.adjust(-150);
-    stone.adjust(-150);
+static const ResourceBundle BARRACKS_COST = ResourceBundle().withGold(400).with(WOOD, 150).with(STONE, 150);
+
+ActionStatus Buildings::checkBuildBarracks(const Economy& econ, const Resource<int>* stock) const {
+    if (isBuilding) return STATUS_BARRACKS_UNDER_CONSTRUCTION;
+    return BARRACKS_COST.coveredBy(stock, &econ) ? STATUS_OK : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+ActionStatus Buildings::tryBuildBarracks(Economy& econ, Resource<int>* stock) {
+    if (isBuilding) return STATUS_BARRACKS_UNDER_CONSTRUCTION;
+    ActionStatus status = BARRACKS_COST.tryWithdraw(stock, &econ);
+    if (status != STATUS_OK) return status;
     isBuilding = true;
     std::cout << "Building barracks...\n";
-    std::this_thread::sleep_for(std::chrono::seconds(5));
+    activeClock().wait(5);
     barracksLevel++;
     trainingEfficiency *= 0.9;
     isBuilding = false;
     std::cout << GREEN << "Barracks built! Level: " << barracksLevel << RESET << "\n";
+    return STATUS_OK;
 }
 
-void Buildings::manageBuildings(int choice, Economy& econ, Resource<int>& wood, Resource<int>& stone) {
-    if (choice == 1) {
-        buildBarracks(econ, wood, stone);
-    }
-    else {
-        throw InsufficientResourcesException("Invalid buildings choice");
-    }
+void Buildings::buildBarracks(Economy& econ, Resource<int>* stock) { requireSuccess(tryBuildBarracks(econ, stock)); }
+
+ActionStatus Buildings::tryManageBuildings(int choice, Economy& econ, Resource<int>* stock) {
+    return choice == 1 ? tryBuildBarracks(econ, stock) : STATUS_INVALID_BUILDINGS_CHOICE;
+}
+
+void Buildings::manageBuildings(int choice, Economy& econ, Resource<int>* stock) {
+    requireSuccess(tryManageBuildings(choice, econ, stock));
 }
 
 int Buildings::getBarracksLevel() const { return barracksLevel; }
 double Buildings::getTrainingEfficiency() const { return trainingEfficiency; }
 
+
+void Buildings::serialize(BinaryWriter& out) const {
+    out.writeInt(barracksLevel);
+    out.writeBool(isBuilding);
+    out.writeDouble(trainingEfficiency);
+}
+
+void Buildings::deserialize(BinaryReader& in) {
+    barracksLevel = in.readInt();
+    isBuilding = in.readBool();
+    trainingEfficiency = in.readDouble();
+}
+
 // Weather class
-Weather::Weather() : season("Spring"), currentWeather("Clear"), turnCount(0) {}
+WeatherModel::WeatherModel() {
+    // Default chain ignores the previous state: 30% clear, 30% rain, 20% snow, 20% flood
+    const double uniform[WEATHER_COUNT] = { 0.3, 0.3, 0.2, 0.2 };
+    for (int season = 0; season < SEASON_COUNT; ++season) {
+        for (int from = 0; from < WEATHER_COUNT; ++from) {
+            setTransitions(static_cast<Season>(season), static_cast<WeatherState>(from), uniform);
+        }
+    }
+}
 
-void Weather::updateWeather() {
-    turnCount++;
-    if (turnCount % 4 == 0) season = "Spring";
-    else if (turnCount % 4 == 1) season = "Summer";
-    else if (turnCount % 4 == 2) season = "Autumn";
-    else season = "Winter";
-    int randWeather = rand() % 10;
-    if (randWeather < 3) currentWeather = "Clear";
-    else if (randWeather < 6) currentWeather = "Rain";
-    else if (randWeather < 8) currentWeather = "Snow";
-    else currentWeather = "Flood";
-    std::cout << YELLOW << "Season: " << season << ", Weather: " << currentWeather << RESET << "\n";
+void WeatherModel::setTransitions(Season season, WeatherState from, const double probabilities[WEATHER_COUNT]) {
+    const uint64_t sampleRange = uint64_t(1) << 32;
+    double total = 0.0;
+    for (int to = 0; to < WEATHER_COUNT; ++to) {
+        if (!(probabilities[to] >= 0.0)) throw std::invalid_argument("Weather transition weights must not be negative");
+        total += probabilities[to];
+    }
+    if (total <= 0.0) throw std::invalid_argument("Weather transition row must have positive weight");
+    // Every sample from the last weighted state up stays there, however the cumulative sum rounds
+    int last = WEATHER_COUNT - 1;
+    while (probabilities[last] <= 0.0) --last;
+    double cumulative = 0.0;
+    for (int to = 0; to < WEATHER_COUNT - 1; ++to) {
+        cumulative += probabilities[to] / total;
+        double scaled = std::ceil(cumulative * 4294967296.0);
+        thresholds[season][from][to] = (to >= last || scaled >= 4294967296.0) ? sampleRange : static_cast<uint64_t>(scaled);
+    }
+}
+
+void WeatherModel::setTransitions(Season season, const double matrix[WEATHER_COUNT][WEATHER_COUNT]) {
+    for (int from = 0; from < WEATHER_COUNT; ++from) {
+        setTransitions(season, static_cast<WeatherState>(from), matrix[from]);
+    }
+}
+
+WeatherState WeatherModel::next(Season season, WeatherState from, uint32_t sample) const {
+    const uint64_t* row = thresholds[season][from];
+    return static_cast<WeatherState>((sample >= row[0]) + (sample >= row[1]) + (sample >= row[2]));
+}
+
+const WeatherModel& WeatherModel::standard() {
+    static const WeatherModel model;
+    return model;
 }
 
-int Weather::getFoodImpact() const {
-    if (currentWeather == "Flood") return -200;
-    if (currentWeather == "Rain" && season == "Spring") return 150;
-    return 0;
+Weather::Weather(const WeatherModel* model) : model(model), turnCount(0), season(SPRING), currentWeather(CLEAR) {}
+
+void Weather::updateWeather(Random& rng) {
+    turnCount++;
+    season = static_cast<Season>(turnCount % SEASON_COUNT);
+    currentWeather = model->next(season, currentWeather, rng.next());
+    std::cout << YELLOW << "Season: " << SEASON_NAMES[season] << ", Weather: " << WEATHER_NAMES[currentWeather] << RESET << "\n";
 }
 
-int Weather::getDelayImpact() const {
-    return (currentWeather == "Snow") ? 1 : 0;
+void Weather::setModel(const WeatherModel* newModel) { model = newModel; }
+int Weather::getFoodImpact() const { return WEATHER_FOOD_IMPACT[season][currentWeather]; }
+int Weather::getDelayImpact() const { return WEATHER_DELAY_IMPACT[currentWeather]; }
+Season Weather::getSeasonId() const { return season; }
+WeatherState Weather::getWeatherId() const { return currentWeather; }
+const char* Weather::getSeason() const { return SEASON_NAMES[season]; }
+const char* Weather::getWeather() const { return WEATHER_NAMES[currentWeather]; }
+
+
+void Weather::serialize(BinaryWriter& out) const {
+    out.writeInt(turnCount);
+    out.writeByte(season);
+    out.writeByte(currentWeather);
 }
 
-std::string Weather::getSeason() const { return season; }
-std::string Weather::getWeather() const { return currentWeather; }
+void Weather::deserialize(BinaryReader& in) {
+    turnCount = in.readInt();
+    uint8_t savedSeason = in.readByte();
+    uint8_t savedWeather = in.readByte();
+    if (savedSeason >= SEASON_COUNT || savedWeather >= WEATHER_COUNT) throw std::runtime_error("Corrupt save data: weather");
+    season = static_cast<Season>(savedSeason);
+    currentWeather = static_cast<WeatherState>(savedWeather);
+}
 
 // Inflation class
 Inflation::Inflation() : rate(1.0) {}
 
-void Inflation::update(Economy& econ, Bank& bank) {
+void Inflation::update(Economy& econ, Bank& bank, const Market& market) {
     if (econ.isProgressiveTax() || bank.getLoan() > 1000) rate += 0.05;
     if (econ.getDebtReliance() > 1000) rate += 0.1;
+    // Sustained price pressure: food averaging well above its base price over the window
+    const PriceHistory& food = market.getHistory(FOOD);
+    if (food.size() >= food.getWindow() && food.movingAverage() > BASE_PRICES[FOOD] * rate * 1.25) rate += 0.02;
     if (rate > 2.0) {
         std::cout << RED << "Bankruptcy! Gold devalued, morale drops.\n" << RESET;
         econ.spend(static_cast<int>(econ.getGold() * 0.5));
@@ -587,506 +1734,3570 @@ void Inflation::update(Economy& econ, Bank& bank) {
 
 double Inflation::getRate() const { return rate; }
 
+
+void Inflation::serialize(BinaryWriter& out) const { out.writeDouble(rate); }
+void Inflation::deserialize(BinaryReader& in) { rate = in.readDouble(); }
+
 // Map class
 Map::Map() {
-    for (int i = 0; i < GRID_SIZE; ++i) {
-        for (int j = 0; j < GRID_SIZE; ++j) {
-            grid[i][j] = '.';
-        }
-    }
-    grid[0][0] = 'S';  // Stronghold
-    grid[4][4] = 'I';  // Ironhold
+    reset(GRID_SIZE, GRID_SIZE);
+    setOwner(0, 0, registerOwner("Stronghold"));
+    setOwner(GRID_SIZE - 1, GRID_SIZE - 1, registerOwner("Ironhold"));
 }
 
-void Map::display() const {
-    std::cout << YELLOW << "Map:\n";
-    for (int i = 0; i < GRID_SIZE; ++i) {
-        for (int j = 0; j < GRID_SIZE; ++j) {
-            std::cout << grid[i][j] << " ";
-        }
-        std::cout << "\n";
-    }
-    std::cout << RESET;
+Map::Map(int rows, int columns) {
+    reset(rows, columns);
 }
 
-void Map::capture(const std::string& kingdom, int x, int y) {
-    if (x >= 0 && x < GRID_SIZE && y >= 0 && y < GRID_SIZE) {
-        grid[x][y] = kingdom[0];
-    }
+void Map::reset(int mapRows, int mapColumns) {
+    if (mapRows <= 0 || mapColumns <= 0) throw std::runtime_error("Invalid map size");
+    rows = mapRows;
+    columns = mapColumns;
+    chunkColumns = (columns + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    int chunkRows = (rows + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    chunks.clear();
+    chunks.resize(static_cast<size_t>(chunkRows) * chunkColumns);
+    ownerNames.assign(1, "");
+    ownerSymbols.assign(1, '.');
+    ownerTiles.assign(1, static_cast<int64_t>(rows) * columns);
+    ownerChunks.assign(1, std::vector<int>());
+    ownerIds.clear();
+    touchedChunks.clear();
+    viewRow = 0;
+    viewColumn = 0;
 }
 
-void Map::enemyAttack(Resource<int>& resource) {
-    if (rand() % 10 < 3) {
-        int loss = resource.get() / 5;
-        resource.adjust(-loss);
-        std::cout << RED << "Enemy attack! Lost " << loss << " resources.\n" << RESET;
+char Map::pickSymbol(const std::string& name) const {
+    // Prefer the owner's initial, but never reuse a symbol another owner already shows
+    std::string candidates;
+    if (!name.empty()) {
+        candidates += static_cast<char>(std::toupper(static_cast<unsigned char>(name[0])));
+        candidates += static_cast<char>(std::tolower(static_cast<unsigned char>(name[0])));
     }
+    candidates += "ABCDEFGHJKLMNOPQRSTUVWXYZabcdefghjkmnopqrstuvwxyz0123456789#@%&*+=?";
+    for (char symbol : candidates) {
+        if (std::isprint(static_cast<unsigned char>(symbol)) && symbol != '.' && symbol != ' ' &&
+            std::find(ownerSymbols.begin(), ownerSymbols.end(), symbol) == ownerSymbols.end())
+            return symbol;
+    }
+    return '?';
 }
 
-// Market class
-Market::Market(Inflation* inf) : inflation(inf), boycott(false), sanctions(false), smugglerActive(false), guildDemands(false) {
-    prices[0] = { "Food", 2.0 };
-    prices[1] = { "Iron", 5.0 };
-    prices[2] = { "Wood", 3.0 };
-    prices[3] = { "Stone", 4.0 };
+OwnerId Map::registerOwner(const std::string& name) {
+    auto existing = ownerIds.find(name);
+    if (existing != ownerIds.end()) return existing->second;
+    if (ownerNames.size() > 0xfffe) throw std::runtime_error("Too many map owners");
+    OwnerId id = static_cast<OwnerId>(ownerNames.size());
+    ownerSymbols.push_back(pickSymbol(name));
+    ownerNames.push_back(name);
+    ownerTiles.push_back(0);
+    ownerChunks.emplace_back();
+    ownerIds.emplace(name, id);
+    return id;
 }
 
-void Market::updatePrices() {
-    for (int i = 0; i < MAX_PRICES; ++i) {
-        prices[i].value *= (0.9 + static_cast<double>(rand() % 21) / 100.0);
+OwnerId Map::findOwner(const std::string& name) const {
+    auto existing = ownerIds.find(name);
+    return existing == ownerIds.end() ? UNOWNED : existing->second;
+}
+
+const std::string& Map::getOwnerName(OwnerId owner) const { return ownerNames[owner]; }
+char Map::getOwnerSymbol(OwnerId owner) const { return ownerSymbols[owner]; }
+int Map::getOwnerCount() const { return static_cast<int>(ownerNames.size()); }
+
+OwnerId Map::getOwner(int row, int column) const {
+    if (row < 0 || row >= rows || column < 0 || column >= columns) return UNOWNED;
+    const Chunk* chunk = chunks[(row >> CHUNK_SHIFT) * chunkColumns + (column >> CHUNK_SHIFT)].get();
+    return chunk ? chunk->tiles[(row & (CHUNK_SIZE - 1)) * CHUNK_SIZE + (column & (CHUNK_SIZE - 1))] : UNOWNED;
+}
+
+void Map::markTouched(int chunk) {
+    if (!chunks[chunk]->touched) {
+        chunks[chunk]->touched = true;
+        touchedChunks.push_back(chunk);
     }
-    boycott = (rand() % 10 == 0);
-    sanctions = (rand() % 15 == 0);
-    smugglerActive = (rand() % 20 == 0);
-    guildDemands = (rand() % 15 == 0);
-    std::cout << YELLOW << "Market prices updated. Boycott: " << (boycott ? "Yes" : "No")
-        << ", Sanctions: " << (sanctions ? "Yes" : "No")
-        << ", Smugglers: " << (smugglerActive ? "Active" : "Inactive")
-        << ", Guild Demands: " << (guildDemands ? "Active" : "Inactive") << "\n" << RESET;
 }
 
-double Market::getPrice(const std::string& resource) const {
-    for (int i = 0; i < MAX_PRICES; ++i) {
-        if (prices[i].resource == resource) {
-            double price = prices[i].value * inflation->getRate();
-            if (boycott) price *= 1.5;
-            if (sanctions) price *= 1.3;
-            if (smugglerActive) price *= 0.8;
-            return price;
-        }
+void Map::setOwner(int row, int column, OwnerId owner) {
+    if (row < 0 || row >= rows || column < 0 || column >= columns || owner >= ownerNames.size()) return;
+    int index = (row >> CHUNK_SHIFT) * chunkColumns + (column >> CHUNK_SHIFT);
+    CowPtr<Chunk>& chunk = chunks[index];
+    if (!chunk) {
+        if (owner == UNOWNED) return;
+        chunk.reset(new Chunk());
     }
-    throw InsufficientResourcesException("Resource not found");
+    int localRow = row & (CHUNK_SIZE - 1);
+    uint64_t bit = uint64_t(1) << (column & (CHUNK_SIZE - 1));
+    OwnerId& tile = chunk->tiles[localRow * CHUNK_SIZE + (column & (CHUNK_SIZE - 1))];
+    if (tile == owner) return;
+    if (tile != UNOWNED) boardFor(index, tile).rows[localRow] &= ~bit;
+    if (owner != UNOWNED) boardFor(index, owner).rows[localRow] |= bit;
+    chunk->owned += (owner != UNOWNED) - (tile != UNOWNED);
+    ownerTiles[tile]--;
+    ownerTiles[owner]++;
+    tile = owner;
+    markTouched(index);
 }
 
-void Market::buyResource(Economy& econ, const std::string& resource, int amount, Resource<int>& res) {
-    double cost = getPrice(resource) * amount;
-    econ.spend(static_cast<int>(cost));
-    res.adjust(amount);
-    std::cout << GREEN << "Bought " << amount << " " << resource << " for " << cost << " gold.\n" << RESET;
+int64_t Map::getTileCount(OwnerId owner) const { return owner < ownerTiles.size() ? ownerTiles[owner] : 0; }
+int Map::getRows() const { return rows; }
+int Map::getColumns() const { return columns; }
+int Map::getChunkColumns() const { return chunkColumns; }
+int Map::getChunkCount() const { return static_cast<int>(chunks.size()); }
+
+int Map::getAllocatedChunks() const {
+    int allocated = 0;
+    for (const auto& chunk : chunks) allocated += chunk ? 1 : 0;
+    return allocated;
 }
 
-void Market::handleSmuggler(Economy& econ, Resource<int>& resource) {
-    if (smugglerActive) {
-        resource.adjust(100);
-        econ.spend(50);
-        std::cout << GREEN << "Smugglers delivered 100 illegal goods for 50 gold.\n" << RESET;
-    }
+const OwnerId* Map::chunkTiles(int chunk) const {
+    return chunks[chunk] ? chunks[chunk]->tiles : nullptr;
 }
 
-void Market::handleGuildDemands(Economy& econ, Population& pop) {
-    if (guildDemands) {
-        econ.spend(200);
-        pop.adjustMorale(-0.05);
-        std::cout << RED << "Trader guild demands met, cost 200 gold, morale drops.\n" << RESET;
+void Map::compact() {
+    for (int chunk : touchedChunks) {
+        Chunk& current = *chunks[chunk];
+        current.touched = false;
+        // Chunks that became empty again are released, as are boards of owners that left a chunk
+        if (current.owned == 0) {
+            for (const auto& entry : current.boards) dropBoard(chunk, entry.first);
+            chunks[chunk].reset();
+            continue;
+        }
+        current.boards.erase(std::remove_if(current.boards.begin(), current.boards.end(),
+            [this, chunk](const std::pair<OwnerId, Bitboard>& entry) {
+                for (uint64_t row : entry.second.rows) if (row) return false;
+                dropBoard(chunk, entry.first);
+                return true;
+            }), current.boards.end());
     }
+    touchedChunks.clear();
 }
 
-bool Market::isSmugglerActive() const { return smugglerActive; }
+void Map::setViewport(int row, int column) {
+    viewRow = std::max(0, std::min(row, rows - 1));
+    viewColumn = std::max(0, std::min(column, columns - 1));
+}
 
-// Espionage class
-Espionage::Espionage() : lastAction("None") {}
+void Map::display() const {
+    std::vector<std::string> lines;
+    render(lines);
+    std::string text;
+    for (const std::string& line : lines) text += line + "\n";
+    std::cout << text;
+}
 
-void Espionage::spyMission(Kingdom& source, Kingdom& target) {
-    Economy& econ = source.getEconomy();
-    Army& army = source.getArmy();
-    if (econ.getGold() < 100 || army.getSize() < 5)
-        throw InsufficientResourcesException("Insufficient resources for spying");
-    econ.spend(100);
-    army.useSpies(5);
-    std::cout << "Sending spies to " << target.getName() << "...\n";
-    std::this_thread::sleep_for(std::chrono::seconds(3 + source.getWeather().getDelayImpact()));
-    double successChance = 0.7 * (target.getPopulation().getMorale() < 0.5 ? 1.2 : 1.0);
-    if (static_cast<double>(rand()) / RAND_MAX < successChance) {
-        std::cout << GREEN << "Spy mission successful! Target status:\n" << RESET;
-        target.printStatus();
-        lastAction = "Spy Mission";
-    }
-    else {
-        std::cout << RED << "Spy mission failed! Spies detected.\n" << RESET;
-        target.getDiplomacy().handleEspionageFailure(source.getName());
-        lastAction = "Failed Spy Mission";
+void Map::render(std::vector<std::string>& lines) const {
+    lines.push_back(std::string(YELLOW) + "Map:" + RESET);
+    int lastRow = std::min(rows, viewRow + MAP_VIEW_SIZE);
+    int lastColumn = std::min(columns, viewColumn + MAP_VIEW_SIZE);
+    for (int i = viewRow; i < lastRow; ++i) {
+        std::string row = YELLOW;
+        for (int j = viewColumn; j < lastColumn; ++j) {
+            row += ownerSymbols[getOwner(i, j)];
+            row += ' ';
+        }
+        lines.push_back(row + RESET);
     }
 }
 
-void Espionage::sabotageWeapons(Kingdom& source, Kingdom& target) {
-    Economy& econ = source.getEconomy();
-    Army& army = source.getArmy();
-    if (econ.getGold() < 150 || army.getSize() < 10)
-        throw InsufficientResourcesException("Insufficient resources for sabotage");
-    econ.spend(150);
-    army.useSpies(10);
-    std::cout << "Attempting to sabotage " << target.getName() << "'s weapons...\n";
-    std::this_thread::sleep_for(std::chrono::seconds(4 + source.getWeather().getDelayImpact()));
-    double successChance = 0.6 * (target.getBlacksmith().isCorrupted() ? 1.3 : 1.0);
-    if (static_cast<double>(rand()) / RAND_MAX < successChance) {
-        int weaponsLost = target.getBlacksmith().getWeaponsInStock() / 2;
-        target.getBlacksmith().useWeapons(weaponsLost);
-        std::cout << GREEN << "Sabotage successful! Destroyed " << weaponsLost << " weapons.\n" << RESET;
-        lastAction = "Sabotage Weapons";
-    }
-    else {
-        std::cout << RED << "Sabotage failed! Spies detected.\n" << RESET;
-        target.getDiplomacy().handleEspionageFailure(source.getName());
-        lastAction = "Failed Sabotage";
-    }
+static inline int popcount64(uint64_t value) {
+#ifdef _MSC_VER
+    return static_cast<int>(__popcnt64(value));
+#else
+    return __builtin_popcountll(value);
+#endif
 }
 
-void Espionage::stealGold(Kingdom& source, Kingdom& target) {
-    Economy& econ = source.getEconomy();
+static inline int lowestBit(uint64_t value) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(value);
+#endif
+}
+
+const Map::Bitboard* Map::board(int chunk, OwnerId owner) const {
+    const Chunk* current = chunks[chunk].get();
+    if (!current) return nullptr;
+    for (const auto& entry : current->boards) if (entry.first == owner) return &entry.second;
+    return nullptr;
+}
+
+Map::Bitboard& Map::boardFor(int chunk, OwnerId owner) {
+    Chunk& current = *chunks[chunk];
+    for (auto& entry : current.boards) if (entry.first == owner) return entry.second;
+    std::vector<int>& found = ownerChunks[owner];
+    found.insert(std::lower_bound(found.begin(), found.end(), chunk), chunk);
+    current.boards.push_back(std::make_pair(owner, Bitboard()));
+    return current.boards.back().second;
+}
+
+void Map::dropBoard(int chunk, OwnerId owner) {
+    std::vector<int>& found = ownerChunks[owner];
+    auto at = std::lower_bound(found.begin(), found.end(), chunk);
+    if (at != found.end() && *at == chunk) found.erase(at);
+}
+
+const Map::Bitboard* Map::chunkBoard(int chunk, OwnerId owner) const { return board(chunk, owner); }
+
+void Map::chunkMasks(int chunk, uint64_t& columnMask, int& rowCount) const {
+    int width = std::min(CHUNK_SIZE, columns - ((chunk % chunkColumns) << CHUNK_SHIFT));
+    columnMask = width == CHUNK_SIZE ? ~uint64_t(0) : (uint64_t(1) << width) - 1;
+    rowCount = std::min(CHUNK_SIZE, rows - ((chunk / chunkColumns) << CHUNK_SHIFT));
+}
+
+void Map::neighbourhood(int chunk, OwnerId owner, Neighbourhood& out) const {
+    int chunkRow = chunk / chunkColumns;
+    int chunkColumn = chunk % chunkColumns;
+    int chunkRows = static_cast<int>(chunks.size()) / chunkColumns;
+    const Bitboard* centre = board(chunk, owner);
+    const Bitboard* above = chunkRow > 0 ? board(chunk - chunkColumns, owner) : nullptr;
+    const Bitboard* below = chunkRow + 1 < chunkRows ? board(chunk + chunkColumns, owner) : nullptr;
+    const Bitboard* left = chunkColumn > 0 ? board(chunk - 1, owner) : nullptr;
+    const Bitboard* right = chunkColumn + 1 < chunkColumns ? board(chunk + 1, owner) : nullptr;
+    out.rows[0] = above ? above->rows[CHUNK_SIZE - 1] : 0;
+    out.rows[CHUNK_SIZE + 1] = below ? below->rows[0] : 0;
+    out.left = 0;
+    out.right = 0;
+    for (int r = 0; r < CHUNK_SIZE; ++r) {
+        out.rows[r + 1] = centre ? centre->rows[r] : 0;
+        if (left) out.left |= (left->rows[r] >> (CHUNK_SIZE - 1)) << r;
+        if (right) out.right |= (right->rows[r] & 1) << r;
+    }
+}
+
+const std::vector<int>& Map::chunksWith(OwnerId owner) const {
+    static const std::vector<int> none;
+    return owner < ownerChunks.size() ? ownerChunks[owner] : none;
+}
+
+int64_t Map::countTiles(OwnerId owner) const {
+    int64_t total = 0;
+    for (int chunk : chunksWith(owner)) {
+        for (uint64_t row : board(chunk, owner)->rows) total += popcount64(row);
+    }
+    return total;
+}
+
+int64_t Map::countEdges(OwnerId owner, OwnerId other, bool border) const {
+    // border: edges from owner's tiles to in-map tiles it does not own; otherwise edges to other's tiles
+    int64_t edges = 0;
+    Neighbourhood mine, theirs;
+    for (int chunk : chunksWith(owner)) {
+        neighbourhood(chunk, owner, mine);
+        if (!border) neighbourhood(chunk, other, theirs);
+        const Neighbourhood& target = border ? mine : theirs;
+        uint64_t columnMask;
+        int rowCount;
+        chunkMasks(chunk, columnMask, rowCount);
+        int firstRow = (chunk / chunkColumns) << CHUNK_SHIFT;
+        int firstColumn = (chunk % chunkColumns) << CHUNK_SHIFT;
+        // Which neighbours exist inside the map for each column of this chunk
+        uint64_t hasLeft = columnMask & (firstColumn == 0 ? ~uint64_t(1) : ~uint64_t(0));
+        uint64_t hasRight = columnMask & (columnMask >> 1 | (firstColumn + CHUNK_SIZE < columns ? uint64_t(1) << (CHUNK_SIZE - 1) : 0));
+        for (int r = 0; r < rowCount; ++r) {
+            uint64_t tiles = mine.rows[r + 1];
+            if (!tiles) continue;
+            uint64_t leftOf = target.rows[r + 1] << 1 | ((target.left >> r) & 1);
+            uint64_t rightOf = target.rows[r + 1] >> 1 | ((target.right >> r) & 1) << (CHUNK_SIZE - 1);
+            uint64_t up = target.rows[r];
+            uint64_t down = target.rows[r + 2];
+            bool hasUp = firstRow + r > 0;
+            bool hasDown = firstRow + r + 1 < rows;
+            if (border) {
+                edges += popcount64(tiles & hasLeft & ~leftOf) + popcount64(tiles & hasRight & ~rightOf);
+                if (hasUp) edges += popcount64(tiles & ~up);
+                if (hasDown) edges += popcount64(tiles & ~down);
+            }
+            else {
+                edges += popcount64(tiles & leftOf) + popcount64(tiles & rightOf) + popcount64(tiles & up) + popcount64(tiles & down);
+            }
+        }
+    }
+    return edges;
+}
+
+int64_t Map::borderLength(OwnerId owner) const { return owner == UNOWNED ? 0 : countEdges(owner, owner, true); }
+int64_t Map::sharedBorder(OwnerId a, OwnerId b) const { return a == b ? 0 : countEdges(a, b, false); }
+bool Map::isAdjacent(OwnerId a, OwnerId b) const { return sharedBorder(a, b) > 0; }
+
+int Map::countRegions(OwnerId owner) const {
+    // Flood fill by repeated dilation: grow a seed inside the owner's tiles until nothing changes,
+    // remove that region and start again from the next remaining tile
+    std::vector<int> owned = chunksWith(owner);
+    std::unordered_map<int, Bitboard> remaining, region;
+    for (int chunk : owned) remaining[chunk] = *board(chunk, owner);
+    int regions = 0;
+    while (true) {
+        int seedChunk = -1;
+        for (int chunk : owned) {
+            for (int r = 0; r < CHUNK_SIZE && seedChunk < 0; ++r) {
+                if (remaining[chunk].rows[r]) {
+                    seedChunk = chunk;
+                    region.clear();
+                    region[chunk].rows[r] = uint64_t(1) << lowestBit(remaining[chunk].rows[r]);
+                }
+            }
+            if (seedChunk >= 0) break;
+        }
+        if (seedChunk < 0) return regions;
+        regions++;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (int chunk : owned) {
+                const Bitboard& allowed = remaining[chunk];
+                Bitboard& grown = region[chunk];
+                int chunkRow = chunk / chunkColumns;
+                int chunkColumn = chunk % chunkColumns;
+                auto neighbourRows = [&](int neighbour, bool exists) -> const Bitboard* {
+                    if (!exists) return nullptr;
+                    auto found = region.find(neighbour);
+                    return found == region.end() ? nullptr : &found->second;
+                };
+                const Bitboard* above = neighbourRows(chunk - chunkColumns, chunkRow > 0);
+                const Bitboard* below = neighbourRows(chunk + chunkColumns, chunk + chunkColumns < static_cast<int>(chunks.size()));
+                const Bitboard* left = neighbourRows(chunk - 1, chunkColumn > 0);
+                const Bitboard* right = neighbourRows(chunk + 1, chunkColumn + 1 < chunkColumns);
+                bool local = true;
+                while (local) {
+                    local = false;
+                    for (int r = 0; r < CHUNK_SIZE; ++r) {
+                        uint64_t row = grown.rows[r];
+                        uint64_t spread = row | row << 1 | row >> 1;
+                        spread |= r > 0 ? grown.rows[r - 1] : (above ? above->rows[CHUNK_SIZE - 1] : 0);
+                        spread |= r + 1 < CHUNK_SIZE ? grown.rows[r + 1] : (below ? below->rows[0] : 0);
+                        if (left) spread |= left->rows[r] >> (CHUNK_SIZE - 1);
+                        if (right) spread |= (right->rows[r] & 1) << (CHUNK_SIZE - 1);
+                        spread &= allowed.rows[r];
+                        if (spread != row) {
+                            grown.rows[r] = spread;
+                            local = true;
+                            changed = true;
+                        }
+                    }
+                }
+            }
+        }
+        for (auto& entry : region) {
+            for (int r = 0; r < CHUNK_SIZE; ++r) remaining[entry.first].rows[r] &= ~entry.second.rows[r];
+        }
+    }
+}
+
+bool Map::isContiguous(OwnerId owner) const { return countRegions(owner) <= 1; }
+
+// Calls visit(row, firstColumn, open) for each chunk row where `open` has a bit set for every in-map
+// tile the attacker does not own that touches the attacker's territory
+template <typename Visit>
+void Map::forEachCapturable(OwnerId attacker, Visit visit) const {
+    if (attacker == UNOWNED) return;
+    std::vector<int> candidates;
+    for (int chunk : chunksWith(attacker)) {
+        candidates.push_back(chunk);
+        if (chunk >= chunkColumns) candidates.push_back(chunk - chunkColumns);
+        if (chunk + chunkColumns < static_cast<int>(chunks.size())) candidates.push_back(chunk + chunkColumns);
+        if (chunk % chunkColumns > 0) candidates.push_back(chunk - 1);
+        if (chunk % chunkColumns + 1 < chunkColumns) candidates.push_back(chunk + 1);
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    Neighbourhood around;
+    for (int chunk : candidates) {
+        neighbourhood(chunk, attacker, around);
+        uint64_t columnMask;
+        int rowCount;
+        chunkMasks(chunk, columnMask, rowCount);
+        int firstRow = (chunk / chunkColumns) << CHUNK_SHIFT;
+        int firstColumn = (chunk % chunkColumns) << CHUNK_SHIFT;
+        for (int r = 0; r < rowCount; ++r) {
+            uint64_t own = around.rows[r + 1];
+            uint64_t touching = own << 1 | own >> 1 | around.rows[r] | around.rows[r + 2]
+                | ((around.left >> r) & 1) | ((around.right >> r) & 1) << (CHUNK_SIZE - 1);
+            uint64_t open = touching & ~own & columnMask;
+            if (open) visit(firstRow + r, firstColumn, open);
+        }
+    }
+}
+
+int64_t Map::countCapturable(OwnerId attacker) const {
+    int64_t total = 0;
+    forEachCapturable(attacker, [&total](int, int, uint64_t open) { total += popcount64(open); });
+    return total;
+}
+
+void Map::capturableCells(OwnerId attacker, std::vector<std::pair<int, int>>& cells) const {
+    cells.clear();
+    forEachCapturable(attacker, [&cells](int row, int firstColumn, uint64_t open) {
+        while (open) {
+            cells.push_back(std::make_pair(row, firstColumn + lowestBit(open)));
+            open &= open - 1;
+        }
+    });
+}
+
+void Map::capture(const std::string& kingdom, int row, int column) {
+    setOwner(row, column, registerOwner(kingdom));
+}
+
+void Map::enemyAttack(Resource<int>& resource, Random& rng) {
+    if (rng.nextInt(10) < 3) {
+        int loss = resource.get() / 5;
+        resource.adjust(-loss);
+        std::cout << RED << "Enemy attack! Lost " << loss << " resources.\n" << RESET;
+    }
+}
+
+
+void Map::serialize(BinaryWriter& out) const {
+    out.writeInt(rows);
+    out.writeInt(columns);
+    out.writeUInt(static_cast<uint32_t>(ownerNames.size() - 1));
+    for (size_t owner = 1; owner < ownerNames.size(); ++owner) {
+        out.writeString(ownerNames[owner]);
+        out.writeByte(static_cast<uint8_t>(ownerSymbols[owner]));
+    }
+    // Allocated chunks only, each run-length encoded as (owner, run) pairs over the tiles that
+    // lie inside the map, row by row
+    uint32_t allocated = 0;
+    for (const auto& chunk : chunks) allocated += chunk && chunk->owned > 0 ? 1 : 0;
+    out.writeUInt(allocated);
+    std::vector<std::pair<OwnerId, uint32_t>> runs;
+    for (size_t index = 0; index < chunks.size(); ++index) {
+        const Chunk* chunk = chunks[index].get();
+        if (!chunk || chunk->owned == 0) continue;
+        out.writeUInt(static_cast<uint32_t>(index));
+        int chunkRows = std::min(CHUNK_SIZE, rows - (static_cast<int>(index) / chunkColumns << CHUNK_SHIFT));
+        int chunkWidth = std::min(CHUNK_SIZE, columns - (static_cast<int>(index) % chunkColumns << CHUNK_SHIFT));
+        runs.clear();
+        for (int r = 0; r < chunkRows; ++r) {
+            for (int c = 0; c < chunkWidth; ++c) {
+                OwnerId tile = chunk->tiles[r * CHUNK_SIZE + c];
+                if (!runs.empty() && runs.back().first == tile) runs.back().second++;
+                else runs.push_back(std::make_pair(tile, 1u));
+            }
+        }
+        out.writeUInt(static_cast<uint32_t>(runs.size()));
+        for (const auto& run : runs) {
+            out.writeUInt(run.first);
+            out.writeUInt(run.second);
+        }
+    }
+}
+
+void Map::deserialize(BinaryReader& in, uint32_t version) {
+    if (version < 3) {
+        // Versions 1-2 stored a 5x5 grid of owner initials
+        char grid[GRID_SIZE][GRID_SIZE];
+        in.readBytes(grid, sizeof(grid));
+        reset(GRID_SIZE, GRID_SIZE);
+        for (int i = 0; i < GRID_SIZE; ++i) {
+            for (int j = 0; j < GRID_SIZE; ++j) {
+                char symbol = grid[i][j];
+                if (symbol == '.') continue;
+                std::string owner = symbol == 'S' ? "Stronghold" : symbol == 'I' ? "Ironhold" : std::string(1, symbol);
+                setOwner(i, j, registerOwner(owner));
+            }
+        }
+        compact();
+        return;
+    }
+    int savedRows = in.readInt();
+    int savedColumns = in.readInt();
+    if (savedRows <= 0 || savedColumns <= 0 || static_cast<int64_t>(savedRows) * savedColumns > (int64_t(1) << 32))
+        throw std::runtime_error("Corrupt save data: map size");
+    reset(savedRows, savedColumns);
+    uint32_t ownerCount = in.readUInt();
+    if (ownerCount > 0xfffe) throw std::runtime_error("Corrupt save data: map owners");
+    for (uint32_t owner = 0; owner < ownerCount; ++owner) {
+        std::string name = in.readString();
+        char symbol = static_cast<char>(in.readByte());
+        if (registerOwner(name) != owner + 1) throw std::runtime_error("Corrupt save data: map owners");
+        ownerSymbols.back() = symbol;
+    }
+    uint32_t allocated = in.readUInt();
+    for (uint32_t c = 0; c < allocated; ++c) {
+        uint32_t index = in.readUInt();
+        if (index >= chunks.size() || chunks[index]) throw std::runtime_error("Corrupt save data: map chunk");
+        int firstRow = static_cast<int>(index) / chunkColumns << CHUNK_SHIFT;
+        int firstColumn = static_cast<int>(index) % chunkColumns << CHUNK_SHIFT;
+        uint32_t chunkWidth = static_cast<uint32_t>(std::min(CHUNK_SIZE, columns - firstColumn));
+        uint32_t tileCount = static_cast<uint32_t>(std::min(CHUNK_SIZE, rows - firstRow)) * chunkWidth;
+        uint32_t runCount = in.readUInt();
+        uint32_t tile = 0;
+        for (uint32_t r = 0; r < runCount; ++r) {
+            uint32_t owner = in.readUInt();
+            uint32_t run = in.readUInt();
+            if (owner >= ownerNames.size() || run > tileCount - tile) throw std::runtime_error("Corrupt save data: map chunk");
+            for (uint32_t t = tile; owner != UNOWNED && t < tile + run; ++t) {
+                setOwner(firstRow + static_cast<int>(t / chunkWidth), firstColumn + static_cast<int>(t % chunkWidth),
+                    static_cast<OwnerId>(owner));
+            }
+            tile += run;
+        }
+    }
+    compact();
+}
+
+// Exchange class
+Exchange::Exchange() : nextOrderId(1), tradeCount(0) {}
+
+int Exchange::registerTrader(const std::string& name) {
+    auto existing = traderIds.find(name);
+    if (existing != traderIds.end()) return existing->second;
+    int id = static_cast<int>(accounts.size());
+    accounts.emplace_back();
+    accounts.back().name = name;
+    traderIds.emplace(name, id);
+    return id;
+}
+
+int Exchange::findTrader(const std::string& name) const {
+    auto existing = traderIds.find(name);
+    return existing == traderIds.end() ? -1 : existing->second;
+}
+
+int32_t Exchange::allocateOrder() {
+    if (!freeOrders.empty()) {
+        int32_t index = freeOrders.back();
+        freeOrders.pop_back();
+        return index;
+    }
+    orders.emplace_back();
+    return static_cast<int32_t>(orders.size()) - 1;
+}
+
+void Exchange::releaseOrder(int32_t index) {
+    resting.erase(orders[index].id);
+    freeOrders.push_back(index);
+}
+
+void Exchange::recordTrade(ResourceType resource, int price, int quantity, int buyer, int seller) {
+    Trade trade;
+    trade.sequence = ++tradeCount;
+    trade.resource = resource;
+    trade.price = price;
+    trade.quantity = quantity;
+    trade.buyer = buyer;
+    trade.seller = seller;
+    recentTrades.push_back(trade);
+    books[resource].loggedValue += static_cast<int64_t>(price) * quantity;
+    books[resource].loggedQuantity += quantity;
+    if (recentTrades.size() > TRADE_LOG_SIZE) {
+        const Trade& oldest = recentTrades.front();
+        books[oldest.resource].loggedValue -= static_cast<int64_t>(oldest.price) * oldest.quantity;
+        books[oldest.resource].loggedQuantity -= oldest.quantity;
+        recentTrades.pop_front();
+    }
+    books[resource].lastPrice = price;
+    books[resource].volume += quantity;
+}
+
+// Fills an incoming order against the opposite side, best price first and oldest first within a
+// price. Trades happen at the resting order's price; returns the quantity left unfilled.
+template <typename Levels, typename Crosses>
+int Exchange::match(Levels& levels, Crosses crosses, int trader, OrderSide side, ResourceType resource, int limit, int quantity) {
+    while (quantity > 0 && !levels.empty() && crosses(levels.begin()->first, limit)) {
+        int price = levels.begin()->first;
+        Level& level = levels.begin()->second;
+        while (quantity > 0 && level.head >= 0) {
+            Order& maker = orders[level.head];
+            if (maker.trader == trader) {
+                // Self-trade: cancel the resting order and refund its escrow rather than print a trade
+                if (maker.side == SIDE_BUY) accounts[trader].gold += static_cast<int64_t>(maker.price) * maker.remaining;
+                else accounts[trader].resources[resource] += maker.remaining;
+                level.quantity -= maker.remaining;
+                int32_t cancelled = level.head;
+                level.head = maker.next;
+                if (level.head >= 0) orders[level.head].prev = -1;
+                releaseOrder(cancelled);
+                continue;
+            }
+            int fill = std::min(quantity, maker.remaining);
+            int buyer = side == SIDE_BUY ? trader : maker.trader;
+            int seller = side == SIDE_BUY ? maker.trader : trader;
+            accounts[buyer].resources[resource] += fill;
+            accounts[seller].gold += static_cast<int64_t>(price) * fill;
+            // A buyer that bid above the resting ask gets the difference back from escrow
+            if (side == SIDE_BUY) accounts[buyer].gold += static_cast<int64_t>(limit - price) * fill;
+            recordTrade(resource, price, fill, buyer, seller);
+            maker.remaining -= fill;
+            level.quantity -= fill;
+            quantity -= fill;
+            if (maker.remaining == 0) {
+                int32_t filled = level.head;
+                level.head = maker.next;
+                if (level.head >= 0) orders[level.head].prev = -1;
+                releaseOrder(filled);
+            }
+        }
+        if (level.head < 0) levels.erase(levels.begin());
+    }
+    return quantity;
+}
+
+ActionStatus Exchange::tryPlaceOrder(int trader, OrderSide side, ResourceType resource, int price, int quantity,
+    Economy& econ, Resource<int>& stock, OrderId& id) {
+    if (trader < 0 || trader >= static_cast<int>(accounts.size())) return STATUS_UNKNOWN_TRADER;
+    if (price <= 0 || quantity <= 0) return STATUS_INVALID_ORDER;
+    if (side == SIDE_BUY) {
+        int64_t escrow = static_cast<int64_t>(price) * quantity;
+        if (escrow > 0x7fffffff) return STATUS_ORDER_TOO_LARGE;
+        ActionStatus status = econ.trySpend(static_cast<int>(escrow));
+        if (status != STATUS_OK) return status;
+    }
+    else {
+        if (stock.get() < quantity) return STATUS_INSUFFICIENT_RESOURCES;
+        stock.adjust(-quantity);
+    }
+
+    Book& book = books[resource];
+    int remaining = side == SIDE_BUY
+        ? match(book.asks, [](int ask, int bid) { return ask <= bid; }, trader, side, resource, price, quantity)
+        : match(book.bids, [](int bid, int ask) { return bid >= ask; }, trader, side, resource, price, quantity);
+    id = nextOrderId++;
+    if (remaining == 0) return STATUS_OK;
+
+    int32_t index = allocateOrder();
+    Level& level = side == SIDE_BUY ? book.bids[price] : book.asks[price];
+    orders[index] = { id, trader, price, remaining, level.tail, -1, resource, side };
+    if (level.tail >= 0) orders[level.tail].next = index;
+    else level.head = index;
+    level.tail = index;
+    level.quantity += remaining;
+    resting.emplace(id, index);
+    return STATUS_OK;
+}
+
+OrderId Exchange::placeOrder(int trader, OrderSide side, ResourceType resource, int price, int quantity,
+    Economy& econ, Resource<int>& stock) {
+    OrderId id = 0;
+    ActionStatus status = tryPlaceOrder(trader, side, resource, price, quantity, econ, stock, id);
+    if (status == STATUS_INSUFFICIENT_RESOURCES) throw InsufficientResourcesException(std::string("Insufficient ") + RESOURCE_NAMES[resource]);
+    requireSuccess(status);
+    return id;
+}
+
+bool Exchange::cancelOrder(int trader, OrderId id) {
+    auto found = resting.find(id);
+    if (found == resting.end() || orders[found->second].trader != trader) return false;
+    int32_t index = found->second;
+    Order& order = orders[index];
+    Book& book = books[order.resource];
+    // Unlink from its price level in O(1) through the neighbours' links
+    auto unlink = [&](Level& level) {
+        if (order.prev < 0) level.head = order.next;
+        else orders[order.prev].next = order.next;
+        if (order.next < 0) level.tail = order.prev;
+        else orders[order.next].prev = order.prev;
+        level.quantity -= order.remaining;
+    };
+    if (order.side == SIDE_BUY) {
+        auto level = book.bids.find(order.price);
+        unlink(level->second);
+        if (level->second.head < 0) book.bids.erase(level);
+        accounts[trader].gold += static_cast<int64_t>(order.price) * order.remaining;
+    }
+    else {
+        auto level = book.asks.find(order.price);
+        unlink(level->second);
+        if (level->second.head < 0) book.asks.erase(level);
+        accounts[trader].resources[order.resource] += order.remaining;
+    }
+    releaseOrder(index);
+    return true;
+}
+
+int Exchange::collect(int trader, Economy& econ, Resource<int> stock[RESOURCE_COUNT]) {
+    if (trader < 0 || trader >= static_cast<int>(accounts.size())) return 0;
+    Account& account = accounts[trader];
+    int gold = static_cast<int>(std::min<int64_t>(account.gold, 0x7fffffff));
+    if (gold > 0) econ.spend(-gold);
+    account.gold -= gold;
+    for (int r = 0; r < RESOURCE_COUNT; ++r) {
+        int amount = static_cast<int>(std::min<int64_t>(account.resources[r], 0x7fffffff));
+        stock[r].adjust(amount);
+        account.resources[r] -= amount;
+    }
+    return gold;
+}
+
+int Exchange::getBestBid(ResourceType resource) const {
+    return books[resource].bids.empty() ? 0 : books[resource].bids.begin()->first;
+}
+
+int Exchange::getBestAsk(ResourceType resource) const {
+    return books[resource].asks.empty() ? 0 : books[resource].asks.begin()->first;
+}
+
+int Exchange::getLastPrice(ResourceType resource) const { return books[resource].lastPrice; }
+
+double Exchange::getAveragePrice(ResourceType resource) const {
+    const Book& book = books[resource];
+    return book.loggedQuantity > 0 ? static_cast<double>(book.loggedValue) / book.loggedQuantity : 0.0;
+}
+
+int64_t Exchange::getVolume(ResourceType resource) const { return books[resource].volume; }
+
+int64_t Exchange::getDepth(ResourceType resource, OrderSide side, int price) const {
+    if (side == SIDE_BUY) {
+        auto level = books[resource].bids.find(price);
+        return level == books[resource].bids.end() ? 0 : level->second.quantity;
+    }
+    auto level = books[resource].asks.find(price);
+    return level == books[resource].asks.end() ? 0 : level->second.quantity;
+}
+
+int Exchange::getOpenOrderCount() const { return static_cast<int>(resting.size()); }
+
+int Exchange::getOpenOrderCount(int trader) const {
+    int count = 0;
+    for (const auto& order : resting) count += orders[order.second].trader == trader;
+    return count;
+}
+uint64_t Exchange::getTradeCount() const { return tradeCount; }
+const std::deque<Trade>& Exchange::getRecentTrades() const { return recentTrades; }
+
+// PriceHistory class
+PriceHistory::PriceHistory(size_t capacity, size_t window)
+    : slots(std::max<size_t>(capacity, 2)), window(std::max<size_t>(1, std::min(window, std::max<size_t>(capacity, 2) - 1))) {
+    clear();
+}
+
+void PriceHistory::allocate() {
+    // Kingdoms are built in bulk for simulations, so the rings wait for the first sample
+    if (!buffer.empty()) return;
+    buffer.assign(slots + 2 * (window + 1), 0);
+    minimums.offset = slots;
+    maximums.offset = slots + window + 1;
+}
+
+void PriceHistory::clear() {
+    recorded = 0;
+    windowSum = 0;
+    windowSquares = 0.0;
+    returnSum = 0.0;
+    returnSquares = 0.0;
+    minimums.head = minimums.count = 0;
+    maximums.head = maximums.count = 0;
+}
+
+int64_t PriceHistory::sample(uint64_t sequence) const { return buffer[sequence % slots]; }
+
+double PriceHistory::stepReturn(uint64_t sequence) const {
+    int64_t previous = sample(sequence - 1);
+    return previous != 0 ? static_cast<double>(sample(sequence) - previous) / previous : 0.0;
+}
+
+uint64_t PriceHistory::front(const Candidates& queue) const {
+    return static_cast<uint64_t>(buffer[queue.offset + queue.head]);
+}
+
+void PriceHistory::push(Candidates& queue, uint64_t sequence, bool lowest) {
+    // Drop candidates the new sample beats for as long as it stays in the window
+    size_t ring = window + 1;
+    int64_t value = sample(sequence);
+    while (queue.count > 0) {
+        int64_t back = sample(static_cast<uint64_t>(buffer[queue.offset + (queue.head + queue.count - 1) % ring]));
+        if (lowest ? back < value : back > value) break;
+        --queue.count;
+    }
+    buffer[queue.offset + (queue.head + queue.count) % ring] = static_cast<int64_t>(sequence);
+    ++queue.count;
+}
+
+void PriceHistory::expire(Candidates& queue, uint64_t oldest) {
+    while (front(queue) < oldest) {
+        queue.head = (queue.head + 1) % (window + 1);
+        --queue.count;
+    }
+}
+
+void PriceHistory::rebuildSums() {
+    // The double sums pick up rounding error as samples enter and leave; recompute them now and then
+    uint64_t first = recorded > window ? recorded - window : 0;
+    windowSquares = 0.0;
+    returnSum = 0.0;
+    returnSquares = 0.0;
+    for (uint64_t i = first; i < recorded; ++i) {
+        windowSquares += static_cast<double>(sample(i)) * sample(i);
+        if (i > first) {
+            double r = stepReturn(i);
+            returnSum += r;
+            returnSquares += r * r;
+        }
+    }
+}
+
+void PriceHistory::record(double price) {
+    int64_t value = static_cast<int64_t>(std::llround(price * 1000.0));
+    allocate();
+    uint64_t sequence = recorded++;
+    buffer[sequence % slots] = value;
+    windowSum += value;
+    windowSquares += static_cast<double>(value) * value;
+    if (sequence >= 1 && window >= 2) {
+        double r = stepReturn(sequence);
+        returnSum += r;
+        returnSquares += r * r;
+    }
+    if (sequence >= window) {
+        // The sample that just left the window, and the return from it to its successor
+        uint64_t leaving = sequence - window;
+        int64_t old = sample(leaving);
+        windowSum -= old;
+        windowSquares -= static_cast<double>(old) * old;
+        if (window >= 2) {
+            double r = stepReturn(leaving + 1);
+            returnSum -= r;
+            returnSquares -= r * r;
+        }
+    }
+    push(minimums, sequence, true);
+    push(maximums, sequence, false);
+    uint64_t oldest = recorded > window ? recorded - window : 0;
+    expire(minimums, oldest);
+    expire(maximums, oldest);
+    if (recorded % 1024 == 0) rebuildSums();
+}
+
+size_t PriceHistory::size() const { return static_cast<size_t>(std::min<uint64_t>(recorded, slots)); }
+size_t PriceHistory::capacity() const { return slots; }
+size_t PriceHistory::getWindow() const { return window; }
+
+double PriceHistory::at(size_t index) const {
+    return sample(recorded - size() + index) / 1000.0;
+}
+
+double PriceHistory::latest() const { return recorded ? sample(recorded - 1) / 1000.0 : 0.0; }
+
+double PriceHistory::movingAverage() const {
+    uint64_t n = std::min<uint64_t>(recorded, window);
+    return n ? static_cast<double>(windowSum) / n / 1000.0 : 0.0;
+}
+
+double PriceHistory::standardDeviation() const {
+    uint64_t n = std::min<uint64_t>(recorded, window);
+    if (n < 2) return 0.0;
+    double mean = static_cast<double>(windowSum) / n;
+    double variance = std::max(0.0, windowSquares / n - mean * mean);
+    return std::sqrt(variance) / 1000.0;
+}
+
+double PriceHistory::volatility() const {
+    uint64_t n = std::min<uint64_t>(recorded, window);
+    if (n < 3) return 0.0;
+    double returns = static_cast<double>(n - 1);
+    double mean = returnSum / returns;
+    return std::sqrt(std::max(0.0, returnSquares / returns - mean * mean));
+}
+
+double PriceHistory::windowMin() const { return minimums.count ? sample(front(minimums)) / 1000.0 : 0.0; }
+double PriceHistory::windowMax() const { return maximums.count ? sample(front(maximums)) / 1000.0 : 0.0; }
+
+void PriceHistory::serialize(BinaryWriter& out) const {
+    // Samples oldest first: the first as a varint, the rest as zigzag varint deltas
+    out.writeVarUInt(slots);
+    out.writeVarUInt(window);
+    out.writeVarUInt(recorded);
+    size_t held = size();
+    out.writeVarUInt(held);
+    int64_t previous = 0;
+    for (size_t i = 0; i < held; ++i) {
+        int64_t value = sample(recorded - held + i);
+        out.writeVarInt(value - previous);
+        previous = value;
+    }
+}
+
+void PriceHistory::deserialize(BinaryReader& in) {
+    uint64_t savedCapacity = in.readVarUInt();
+    uint64_t savedWindow = in.readVarUInt();
+    uint64_t savedRecorded = in.readVarUInt();
+    uint64_t held = in.readVarUInt();
+    if (savedCapacity < 2 || savedCapacity > (1u << 24) || savedWindow < 1 || savedWindow >= savedCapacity ||
+        held > savedCapacity || held > savedRecorded)
+        throw std::runtime_error("Corrupt save data: price history");
+    buffer.clear();
+    slots = static_cast<size_t>(savedCapacity);
+    window = static_cast<size_t>(savedWindow);
+    allocate();
+    clear();
+    // Replaying the held samples rebuilds the window sums and queues; then restore the true count
+    uint64_t skipped = savedRecorded - held;
+    recorded = skipped;
+    int64_t value = 0;
+    for (uint64_t i = 0; i < held; ++i) {
+        value += in.readVarInt();
+        uint64_t sequence = recorded++;
+        buffer[sequence % slots] = value;
+    }
+    uint64_t first = recorded > window ? recorded - window : skipped;
+    first = std::max(first, skipped);
+    for (uint64_t i = first; i < recorded; ++i) {
+        windowSum += sample(i);
+        push(minimums, i, true);
+        push(maximums, i, false);
+    }
+    rebuildSums();
+}
+
+// Market class
+Market::Market(const Inflation* inf) : inflation(inf), exchange(nullptr), boycott(false), sanctions(false), smugglerActive(false), guildDemands(false) {
+    for (int i = 0; i < RESOURCE_COUNT; ++i) {
+        prices[i] = { RESOURCE_NAMES[i], BASE_PRICES[i] };
+    }
+}
+
+void Market::updatePrices(Random& rng) {
+    // With an exchange attached, prices follow its trades instead of a random walk
+    for (int i = 0; i < MAX_PRICES && !exchange; ++i) {
+        prices[i].value *= (0.9 + static_cast<double>(rng.nextInt(21)) / 100.0);
+    }
+    boycott = (rng.nextInt(10) == 0);
+    sanctions = (rng.nextInt(15) == 0);
+    smugglerActive = (rng.nextInt(20) == 0);
+    guildDemands = (rng.nextInt(15) == 0);
+    std::cout << YELLOW << "Market prices updated. Boycott: " << (boycott ? "Yes" : "No")
+        << ", Sanctions: " << (sanctions ? "Yes" : "No")
+        << ", Smugglers: " << (smugglerActive ? "Active" : "Inactive")
+        << ", Guild Demands: " << (guildDemands ? "Active" : "Inactive") << "\n" << RESET;
+}
+
+double Market::getPrice(ResourceType resource) const {
+    // Exchange trades steer the price by their volume-weighted average, but only within a band
+    // around the inflation price, so a few tiny trades cannot make goods free for everyone
+    double price = prices[resource].value * inflation->getRate();
+    if (exchange) {
+        double traded = exchange->getAveragePrice(resource);
+        if (traded > 0.0) price = std::max(price / EXCHANGE_PRICE_BAND, std::min(price * EXCHANGE_PRICE_BAND, traded));
+    }
+    if (boycott) price *= 1.5;
+    if (sanctions) price *= 1.3;
+    if (smugglerActive) price *= 0.8;
+    return price;
+}
+
+double Market::getPrice(const std::string& resource) const {
+    ResourceType type;
+    if (!parseResourceType(resource, type)) throw InsufficientResourcesException("Resource not found");
+    return getPrice(type);
+}
+
+bool Market::canAfford(const Economy& econ, ResourceType resource, int amount) const {
+    return econ.canAfford(static_cast<int>(getPrice(resource) * amount));
+}
+
+ActionStatus Market::tryBuyResource(Economy& econ, ResourceType resource, int amount, Resource<int>& res) {
+    double cost = getPrice(resource) * amount;
+    ActionStatus status = econ.trySpend(static_cast<int>(cost));
+    if (status != STATUS_OK) return status;
+    res.adjust(amount);
+    std::cout << GREEN << "Bought " << amount << " " << RESOURCE_NAMES[resource] << " for " << cost << " gold.\n" << RESET;
+    return STATUS_OK;
+}
+
+void Market::buyResource(Economy& econ, ResourceType resource, int amount, Resource<int>& res) {
+    requireSuccess(tryBuyResource(econ, resource, amount, res));
+}
+
+void Market::handleSmuggler(Economy& econ, Resource<int>& resource) {
+    // A kingdom that cannot pay simply gets no delivery, rather than aborting the rest of its turn
+    if (smugglerActive && econ.trySpend(50) == STATUS_OK) {
+        resource.adjust(100);
+        std::cout << GREEN << "Smugglers delivered 100 illegal goods for 50 gold.\n" << RESET;
+    }
+}
+
+void Market::handleGuildDemands(Economy& econ, Population& pop) {
+    if (!guildDemands) return;
+    pop.adjustMorale(-0.05);
+    if (econ.trySpend(200) == STATUS_OK) {
+        std::cout << RED << "Trader guild demands met, cost 200 gold, morale drops.\n" << RESET;
+    }
+    else {
+        std::cout << RED << "Trader guild demands unmet, morale drops.\n" << RESET;
+    }
+}
+
+bool Market::isSmugglerActive() const { return smugglerActive; }
+void Market::attachExchange(const Exchange* shared) { exchange = shared; }
+void Market::attachInflation(const Inflation* rate) { inflation = rate; }
+const Inflation* Market::getInflation() const { return inflation; }
+
+void Market::recordPrices() {
+    for (int i = 0; i < RESOURCE_COUNT; ++i) history[i].record(getPrice(static_cast<ResourceType>(i)));
+}
+
+const PriceHistory& Market::getHistory(ResourceType resource) const { return history[resource]; }
+
+
+void Market::serialize(BinaryWriter& out) const {
+    out.writeBool(boycott);
+    out.writeBool(sanctions);
+    out.writeBool(smugglerActive);
+    out.writeBool(guildDemands);
+    for (int i = 0; i < MAX_PRICES; ++i) {
+        out.writeDouble(prices[i].value);
+    }
+    for (int i = 0; i < RESOURCE_COUNT; ++i) history[i].serialize(out);
+}
+
+void Market::deserialize(BinaryReader& in, uint32_t version) {
+    boycott = in.readBool();
+    sanctions = in.readBool();
+    smugglerActive = in.readBool();
+    guildDemands = in.readBool();
+    for (int i = 0; i < MAX_PRICES; ++i) {
+        prices[i].value = in.readDouble();
+    }
+    // Saves before version 4 carry no history; start recording from this turn
+    for (int i = 0; i < RESOURCE_COUNT; ++i) {
+        if (version >= 4) history[i].deserialize(in);
+        else history[i].clear();
+    }
+}
+
+// Id of `kingdom` in the graph behind `view`; kingdoms sharing a graph (as in a World) skip the name lookup
+static KingdomId diplomacyId(const Diplomacy& view, const Kingdom& kingdom) {
+    const Diplomacy& own = kingdom.getDiplomacy();
+    return &own.getGraph() == &view.getGraph() ? own.getId() : view.getGraph().find(kingdom.getName());
+}
+
+// Espionage class
+Espionage::Espionage() : lastAction("None") {}
+
+// Gold and spies each mission needs, indexed by action - 1
+static const int MISSION_GOLD[3] = { 100, 150, 200 };
+static const int MISSION_SPIES[3] = { 5, 10, 15 };
+static const ActionStatus MISSION_SHORTFALL[3] = {
+    STATUS_INSUFFICIENT_SPY_RESOURCES, STATUS_INSUFFICIENT_SABOTAGE_RESOURCES, STATUS_INSUFFICIENT_THEFT_RESOURCES
+};
+
+ActionStatus Espionage::checkMission(int action, const Kingdom& source) {
+    if (action < 1 || action > 3) return STATUS_INVALID_ESPIONAGE_ACTION;
+    if (!source.getEconomy().canAfford(MISSION_GOLD[action - 1]) || source.getArmy().getSize() < MISSION_SPIES[action - 1])
+        return MISSION_SHORTFALL[action - 1];
+    return STATUS_OK;
+}
+
+ActionStatus Espionage::trySpyMission(Kingdom& source, Kingdom& target) {
+    ActionStatus status = checkMission(1, source);
+    if (status != STATUS_OK) return status;
+    Economy& econ = source.getEconomy();
     Army& army = source.getArmy();
-    if (econ.getGold() < 200 || army.getSize() < 15)
-        throw InsufficientResourcesException("Insufficient resources for theft");
-    econ.spend(200);
-    army.useSpies(15);
-    std::cout << "Attempting to steal gold from " << target.getName() << "...\n";
-    std::this_thread::sleep_for(std::chrono::seconds(5 + source.getWeather().getDelayImpact()));
-    double successChance = 0.5 * (target.getBank().isCorrupted() ? 1.4 : 1.0);
-    if (static_cast<double>(rand()) / RAND_MAX < successChance) {
-        int goldStolen = target.getEconomy().getGold() / 4;
-        target.getEconomy().spend(goldStolen);
-        source.getEconomy().spend(-goldStolen);
-        std::cout << GREEN << "Theft successful! Stole " << goldStolen << " gold.\n" << RESET;
-        lastAction = "Steal Gold";
+    econ.spend(100);
+    army.useSpies(5);
+    std::cout << "Sending spies to " << target.getName() << "...\n";
+    activeClock().wait(3 + source.getWeather().getDelayImpact());
+    double successChance = 0.7 * (target.getPopulation().getMorale() < 0.5 ? 1.2 : 1.0);
+    if (source.getRandom().nextDouble() < successChance) {
+        std::cout << GREEN << "Spy mission successful! Target status:\n" << RESET;
+        target.printStatus();
+        lastAction = "Spy Mission";
+    }
+    else {
+        std::cout << RED << "Spy mission failed! Spies detected.\n" << RESET;
+        target.getDiplomacy().handleEspionageFailure(diplomacyId(target.getDiplomacy(), source));
+        lastAction = "Failed Spy Mission";
+    }
+    return STATUS_OK;
+}
+
+void Espionage::spyMission(Kingdom& source, Kingdom& target) { requireSuccess(trySpyMission(source, target)); }
+
+ActionStatus Espionage::trySabotageWeapons(Kingdom& source, Kingdom& target) {
+    ActionStatus status = checkMission(2, source);
+    if (status != STATUS_OK) return status;
+    Economy& econ = source.getEconomy();
+    Army& army = source.getArmy();
+    econ.spend(150);
+    army.useSpies(10);
+    std::cout << "Attempting to sabotage " << target.getName() << "'s weapons...\n";
+    activeClock().wait(4 + source.getWeather().getDelayImpact());
+    double successChance = 0.6 * (target.getBlacksmith().isCorrupted() ? 1.3 : 1.0);
+    if (source.getRandom().nextDouble() < successChance) {
+        int weaponsLost = target.getBlacksmith().getWeaponsInStock() / 2;
+        target.getBlacksmith().useWeapons(weaponsLost);
+        std::cout << GREEN << "Sabotage successful! Destroyed " << weaponsLost << " weapons.\n" << RESET;
+        lastAction = "Sabotage Weapons";
+    }
+    else {
+        std::cout << RED << "Sabotage failed! Spies detected.\n" << RESET;
+        target.getDiplomacy().handleEspionageFailure(diplomacyId(target.getDiplomacy(), source));
+        lastAction = "Failed Sabotage";
+    }
+    return STATUS_OK;
+}
+
+void Espionage::sabotageWeapons(Kingdom& source, Kingdom& target) { requireSuccess(trySabotageWeapons(source, target)); }
+
+ActionStatus Espionage::tryStealGold(Kingdom& source, Kingdom& target) {
+    ActionStatus status = checkMission(3, source);
+    if (status != STATUS_OK) return status;
+    Economy& econ = source.getEconomy();
+    Army& army = source.getArmy();
+    econ.spend(200);
+    army.useSpies(15);
+    std::cout << "Attempting to steal gold from " << target.getName() << "...\n";
+    activeClock().wait(5 + source.getWeather().getDelayImpact());
+    double successChance = 0.5 * (target.getBank().isCorrupted() ? 1.4 : 1.0);
+    if (source.getRandom().nextDouble() < successChance) {
+        int goldStolen = target.getEconomy().getGold() / 4;
+        target.getEconomy().spend(goldStolen);
+        source.getEconomy().spend(-goldStolen);
+        std::cout << GREEN << "Theft successful! Stole " << goldStolen << " gold.\n" << RESET;
+        lastAction = "Steal Gold";
+    }
+    else {
+        std::cout << RED << "Theft failed! Spies detected.\n" << RESET;
+        target.getDiplomacy().handleEspionageFailure(diplomacyId(target.getDiplomacy(), source));
+        lastAction = "Failed Theft";
+    }
+    return STATUS_OK;
+}
+
+void Espionage::stealGold(Kingdom& source, Kingdom& target) { requireSuccess(tryStealGold(source, target)); }
+
+// Smuggling class
+Smuggling::Smuggling() : lastAction("None") {}
+
+ActionStatus Smuggling::trySmuggleGoods(Kingdom& source, Kingdom& target) {
+    Economy& econ = source.getEconomy();
+    if (!econ.canAfford(100)) return STATUS_INSUFFICIENT_SMUGGLING_GOLD;
+    if (!source.getDiplomacy().hasSecureRoute(diplomacyId(source.getDiplomacy(), target))) return STATUS_NO_SECURE_ROUTE;
+    econ.spend(100);
+    std::cout << "Smuggling goods to " << target.getName() << "...\n";
+    activeClock().wait(3 + source.getWeather().getDelayImpact());
+    double successChance = 0.8 * (target.getMarket().isSmugglerActive() ? 1.2 : 1.0);
+    if (source.getRandom().nextDouble() < successChance) {
+        int goods = 200;
+        source.getIron().adjust(goods);
+        target.getIron().adjust(-goods / 2);
+        std::cout << GREEN << "Smuggling successful! Gained " << goods << " iron.\n" << RESET;
+        lastAction = "Smuggle Goods";
+    }
+    else {
+        std::cout << RED << "Smuggling failed! Goods seized.\n" << RESET;
+        ActionStatus status = econ.trySpend(50);
+        if (status != STATUS_OK) return status;
+        lastAction = "Failed Smuggling";
+    }
+    return STATUS_OK;
+}
+
+void Smuggling::smuggleGoods(Kingdom& source, Kingdom& target) { requireSuccess(trySmuggleGoods(source, target)); }
+
+// Kingdom class
+// Every kingdom, on any thread, starts on the same map and shares it until it changes it. The
+// template is const and this reference keeps it shared, so the first change always copies it.
+static const std::shared_ptr<const Map>& startingMap() {
+    static const std::shared_ptr<const Map> map = std::make_shared<const Map>();
+    return map;
+}
+
+Kingdom::Kingdom(const std::string& kingdomName, const std::string& kingName, uint64_t seed, uint64_t stream)
+    : Kingdom(kingdomName, kingName, seed, stream, nullptr, nullptr) {}
+
+Kingdom::Kingdom(const std::string& kingdomName, const std::string& kingName, uint64_t seed, uint64_t stream,
+    MonotonicArena* arena, const std::shared_ptr<DiplomacyGraph>& graph)
+    : name(kingdomName), rng(seed, stream), exchange(nullptr), traderId(-1), quiet(false) {
+    for (int i = 0; i < RESOURCE_COUNT; ++i) {
+        resources[i] = Resource<int>(STARTING_RESOURCES[i]);
+    }
+    population = makeShared<Population>(arena);
+    economy = makeShared<Economy>(arena, 1000);
+    army = makeShared<Army>(arena, 100, 100);
+    bank = makeShared<Bank>(arena);
+    politics = makeShared<Politics>(arena, kingName);
+    blacksmith = makeShared<Blacksmith>(arena);
+    diplomacy = graph ? makeShared<Diplomacy>(arena, kingdomName, graph) : makeShared<Diplomacy>(arena, kingdomName);
+    communication = makeShared<Communication>(arena);
+    healthcare = makeShared<Healthcare>(arena);
+    buildings = makeShared<Buildings>(arena);
+    weather = makeShared<Weather>(arena);
+    inflation = makeShared<Inflation>(arena);
+    corruption = makeShared<Corruption>(arena);
+    map = std::const_pointer_cast<Map>(startingMap());
+    market = makeShared<Market>(arena, inflation.get());
+}
+
+Kingdom Kingdom::clone() const {
+    Kingdom copy(*this);
+    // The copy is a private what-if: it keeps its own diplomacy graph once it changes it, keeps
+    // messages in its own mailboxes and cannot trade. Actions aimed at another kingdom still change
+    // that kingdom, so look-ahead should aim them at clones too.
+    copy.diplomacy->fork();
+    copy.communication->isolate();
+    copy.exchange = nullptr;
+    copy.traderId = -1;
+    return copy;
+}
+
+void Kingdom::stepDeterministic() {
+    resources[FOOD].adjust(weather->getFoodImpact());
+    economy->collectTaxes(*population);
+    army->checkMorale(*economy);
+    inflation->update(*economy, *bank, *market);
+    bindMarket();
+}
+
+void Kingdom::bindMarket() {
+    // The market reads the inflation rate through a pointer; once this kingdom's inflation has been
+    // copied on write, its market has to follow it to the copy
+    if (market.get()->getInflation() != inflation.get()) market->attachInflation(inflation.get());
+}
+
+void Kingdom::playTurn() {
+    PROFILE_SCOPE("playTurn");
+    std::cout << BOLD << "=== Turn in " << name << " ===\n" << RESET;
+    { PROFILE_SCOPE("exchangeSettlement"); collectTrades(); }
+    {
+        PROFILE_SCOPE("weather");
+        weather->updateWeather(rng);
+        resources[FOOD].adjust(weather->getFoodImpact());
+        if (weather->getFoodImpact() < 0)
+            std::cout << RED << "Weather reduced food by " << -weather->getFoodImpact() << "!\n" << RESET;
+        else if (weather->getFoodImpact() > 0)
+            std::cout << GREEN << "Weather increased food by " << weather->getFoodImpact() << "!\n" << RESET;
+    }
+    { PROFILE_SCOPE("taxes"); economy->collectTaxes(*population); }
+    { PROFILE_SCOPE("marketCrash"); economy->triggerMarketCrash(*population, rng); }
+    { PROFILE_SCOPE("bankCorruption"); bank->checkCorruption(rng); }
+    { PROFILE_SCOPE("landSeizure"); bank->seizeLand(*economy, *map, rng); }
+    { PROFILE_SCOPE("armyMorale"); army->checkMorale(*economy); }
+    { PROFILE_SCOPE("trainingDelay"); army->applyTrainingDelay(); }
+    { PROFILE_SCOPE("corruption"); corruption->checkCorruption(rng); }
+    {
+        PROFILE_SCOPE("inflation");
+        inflation->update(*economy, *bank, *market);
+        bindMarket();
+    }
+    { PROFILE_SCOPE("classConflict"); population->handleClassConflict(rng); }
+    { PROFILE_SCOPE("rebellion"); politics->triggerRebellion(*population, *economy, rng); }
+    { PROFILE_SCOPE("enemyAttack"); map->enemyAttack(resources[FOOD], rng); }
+    { PROFILE_SCOPE("smuggler"); market->handleSmuggler(*economy, resources[IRON]); }
+    { PROFILE_SCOPE("guildDemands"); market->handleGuildDemands(*economy, *population); }
+    { PROFILE_SCOPE("randomEvent"); randomEvent(); }
+    { PROFILE_SCOPE("marketHistory"); market->recordPrices(); }
+    { PROFILE_SCOPE("validation"); Validation::validateKingdom(*this); }
+}
+
+void Kingdom::randomEvent() {
+    int event = rng.nextInt(10);
+    switch (event) {
+    case 0:
+        population->adjustClassSize(PEASANTS, -static_cast<int>(population->getTotalSize() / 5 * (1 - healthcare->getPlagueReduction())));
+        population->adjustMorale(-0.15);
+        std::cout << RED << "Plague spreads! Population decreases significantly.\n" << RESET;
+        break;
+    case 1:
+        economy->spend(economy->getGold() / 10);
+        std::cout << RED << "Bandits raid the treasury!\n" << RESET;
+        break;
+    case 2:
+        resources[FOOD].adjust(500);
+        population->adjustMorale(0.1);
+        std::cout << GREEN << "Bumper harvest! Food increases.\n" << RESET;
+        break;
+    case 3:
+        resources[FOOD].adjust(-300);
+        std::cout << RED << "Drought! Food supply decreases.\n" << RESET;
+        break;
+    case 4:
+        market->updatePrices(rng);
+        std::cout << RED << "Sanctions imposed! Market prices increase.\n" << RESET;
+        break;
+    case 5:
+        population->adjustMorale(-0.1);
+        politics->getCandidates()[rng.nextInt(politics->getCandidateCount())].setCorrupted(true);
+        std::cout << RED << "Assassination attempt on king! Candidate corrupted.\n" << RESET;
+        break;
+    case 6:
+        economy->triggerMarketCrash(*population, rng);
+        std::cout << RED << "Market crash! Prices soar.\n" << RESET;
+        break;
+    case 7:
+        population->adjustMorale(-0.05);
+        std::cout << RED << "Revolt risk rises!\n" << RESET;
+        break;
+    case 8:
+        population->adjustClassSize(NOBILITY, -population->getClasses()[NOBILITY].size / 2);
+        population->adjustMorale(-0.1);
+        std::cout << RED << "Noble uprising! Nobility population halved.\n" << RESET;
+        break;
+    case 9:
+        army->getGeneral().setCorrupted(true);
+        std::cout << RED << "Spy infiltration! General corrupted.\n" << RESET;
+        break;
+    }
+}
+
+ActionStatus Kingdom::tryTrainArmy(int count) {
+    PROFILE_SCOPE("trainArmy");
+    return army->tryTrain(count, *population, resources, *blacksmith, buildings->getTrainingEfficiency());
+}
+
+void Kingdom::trainArmy(int count) { requireSuccess(tryTrainArmy(count)); }
+
+void Kingdom::holdElection() {
+    PROFILE_SCOPE("holdElection");
+    politics->holdElection(*population, *economy, rng);
+}
+
+ActionStatus Kingdom::tryManageLoanOrAudit(int choice, int amount) {
+    PROFILE_SCOPE("manageLoanOrAudit");
+    if (choice == 1) {
+        bank->takeLoan(*economy, amount);
+    }
+    else if (choice == 2) {
+        return bank->tryRepayLoan(*economy, amount);
+    }
+    else if (choice == 3) {
+        return corruption->tryAudit(*economy, *army, *politics, *blacksmith);
+    }
+    return STATUS_OK;
+}
+
+void Kingdom::manageLoanOrAudit(int choice, int amount) { requireSuccess(tryManageLoanOrAudit(choice, amount)); }
+
+ActionStatus Kingdom::tryBuyResource(ResourceType resource, int amount) {
+    PROFILE_SCOPE("buyResource");
+    return market->tryBuyResource(*economy, resource, amount, resources[resource]);
+}
+
+void Kingdom::buyResource(ResourceType resource, int amount) { requireSuccess(tryBuyResource(resource, amount)); }
+
+void Kingdom::buyResource(const std::string& resource, int amount) {
+    ResourceType type;
+    if (!parseResourceType(resource, type)) throw InsufficientResourcesException("Invalid resource");
+    buyResource(type, amount);
+}
+
+void Kingdom::manageDiplomacy(const std::string& kingdom, int choice) {
+    PROFILE_SCOPE("manageDiplomacy");
+    if (choice == 1) diplomacy->formAlliance(kingdom);
+    else if (choice == 2) diplomacy->breakAlliance(kingdom);
+    else if (choice == 3) diplomacy->formTradeAgreement(kingdom);
+    else if (choice == 4) diplomacy->establishSecureRoute(kingdom);
+}
+
+ActionStatus Kingdom::tryManageDiplomacy(KingdomId kingdom, int choice) {
+    PROFILE_SCOPE("manageDiplomacy");
+    if (choice == 1) return diplomacy->tryFormAlliance(kingdom);
+    if (choice == 2) return diplomacy->tryBreakAlliance(kingdom);
+    if (choice == 3) return diplomacy->tryFormTradeAgreement(kingdom);
+    if (choice == 4) return diplomacy->tryEstablishSecureRoute(kingdom);
+    return STATUS_OK;
+}
+
+void Kingdom::manageDiplomacy(KingdomId kingdom, int choice) { requireSuccess(tryManageDiplomacy(kingdom, choice)); }
+
+ActionStatus Kingdom::tryBribeOrBlackmail(int choice, const std::string& candidate) {
+    PROFILE_SCOPE("bribeOrBlackmail");
+    if (choice == 1) return politics->tryBribe(*economy, candidate);
+    if (choice == 2) return politics->tryBlackmail(*economy, candidate);
+    return STATUS_OK;
+}
+
+void Kingdom::bribeOrBlackmail(int choice, const std::string& candidate) {
+    requireSuccess(tryBribeOrBlackmail(choice, candidate));
+}
+
+void Kingdom::sendMessage(const std::string& recipient, const std::string& message) {
+    PROFILE_SCOPE("sendMessage");
+    communication->sendMessage(recipient, message, false);
+}
+
+ActionStatus Kingdom::trySendMessage(KingdomId recipient, const std::string& message) {
+    PROFILE_SCOPE("sendMessage");
+    return communication->trySendMessage(recipient, message, false);
+}
+
+void Kingdom::sendMessage(KingdomId recipient, const std::string& message) { requireSuccess(trySendMessage(recipient, message)); }
+
+void Kingdom::sendFakeTradeRequest(const std::string& recipient) {
+    PROFILE_SCOPE("sendFakeTradeRequest");
+    communication->sendFakeTradeRequest(recipient);
+}
+
+ActionStatus Kingdom::trySendFakeTradeRequest(KingdomId recipient) {
+    PROFILE_SCOPE("sendFakeTradeRequest");
+    return communication->trySendFakeTradeRequest(recipient);
+}
+
+void Kingdom::sendFakeTradeRequest(KingdomId recipient) { requireSuccess(trySendFakeTradeRequest(recipient)); }
+
+void Kingdom::attachPostOffice(PostOffice* office) {
+    communication->attach(office);
+}
+
+void Kingdom::attachDiplomacyGraph(const std::shared_ptr<DiplomacyGraph>& graph) {
+    diplomacy->attach(graph);
+}
+
+void Kingdom::attachExchange(Exchange* shared) {
+    exchange = shared;
+    traderId = shared ? shared->registerTrader(name) : -1;
+    market->attachExchange(shared);
+}
+
+ActionStatus Kingdom::tryPlaceOrder(ResourceType resource, OrderSide side, int price, int quantity, OrderId* id) {
+    PROFILE_SCOPE("placeOrder");
+    if (!exchange) return STATUS_NO_EXCHANGE;
+    OrderId placed = 0;
+    ActionStatus status = exchange->tryPlaceOrder(traderId, side, resource, price, quantity, *economy, resources[resource], placed);
+    if (status != STATUS_OK) return status;
+    collectTrades();
+    std::cout << GREEN << (side == SIDE_BUY ? "Buy" : "Sell") << " order #" << placed << " placed: " << quantity << " "
+        << RESOURCE_NAMES[resource] << " at " << price << " gold.\n" << RESET;
+    if (id) *id = placed;
+    return STATUS_OK;
+}
+
+OrderId Kingdom::placeOrder(ResourceType resource, OrderSide side, int price, int quantity) {
+    OrderId id = 0;
+    ActionStatus status = tryPlaceOrder(resource, side, price, quantity, &id);
+    if (status == STATUS_INSUFFICIENT_RESOURCES) throw InsufficientResourcesException(std::string("Insufficient ") + RESOURCE_NAMES[resource]);
+    requireSuccess(status);
+    return id;
+}
+
+ActionStatus Kingdom::tryCancelOrder(OrderId id) {
+    if (!exchange || !exchange->cancelOrder(traderId, id)) return STATUS_NO_SUCH_ORDER;
+    collectTrades();
+    std::cout << YELLOW << "Order #" << id << " cancelled.\n" << RESET;
+    return STATUS_OK;
+}
+
+void Kingdom::cancelOrder(OrderId id) { requireSuccess(tryCancelOrder(id)); }
+
+void Kingdom::collectTrades() {
+    if (exchange) exchange->collect(traderId, *economy, resources);
+}
+
+void Kingdom::viewMessages() {
+    PROFILE_SCOPE("viewMessages");
+    communication->viewMessages(name);
+}
+
+ActionStatus Kingdom::tryUpgradeBlacksmith() {
+    PROFILE_SCOPE("upgradeBlacksmith");
+    return blacksmith->tryUpgrade(*economy);
+}
+
+void Kingdom::upgradeBlacksmith() { requireSuccess(tryUpgradeBlacksmith()); }
+
+ActionStatus Kingdom::tryProduceWeapons(int count) {
+    PROFILE_SCOPE("produceWeapons");
+    return blacksmith->tryProduceWeapons(resources, count);
+}
+
+void Kingdom::produceWeapons(int count) { requireSuccess(tryProduceWeapons(count)); }
+
+ActionStatus Kingdom::tryConductEspionage(int action, Kingdom& target) {
+    PROFILE_SCOPE("conductEspionage");
+    Espionage espionage;
+    if (action == 1) return espionage.trySpyMission(*this, target);
+    if (action == 2) return espionage.trySabotageWeapons(*this, target);
+    if (action == 3) return espionage.tryStealGold(*this, target);
+    return STATUS_INVALID_ESPIONAGE_ACTION;
+}
+
+void Kingdom::conductEspionage(int action, Kingdom& target) { requireSuccess(tryConductEspionage(action, target)); }
+
+ActionStatus Kingdom::tryConductSmuggling(Kingdom& target) {
+    PROFILE_SCOPE("conductSmuggling");
+    Smuggling smuggling;
+    return smuggling.trySmuggleGoods(*this, target);
+}
+
+void Kingdom::conductSmuggling(Kingdom& target) { requireSuccess(tryConductSmuggling(target)); }
+
+ActionStatus Kingdom::tryManageHealthcare(int choice) {
+    PROFILE_SCOPE("manageHealthcare");
+    return healthcare->tryManageHealthcare(choice, *economy, resources, *population);
+}
+
+void Kingdom::manageHealthcare(int choice) { requireSuccess(tryManageHealthcare(choice)); }
+
+ActionStatus Kingdom::tryManageBuildings(int choice) {
+    PROFILE_SCOPE("manageBuildings");
+    return buildings->tryManageBuildings(choice, *economy, resources);
+}
+
+void Kingdom::manageBuildings(int choice) { requireSuccess(tryManageBuildings(choice)); }
+
+void Kingdom::snapshot(std::string& out) const {
+    size_t start = out.size();
+    BinaryWriter writer(out);
+    writer.writeUInt(SAVE_FORMAT_MAGIC);
+    writer.writeUInt(SAVE_FORMAT_VERSION);
+    writer.writeUInt64(0);  // payload size, patched below
+    writer.writeUInt(0);    // checksum, patched below
+    size_t payloadStart = out.size();
+    writer.writeString(name);
+    for (int i = 0; i < RESOURCE_COUNT; ++i) {
+        writer.writeInt(resources[i].get());
+    }
+    population->serialize(writer);
+    economy->serialize(writer);
+    army->serialize(writer);
+    bank->serialize(writer);
+    politics->serialize(writer);
+    blacksmith->serialize(writer);
+    diplomacy->serialize(writer);
+    communication->serialize(writer);
+    healthcare->serialize(writer);
+    buildings->serialize(writer);
+    weather->serialize(writer);
+    inflation->serialize(writer);
+    corruption->serialize(writer);
+    map->serialize(writer);
+    market->serialize(writer);
+    rng.serialize(writer);
+    uint64_t payloadSize = out.size() - payloadStart;
+    uint32_t checksum = snapshotChecksum(out.data() + payloadStart, static_cast<size_t>(payloadSize));
+    std::memcpy(&out[start + 8], &payloadSize, sizeof(payloadSize));
+    std::memcpy(&out[start + 16], &checksum, sizeof(checksum));
+}
+
+std::string Kingdom::snapshot() const {
+    std::string out;
+    snapshot(out);
+    return out;
+}
+
+void Kingdom::restore(const char* data, size_t size) {
+    SnapshotHeader header;
+    if (!readSnapshotHeader(data, size, header)) throw std::runtime_error("Corrupt save data: bad header");
+    if (header.version < 1 || header.version > SAVE_FORMAT_VERSION) throw std::runtime_error("Unsupported save format version");
+    const char* payload = data + SNAPSHOT_HEADER_SIZE;
+    size_t payloadSize = static_cast<size_t>(header.payloadSize);
+    if (snapshotChecksum(payload, payloadSize) != header.checksum) throw std::runtime_error("Corrupt save data: checksum mismatch");
+    // Snapshots do not hold exchange escrow, so an open order would hand its gold or goods back on top of the saved stock
+    if (exchange && exchange->getOpenOrderCount(traderId) > 0) {
+        throw std::runtime_error("Cancel your open exchange orders before loading a saved game");
+    }
+    // Read into a copy-on-write copy so a bad record leaves this kingdom untouched. Its diplomacy is
+    // forked, keeping the shared graph out of it until the whole record has been read.
+    Kingdom loaded(*this);
+    loaded.diplomacy->fork();
+    BinaryReader reader(payload, payloadSize);
+    loaded.name = reader.readString();
+    for (int i = 0; i < RESOURCE_COUNT; ++i) {
+        loaded.resources[i] = Resource<int>(reader.readInt());
+    }
+    loaded.population->deserialize(reader);
+    loaded.economy->deserialize(reader);
+    loaded.army->deserialize(reader);
+    loaded.bank->deserialize(reader);
+    loaded.politics->deserialize(reader);
+    loaded.blacksmith->deserialize(reader);
+    size_t relationsOffset = payloadSize - reader.remaining();
+    loaded.diplomacy->setOwner(loaded.name);
+    loaded.diplomacy->deserialize(reader);
+    loaded.communication->deserialize(reader, header.version);
+    loaded.healthcare->deserialize(reader);
+    loaded.buildings->deserialize(reader);
+    loaded.weather->deserialize(reader);
+    loaded.inflation->deserialize(reader);
+    loaded.bindMarket();
+    loaded.corruption->deserialize(reader);
+    loaded.map->deserialize(reader, header.version);
+    loaded.market->deserialize(reader, header.version);
+    loaded.rng.deserialize(reader);
+    if (reader.remaining() != 0) throw std::runtime_error("Corrupt save data: trailing bytes");
+
+    // The record is good: replay its relations on the live graph and swap the copy in
+    BinaryReader relations(payload + relationsOffset, payloadSize - relationsOffset);
+    loaded.diplomacy = diplomacy;
+    loaded.diplomacy->setOwner(loaded.name);
+    loaded.diplomacy->deserialize(relations);
+    *this = std::move(loaded);
+}
+
+std::string Kingdom::snapshotName(const char* data, size_t size) {
+    SnapshotHeader header;
+    if (!readSnapshotHeader(data, size, header)) throw std::runtime_error("Corrupt save data: bad header");
+    BinaryReader reader(data + SNAPSHOT_HEADER_SIZE, static_cast<size_t>(header.payloadSize));
+    return reader.readString();
+}
+
+static std::string readWholeFile(std::ifstream& file) {
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+void Kingdom::saveState(const std::string& filename) const {
+    // A save file holds one snapshot per kingdom; saving replaces this kingdom's previous snapshot
+    std::string existing;
+    {
+        std::ifstream in(filename, std::ios::binary);
+        if (in.is_open()) existing = readWholeFile(in);
+    }
+    std::string output;
+    SnapshotHeader header;
+    size_t offset = 0;
+    while (readSnapshotHeader(existing.data() + offset, existing.size() - offset, header)) {
+        size_t recordSize = SNAPSHOT_HEADER_SIZE + static_cast<size_t>(header.payloadSize);
+        if (snapshotName(existing.data() + offset, recordSize) != name) {
+            output.append(existing, offset, recordSize);
+        }
+        offset += recordSize;
+    }
+    // Anything left over (an old text save, a torn write) would be lost with the rewrite
+    if (offset != existing.size()) {
+        throw std::runtime_error("Save file " + filename + " has records that cannot be read; not overwriting it");
+    }
+    snapshot(output);
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) throw std::runtime_error("Cannot open save file");
+    file.write(output.data(), static_cast<std::streamsize>(output.size()));
+    file.close();
+    std::cout << GREEN << "Game state saved for " << name << "!\n" << RESET;
+}
+
+void Kingdom::loadState(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cout << YELLOW << "No save file found for " << name << ". Starting new game.\n" << RESET;
+        return;
+    }
+    std::string contents = readWholeFile(file);
+    file.close();
+    SnapshotHeader header;
+    size_t offset = 0;
+    while (readSnapshotHeader(contents.data() + offset, contents.size() - offset, header)) {
+        size_t recordSize = SNAPSHOT_HEADER_SIZE + static_cast<size_t>(header.payloadSize);
+        if (snapshotName(contents.data() + offset, recordSize) == name) {
+            restore(contents.data() + offset, recordSize);
+            std::cout << GREEN << "Game state loaded for " << name << "!\n" << RESET;
+            return;
+        }
+        offset += recordSize;
+    }
+    std::cout << YELLOW << "No saved state for " << name << " in " << filename << ".\n" << RESET;
+}
+
+void Kingdom::saveScore() const {
+    ScoreRecord record;
+    record.timestamp = static_cast<int64_t>(time(nullptr));
+    record.score = calculateScore();
+    record.gold = economy->getGold();
+    record.army = army->getSize();
+    record.morale = population->getMorale();
+    record.kingdom = name;
+    Leaderboard::append("scores.dat", record);
+    std::cout << GREEN << "Score saved to scores.dat for " << name << "!\n" << RESET;
+}
+
+bool Kingdom::isCollapsed() const {
+    return population->getTotalSize() == 0 || (economy->getGold() == 0 && resources[FOOD].get() == 0);
+}
+
+int Kingdom::calculateScore() const {
+    int moraleScore = static_cast<int>(population->getMorale() * 300);
+    int goldScore = std::min(1000, economy->getGold() / 10) * 250;
+    int armyScore = army->getSize() * 2;
+    int resourceScore = (resources[FOOD].get() + resources[IRON].get() + resources[WOOD].get() + resources[STONE].get()) / 10;
+    int diplomacyScore = diplomacy->getAllianceCount() * 50;
+    OwnerId bankOwner = map->findOwner("Bank");
+    int landPenalty = bankOwner == UNOWNED ? 0 : static_cast<int>(map->getTileCount(bankOwner)) * 100;
+    return moraleScore + goldScore + armyScore + resourceScore + diplomacyScore - landPenalty;
+}
+
+void Kingdom::setQuiet(bool silent) { quiet = silent; }
+bool Kingdom::isQuiet() const { return quiet; }
+
+void Kingdom::printStatus() const {
+    if (quiet) return;
+    std::vector<std::string> lines;
+    renderStatus(lines);
+    std::string text;
+    for (const std::string& line : lines) text += line + "\n";
+    std::cout << text;
+}
+
+void Kingdom::renderStatus(std::vector<std::string>& lines) const {
+    std::ostringstream line;
+    auto emit = [&]() {
+        lines.push_back(line.str());
+        line.str("");
+    };
+    line << YELLOW << "Kingdom Status (" << name << "):" << RESET; emit();
+    line << "Population: " << population->getTotalSize() << ", Morale: " << population->getMorale(); emit();
+    const ResourcePair* classes = population->getClasses();
+    for (int i = 0; i < MAX_CLASSES; ++i) {
+        line << "  " << classes[i].name << ": " << classes[i].size << ", Satisfaction: " << classes[i].satisfaction; emit();
+    }
+    line << "Gold: " << economy->getGold() << ", Loan: " << bank->getLoan() << ", Debt Reliance: " << economy->getDebtReliance(); emit();
+    line << "Army: " << army->getSize() << ", Morale: " << army->getMorale() << ", Weapons: " << army->getWeapons(); emit();
+    line << "Resources: Food=" << resources[FOOD].get() << ", Iron=" << resources[IRON].get()
+        << ", Wood=" << resources[WOOD].get() << ", Stone=" << resources[STONE].get(); emit();
+    line << "Blacksmith: Level=" << blacksmith->getLevel() << ", Weapons in stock=" << blacksmith->getWeaponsInStock(); emit();
+    line << "Healthcare: Level=" << healthcare->getLevel() << ", Plague Reduction=" << healthcare->getPlagueReduction() * 100 << "%"; emit();
+    line << "Barracks: Level=" << buildings->getBarracksLevel() << ", Training Efficiency="
+        << buildings->getTrainingEfficiency() * 100 << "%"; emit();
+    line << "Weather: " << weather->getSeason() << ", " << weather->getWeather(); emit();
+    line << "Inflation: " << inflation->getRate(); emit();
+    line << "Prices (avg/vol):";
+    for (int i = 0; i < RESOURCE_COUNT; ++i) {
+        const PriceHistory& history = market->getHistory(static_cast<ResourceType>(i));
+        line << " " << RESOURCE_NAMES[i] << "=" << std::fixed << std::setprecision(2)
+            << market->getPrice(static_cast<ResourceType>(i)) << " (" << history.movingAverage() << "/"
+            << history.volatility() * 100 << "%)";
+    }
+    line << std::defaultfloat; emit();
+    line << "King: " << politics->getCurrentKing(); emit();
+    line << "Tax: " << (economy->isProgressiveTax() ? "Progressive" : "Flat"); emit();
+    line << "Land Seized by Bank: " << bank->getLandSeized(); emit();
+    line << "Score: " << calculateScore() << " points"; emit();
+    map->render(lines);
+}
+
+Bank& Kingdom::getBank() { return *bank; }
+const Bank& Kingdom::getBank() const { return *bank; }
+Resource<int>& Kingdom::getResource(ResourceType type) { return resources[type]; }
+const Resource<int>& Kingdom::getResource(ResourceType type) const { return resources[type]; }
+Resource<int>& Kingdom::getIron() { return resources[IRON]; }
+const Resource<int>& Kingdom::getIron() const { return resources[IRON]; }
+const Resource<int>& Kingdom::getFood() const { return resources[FOOD]; }
+const Resource<int>& Kingdom::getWood() const { return resources[WOOD]; }
+const Resource<int>& Kingdom::getStone() const { return resources[STONE]; }
+Economy& Kingdom::getEconomy() { return *economy; }
+const Economy& Kingdom::getEconomy() const { return *economy; }
+Population& Kingdom::getPopulation() { return *population; }
+const Population& Kingdom::getPopulation() const { return *population; }
+Army& Kingdom::getArmy() { return *army; }
+const Army& Kingdom::getArmy() const { return *army; }
+Blacksmith& Kingdom::getBlacksmith() { return *blacksmith; }
+const Blacksmith& Kingdom::getBlacksmith() const { return *blacksmith; }
+Diplomacy& Kingdom::getDiplomacy() { return *diplomacy; }
+const Diplomacy& Kingdom::getDiplomacy() const { return *diplomacy; }
+Weather& Kingdom::getWeather() { return *weather; }
+const Weather& Kingdom::getWeather() const { return *weather; }
+const Inflation& Kingdom::getInflation() const { return *inflation; }
+Market& Kingdom::getMarket() { return *market; }
+const Market& Kingdom::getMarket() const { return *market; }
+Random& Kingdom::getRandom() { return rng; }
+std::string Kingdom::getName() const { return name; }
+KingdomId Kingdom::getId() const { return diplomacy->getId(); }
+
+// World class
+World::World(uint64_t seed)
+    : seed(seed), postOffice(std::make_unique<PostOffice>()), diplomacyGraph(std::make_shared<DiplomacyGraph>()),
+    exchange(std::make_unique<Exchange>()) {}
+
+void World::reserve(int count) { kingdoms.reserve(count); }
+
+KingdomId World::addKingdom(const std::string& kingdomName, const std::string& kingName) {
+    if (ids.find(kingdomName) != ids.end()) throw std::runtime_error("Kingdom name already in use: " + kingdomName);
+    if (kingdoms.size() >= static_cast<size_t>(MAX_KINGDOMS)) throw std::runtime_error("Too many kingdoms in world");
+    KingdomId id = static_cast<KingdomId>(kingdoms.size());
+    if (postOffice->registerRecipient(kingdomName) != id || diplomacyGraph->addKingdom(kingdomName) != id)
+        throw std::runtime_error("World registries out of step for " + kingdomName);
+    kingdoms.emplace_back(kingdomName, kingName, seed, kingdoms.size() + 1, &arena, diplomacyGraph);
+    kingdoms.back().attachPostOffice(postOffice.get());
+    kingdoms.back().attachExchange(exchange.get());
+    ids.emplace(kingdomName, id);
+    return id;
+}
+
+KingdomId World::find(const std::string& name) const {
+    auto existing = ids.find(name);
+    return existing == ids.end() ? NO_KINGDOM : existing->second;
+}
+
+bool World::contains(KingdomId id) const { return id < kingdoms.size(); }
+int World::getKingdomCount() const { return static_cast<int>(kingdoms.size()); }
+Kingdom& World::getKingdom(KingdomId id) { return kingdoms[id]; }
+const Kingdom& World::getKingdom(KingdomId id) const { return kingdoms[id]; }
+PostOffice& World::getPostOffice() { return *postOffice; }
+DiplomacyGraph& World::getDiplomacyGraph() { return *diplomacyGraph; }
+Exchange& World::getExchange() { return *exchange; }
+const MonotonicArena& World::getArena() const { return arena; }
+
+// Validation class
+void Validation::validateKingdom(const Kingdom& kingdom) {
+    if (kingdom.getEconomy().getGold() < 0)
+        std::cout << RED << "Warning: Negative gold detected!\n" << RESET;
+    if (kingdom.getPopulation().getMorale() < 0 || kingdom.getPopulation().getMorale() > 1)
+        std::cout << RED << "Warning: Invalid morale!\n" << RESET;
+    if (kingdom.getArmy().getSize() < 0)
+        std::cout << RED << "Warning: Negative army size!\n" << RESET;
+    if (kingdom.getBank().getLoan() > 5000)
+        std::cout << RED << "Warning: Excessive loan detected!\n" << RESET;
+}
+
+// ConsoleSilencer class
+ConsoleSilencer::ConsoleSilencer() : saved(std::cout.rdbuf(nullptr)) {}
+
+ConsoleSilencer::~ConsoleSilencer() {
+    std::cout.rdbuf(saved);
+    if (saved) std::cout.clear();
+}
+
+// Simulation class
+Simulation::Simulation(int count, uint64_t seed, bool quiet)
+    : turnCount(0), actionCount(0), failedActions(0), quiet(quiet), seed(seed), rng(seed, 0), world(seed) {
+    world.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        addKingdom("Kingdom " + std::to_string(i + 1), "King " + std::to_string(i + 1));
+    }
+}
+
+int Simulation::addKingdom(const std::string& kingdomName, const std::string& kingName) {
+    if (quiet) {
+        ConsoleSilencer silencer;
+        return world.addKingdom(kingdomName, kingName);
+    }
+    return world.addKingdom(kingdomName, kingName);
+}
+
+bool Simulation::apply(int kingdom, const Action& action) {
+    ClockScope scope(clock);
+    if (quiet) {
+        ConsoleSilencer silencer;
+        return perform(kingdom, action);
+    }
+    return perform(kingdom, action);
+}
+
+bool Simulation::perform(int kingdom, const Action& action) {
+    actionCount++;
+    bool hasTarget = action.target >= 0 && action.target < getKingdomCount() && action.target != kingdom;
+    ActionStatus status;
+    try {
+        status = tryExecute(world.getKingdom(static_cast<KingdomId>(kingdom)),
+            hasTarget ? &world.getKingdom(static_cast<KingdomId>(action.target)) : nullptr, action);
+    }
+    catch (const std::exception&) {
+        status = STATUS_INVALID_ACTION;
+    }
+    if (status != STATUS_OK) failedActions++;
+    return status == STATUS_OK;
+}
+
+bool Simulation::needsTarget(ActionType type) {
+    return type == ACTION_DIPLOMACY || type == ACTION_SEND_MESSAGE || type == ACTION_FAKE_TRADE_REQUEST ||
+        type == ACTION_ESPIONAGE || type == ACTION_SMUGGLING;
+}
+
+ActionStatus Simulation::tryExecute(Kingdom& current, Kingdom* target, const Action& action) {
+    if (needsTarget(action.type) && (!target || target == &current)) return STATUS_INVALID_TARGET;
+    switch (action.type) {
+    case ACTION_PLAY_TURN: current.playTurn(); break;
+    case ACTION_TRAIN_ARMY: return current.tryTrainArmy(action.amount);
+    case ACTION_HOLD_ELECTION: current.holdElection(); break;
+    case ACTION_LOAN_OR_AUDIT: return current.tryManageLoanOrAudit(action.choice, action.amount);
+    case ACTION_BUY_RESOURCE: return current.tryBuyResource(action.resource, action.amount);
+    case ACTION_DIPLOMACY: return current.tryManageDiplomacy(target->getId(), action.choice);
+    case ACTION_BRIBE_OR_BLACKMAIL: return current.tryBribeOrBlackmail(action.choice, action.text);
+    case ACTION_SEND_MESSAGE: return current.trySendMessage(target->getId(), action.text);
+    case ACTION_FAKE_TRADE_REQUEST: return current.trySendFakeTradeRequest(target->getId());
+    case ACTION_VIEW_MESSAGES: current.viewMessages(); break;
+    case ACTION_UPGRADE_BLACKSMITH: return current.tryUpgradeBlacksmith();
+    case ACTION_PRODUCE_WEAPONS: return current.tryProduceWeapons(action.amount);
+    case ACTION_ESPIONAGE: return current.tryConductEspionage(action.choice, *target);
+    case ACTION_SMUGGLING: return current.tryConductSmuggling(*target);
+    case ACTION_HEALTHCARE: return current.tryManageHealthcare(action.choice);
+    case ACTION_BUILDINGS: return current.tryManageBuildings(action.choice);
+    case ACTION_TRADE:
+        if (action.choice == 3) return current.tryCancelOrder(static_cast<OrderId>(action.amount));
+        return current.tryPlaceOrder(action.resource, action.choice == 1 ? SIDE_BUY : SIDE_SELL, action.price, action.amount);
+    default: return STATUS_INVALID_ACTION;
+    }
+    return STATUS_OK;
+}
+
+void Simulation::execute(Kingdom& current, Kingdom* target, const Action& action) {
+    requireSuccess(tryExecute(current, target, action));
+}
+
+void Simulation::step() {
+    ClockScope scope(clock);
+    std::unique_ptr<ConsoleSilencer> silencer(quiet ? new ConsoleSilencer() : nullptr);
+    for (int i = 0; i < getKingdomCount(); ++i) {
+        perform(i, Action());
+    }
+    turnCount++;
+}
+
+void Simulation::run(int turns, const ActionPolicy& policy) {
+    ClockScope scope(clock);
+    std::unique_ptr<ConsoleSilencer> silencer(quiet ? new ConsoleSilencer() : nullptr);
+    for (int t = 0; t < turns; ++t) {
+        for (int i = 0; i < getKingdomCount(); ++i) {
+            if (policy) perform(i, policy(*this, i));
+        }
+        step();
+    }
+}
+
+Action Simulation::randomAction(Simulation& sim, int kingdom) {
+    Random& rng = sim.getRandom();
+    Action action;
+    int pick = 1 + rng.nextInt(ACTION_BUILDINGS + 1);
+    action.type = pick > ACTION_BUILDINGS ? ACTION_TRADE : static_cast<ActionType>(pick);
+    action.target = sim.getKingdomCount() > 1 ? (kingdom + 1 + rng.nextInt(sim.getKingdomCount() - 1)) % sim.getKingdomCount() : -1;
+    switch (action.type) {
+    case ACTION_TRAIN_ARMY: action.amount = 1 + rng.nextInt(100); break;
+    case ACTION_LOAN_OR_AUDIT:
+        action.choice = 1 + rng.nextInt(3);
+        action.amount = 1 + rng.nextInt(2000);
+        break;
+    case ACTION_BUY_RESOURCE:
+        action.resource = static_cast<ResourceType>(rng.nextInt(RESOURCE_COUNT));
+        action.amount = 1 + rng.nextInt(200);
+        break;
+    case ACTION_DIPLOMACY: action.choice = 1 + rng.nextInt(4); break;
+    case ACTION_BRIBE_OR_BLACKMAIL:
+        action.choice = 1 + rng.nextInt(2);
+        action.text = "Arthur";
+        break;
+    case ACTION_SEND_MESSAGE: action.text = "Greetings"; break;
+    case ACTION_PRODUCE_WEAPONS: action.amount = 1 + rng.nextInt(50); break;
+    case ACTION_ESPIONAGE: action.choice = 1 + rng.nextInt(3); break;
+    case ACTION_HEALTHCARE: action.choice = 1 + rng.nextInt(2); break;
+    case ACTION_BUILDINGS: action.choice = 1; break;
+    case ACTION_TRADE: {
+        // Quote within 20% either side of the rolling average, or the spot price before any history
+        action.choice = 1 + rng.nextInt(2);
+        action.resource = static_cast<ResourceType>(rng.nextInt(RESOURCE_COUNT));
+        const Market& market = sim.getKingdom(kingdom).getMarket();
+        const PriceHistory& history = market.getHistory(action.resource);
+        double price = history.size() ? history.movingAverage() : market.getPrice(action.resource);
+        action.price = std::max(1, static_cast<int>(price * (0.8 + rng.nextInt(41) / 100.0)));
+        action.amount = 1 + rng.nextInt(100);
+        break;
+    }
+    default: break;
+    }
+    return action;
+}
+
+Exchange& Simulation::getExchange() { return world.getExchange(); }
+World& Simulation::getWorld() { return world; }
+Kingdom& Simulation::getKingdom(int index) { return world.getKingdom(static_cast<KingdomId>(index)); }
+const Kingdom& Simulation::getKingdom(int index) const { return world.getKingdom(static_cast<KingdomId>(index)); }
+int Simulation::getKingdomCount() const { return world.getKingdomCount(); }
+int Simulation::getTurnCount() const { return turnCount; }
+long long Simulation::getActionCount() const { return actionCount; }
+long long Simulation::getFailedActions() const { return failedActions; }
+double Simulation::getSimulatedSeconds() const { return clock.now(); }
+Random& Simulation::getRandom() { return rng; }
+
+
+// ThreadPool class
+static thread_local int currentWorker = -1;
+
+ThreadPool::ThreadPool(int threadCount) : queued(0), pending(0), nextQueue(0), stopping(false) {
+    if (threadCount <= 0) threadCount = static_cast<int>(std::thread::hardware_concurrency());
+    if (threadCount <= 0) threadCount = 1;
+    for (int i = 0; i < threadCount; ++i) {
+        queues.push_back(std::make_unique<WorkQueue>());
+    }
+    for (int i = 0; i < threadCount; ++i) {
+        threads.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(waitMutex);
+        stopping = true;
+    }
+    taskAvailable.notify_all();
+    for (std::thread& thread : threads) thread.join();
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    // Tasks spawned by a worker stay on its own queue; outside tasks are dealt round-robin
+    int index = currentWorker >= 0 ? currentWorker : static_cast<int>(nextQueue++ % queues.size());
+    pending++;
+    {
+        std::lock_guard<std::mutex> lock(queues[index]->mutex);
+        queues[index]->tasks.push_back(std::move(task));
+    }
+    queued++;
+    {
+        std::lock_guard<std::mutex> lock(waitMutex);
+    }
+    taskAvailable.notify_one();
+}
+
+bool ThreadPool::popTask(int index, std::function<void()>& task) {
+    {
+        WorkQueue& own = *queues[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            queued--;
+            return true;
+        }
+    }
+    int count = static_cast<int>(queues.size());
+    for (int offset = 1; offset < count; ++offset) {
+        WorkQueue& victim = *queues[(index + offset) % count];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::workerLoop(int index) {
+    currentWorker = index;
+    std::function<void()> task;
+    while (true) {
+        if (popTask(index, task)) {
+            try {
+                task();
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(waitMutex);
+                if (!failure) failure = std::current_exception();
+            }
+            task = nullptr;
+            if (--pending == 0) {
+                std::lock_guard<std::mutex> lock(waitMutex);
+                allDone.notify_all();
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(waitMutex);
+        taskAvailable.wait(lock, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0) return;
+    }
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(waitMutex);
+    allDone.wait(lock, [this] { return pending == 0; });
+    if (failure) {
+        std::exception_ptr error = failure;
+        failure = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+int ThreadPool::getThreadCount() const { return static_cast<int>(threads.size()); }
+
+// MonteCarloStats class
+MonteCarloStats::MonteCarloStats() : games(0), draws(0) {
+    for (int seat = 0; seat < 2; ++seat) {
+        wins[seat] = 0;
+        scoreMean[seat] = 0.0;
+        scoreM2[seat] = 0.0;
+        scoreMin[seat] = 0;
+        scoreMax[seat] = 0;
+        survivalMean[seat] = 0.0;
+    }
+}
+
+void MonteCarloStats::add(const GameResult& result) {
+    games++;
+    if (result.winner < 0) draws++;
+    else wins[result.winner]++;
+    for (int seat = 0; seat < 2; ++seat) {
+        double delta = result.scores[seat] - scoreMean[seat];
+        scoreMean[seat] += delta / games;
+        scoreM2[seat] += delta * (result.scores[seat] - scoreMean[seat]);
+        survivalMean[seat] += (result.survivalTurns[seat] - survivalMean[seat]) / games;
+        scoreMin[seat] = games == 1 ? result.scores[seat] : std::min(scoreMin[seat], result.scores[seat]);
+        scoreMax[seat] = games == 1 ? result.scores[seat] : std::max(scoreMax[seat], result.scores[seat]);
+    }
+}
+
+void MonteCarloStats::merge(const MonteCarloStats& other) {
+    if (other.games == 0) return;
+    if (games == 0) {
+        *this = other;
+        return;
+    }
+    long long total = games + other.games;
+    for (int seat = 0; seat < 2; ++seat) {
+        double delta = other.scoreMean[seat] - scoreMean[seat];
+        scoreM2[seat] += other.scoreM2[seat] + delta * delta * games * other.games / total;
+        scoreMean[seat] += delta * other.games / total;
+        survivalMean[seat] += (other.survivalMean[seat] - survivalMean[seat]) * other.games / total;
+        scoreMin[seat] = std::min(scoreMin[seat], other.scoreMin[seat]);
+        scoreMax[seat] = std::max(scoreMax[seat], other.scoreMax[seat]);
+        wins[seat] += other.wins[seat];
+    }
+    draws += other.draws;
+    games = total;
+}
+
+long long MonteCarloStats::getGames() const { return games; }
+long long MonteCarloStats::getDraws() const { return draws; }
+double MonteCarloStats::getWinRate(int seat) const { return games ? static_cast<double>(wins[seat]) / games : 0.0; }
+double MonteCarloStats::getDrawRate() const { return games ? static_cast<double>(draws) / games : 0.0; }
+double MonteCarloStats::getScoreMean(int seat) const { return scoreMean[seat]; }
+double MonteCarloStats::getScoreStdDev(int seat) const { return games > 1 ? std::sqrt(scoreM2[seat] / (games - 1)) : 0.0; }
+int MonteCarloStats::getScoreMin(int seat) const { return scoreMin[seat]; }
+int MonteCarloStats::getScoreMax(int seat) const { return scoreMax[seat]; }
+double MonteCarloStats::getSurvivalMean(int seat) const { return survivalMean[seat]; }
+
+// MonteCarloRunner class
+MonteCarloRunner::MonteCarloRunner(int maxTurns, uint64_t seed, int threadCount)
+    : maxTurns(maxTurns), seed(seed), threadCount(threadCount), gamesPerTask(64), policy(Simulation::randomAction) {
+}
+
+void MonteCarloRunner::setPolicy(const ActionPolicy& newPolicy) { policy = newPolicy; }
+
+GameResult MonteCarloRunner::playGame(long long gameIndex) const {
+    // SplitMix64 step so neighbouring games get unrelated seeds
+    uint64_t gameSeed = seed + 0x9e3779b97f4a7c15ULL * static_cast<uint64_t>(gameIndex + 1);
+    gameSeed = (gameSeed ^ (gameSeed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    gameSeed = (gameSeed ^ (gameSeed >> 27)) * 0x94d049bb133111ebULL;
+    gameSeed ^= gameSeed >> 31;
+
+    Simulation sim(2, gameSeed, false);
+    GameResult result;
+    result.survivalTurns[0] = result.survivalTurns[1] = maxTurns;
+    bool collapsed[2] = { false, false };
+    for (int turn = 1; turn <= maxTurns && !collapsed[0] && !collapsed[1]; ++turn) {
+        for (int seat = 0; seat < 2; ++seat) {
+            if (policy) sim.apply(seat, policy(sim, seat));
+            sim.apply(seat, Action());
+        }
+        for (int seat = 0; seat < 2; ++seat) {
+            if (sim.getKingdom(seat).isCollapsed()) {
+                collapsed[seat] = true;
+                result.survivalTurns[seat] = turn;
+            }
+        }
+    }
+    for (int seat = 0; seat < 2; ++seat) {
+        result.scores[seat] = sim.getKingdom(seat).calculateScore();
+    }
+    if (collapsed[0] != collapsed[1]) result.winner = collapsed[0] ? 1 : 0;
+    else if (result.scores[0] != result.scores[1]) result.winner = result.scores[0] > result.scores[1] ? 0 : 1;
+    return result;
+}
+
+MonteCarloStats MonteCarloRunner::run(long long games) {
+    ConsoleSilencer silencer;
+    MonteCarloStats total;
+    std::mutex totalMutex;
+    ThreadPool pool(threadCount);
+    for (long long first = 0; first < games; first += gamesPerTask) {
+        long long last = std::min(games, first + gamesPerTask);
+        pool.submit([this, first, last, &total, &totalMutex] {
+            MonteCarloStats local;
+            for (long long game = first; game < last; ++game) {
+                local.add(playGame(game));
+            }
+            std::lock_guard<std::mutex> lock(totalMutex);
+            total.merge(local);
+        });
+    }
+    pool.wait();
+    return total;
+}
+
+// MctsPlayer class
+MctsPlayer::Node::Node() : visits(0), reward(0.0) {
+    std::fill(children, children + MCTS_MAX_ACTIONS, -1);
+}
+
+MctsPlayer::MctsPlayer(int budgetMs, int threadCount, uint64_t seed)
+    : budgetMs(budgetMs), pool(threadCount), lastChoice(-1), lastSelf(NO_KINGDOM), lastTarget(NO_KINGDOM),
+    lastIterations(0) {
+    buildActions();
+    trees.resize(pool.getThreadCount());
+    for (size_t i = 0; i < trees.size(); ++i) {
+        trees[i].nodes.assign(1, Node());
+        trees[i].rng.seed(seed, i + 1);
+        trees[i].iterations = 0;
+    }
+}
+
+void MctsPlayer::buildActions() {
+    // Menu actions with representative amounts; save, load, score and exit do not change the game
+    auto add = [this](ActionType type, int choice, int amount) {
+        Action action;
+        action.type = type;
+        action.choice = choice;
+        action.amount = amount;
+        actions.push_back(action);
+        return &actions.back();
+    };
+    add(ACTION_PLAY_TURN, 0, 0);  // must stay first: rollouts refer to it as MCTS_PLAY_TURN
+    add(ACTION_TRAIN_ARMY, 0, 10);
+    add(ACTION_TRAIN_ARMY, 0, 50);
+    add(ACTION_HOLD_ELECTION, 0, 0);
+    add(ACTION_LOAN_OR_AUDIT, 1, 500);
+    add(ACTION_LOAN_OR_AUDIT, 2, 500);
+    add(ACTION_LOAN_OR_AUDIT, 3, 0);
+    for (int r = 0; r < RESOURCE_COUNT; ++r) add(ACTION_BUY_RESOURCE, 0, 100)->resource = static_cast<ResourceType>(r);
+    add(ACTION_DIPLOMACY, 1, 0);
+    add(ACTION_DIPLOMACY, 3, 0);
+    add(ACTION_DIPLOMACY, 4, 0);
+    add(ACTION_BRIBE_OR_BLACKMAIL, 1, 0)->text = "Arthur";
+    add(ACTION_BRIBE_OR_BLACKMAIL, 2, 0)->text = "Arthur";
+    add(ACTION_FAKE_TRADE_REQUEST, 0, 0);
+    add(ACTION_UPGRADE_BLACKSMITH, 0, 0);
+    add(ACTION_PRODUCE_WEAPONS, 0, 20);
+    for (int choice = 1; choice <= 3; ++choice) add(ACTION_ESPIONAGE, choice, 0);
+    add(ACTION_SMUGGLING, 0, 0);
+    add(ACTION_HEALTHCARE, 1, 0);
+    add(ACTION_HEALTHCARE, 2, 0);
+    add(ACTION_BUILDINGS, 1, 0);
+    if (actions.size() > static_cast<size_t>(MCTS_MAX_ACTIONS)) throw std::runtime_error("Too many MCTS actions");
+}
+
+KingdomId MctsPlayer::pickTarget(const World& world, KingdomId self) {
+    // The strongest rival still standing
+    KingdomId target = self;
+    int best = 0;
+    for (KingdomId id = 0; id < world.getKingdomCount(); ++id) {
+        const Kingdom& kingdom = world.getKingdom(id);
+        if (id == self || kingdom.isCollapsed()) continue;
+        int score = kingdom.calculateScore();
+        if (target == self || score > best) {
+            target = id;
+            best = score;
+        }
+    }
+    return target;
+}
+
+void MctsPlayer::play(std::vector<Kingdom>& state, KingdomId self, KingdomId target, int choice, Random& rng) const {
+    // Failed moves simply waste the turn; every candidate has a status form, so nothing here throws
+    Simulation::tryExecute(state[self], &state[target], actions[choice]);
+    for (size_t other = 0; other < state.size(); ++other) {
+        if (other == self || state[other].isCollapsed()) continue;
+        Simulation::tryExecute(state[other], &state[self], actions[rng.nextInt(static_cast<int>(actions.size()))]);
+    }
+}
+
+double MctsPlayer::netScore(const Kingdom& kingdom) {
+    // Outstanding debt is charged at the rate calculateScore pays for gold, so a loan is not free points
+    return static_cast<double>(kingdom.calculateScore()) - kingdom.getBank().getLoan() / 10 * 250.0;
+}
+
+double MctsPlayer::evaluate(const std::vector<Kingdom>& state, KingdomId self) {
+    // Squashed net score lead over the best surviving rival; a collapsed kingdom has lost outright
+    if (state[self].isCollapsed()) return 0.0;
+    double best = 0.0;
+    bool rival = false;
+    for (size_t other = 0; other < state.size(); ++other) {
+        if (other == self || state[other].isCollapsed()) continue;
+        double score = netScore(state[other]);
+        if (!rival || score > best) best = score;
+        rival = true;
+    }
+    double lead = netScore(state[self]) - best;
+    return 1.0 / (1.0 + std::exp(-lead / MCTS_SCORE_SCALE));
+}
+
+void MctsPlayer::search(Tree& tree, const std::vector<Kingdom>& root, KingdomId self, KingdomId target,
+    std::chrono::steady_clock::time_point deadline) const {
+    InstantClock clock;
+    ClockScope scope(clock);
+    int actionCount = static_cast<int>(actions.size());
+    std::vector<int> path;
+    std::vector<Kingdom> state;
+    state.reserve(root.size());
+    do {
+        state.clear();
+        for (size_t k = 0; k < root.size(); ++k) {
+            state.push_back(root[k].clone());
+            state.back().getRandom().seed(tree.rng.next() | static_cast<uint64_t>(tree.rng.next()) << 32, k);
+        }
+        path.assign(1, 0);
+        int node = 0;
+        int depth = 0;
+        while (depth < MCTS_HORIZON) {
+            int untried = 0;
+            for (int a = 0; a < actionCount; ++a) untried += tree.nodes[node].children[a] < 0;
+            if (untried > 0 && tree.nodes.size() < static_cast<size_t>(MCTS_MAX_NODES)) {
+                // Expand one untried action, chosen at random, then roll out from it
+                int pick = tree.rng.nextInt(untried);
+                int choice = 0;
+                while (tree.nodes[node].children[choice] >= 0 || pick-- > 0) ++choice;
+                tree.nodes.emplace_back();
+                int child = static_cast<int>(tree.nodes.size()) - 1;
+                tree.nodes[node].children[choice] = child;
+                play(state, self, target, choice, tree.rng);
+                path.push_back(child);
+                ++depth;
+                break;
+            }
+            // UCB1 over the expanded children
+            int best = -1;
+            double bestScore = 0.0;
+            double logVisits = std::log(static_cast<double>(std::max(1, tree.nodes[node].visits)));
+            for (int a = 0; a < actionCount; ++a) {
+                int child = tree.nodes[node].children[a];
+                if (child < 0) continue;
+                const Node& candidate = tree.nodes[child];
+                double score = candidate.reward / candidate.visits + MCTS_EXPLORATION * std::sqrt(logVisits / candidate.visits);
+                if (best < 0 || score > bestScore) {
+                    best = a;
+                    bestScore = score;
+                }
+            }
+            if (best < 0) break;
+            play(state, self, target, best, tree.rng);
+            node = tree.nodes[node].children[best];
+            path.push_back(node);
+            ++depth;
+        }
+        // Rollouts alternate a random move with Play Turn so the kingdom's economy actually advances
+        for (; depth < MCTS_HORIZON; ++depth) {
+            play(state, self, target, depth % 2 ? MCTS_PLAY_TURN : tree.rng.nextInt(actionCount), tree.rng);
+        }
+        double reward = evaluate(state, self);
+        for (int index : path) {
+            tree.nodes[index].visits++;
+            tree.nodes[index].reward += reward;
+        }
+        tree.iterations++;
+    } while (std::chrono::steady_clock::now() < deadline);
+}
+
+void MctsPlayer::reroot(Tree& tree, int child) {
+    if (child < 0) {
+        tree.nodes.assign(1, Node());
+        return;
+    }
+    // Copy the chosen subtree to the front of a fresh node list, renumbering as we go
+    std::vector<Node> kept(1, tree.nodes[child]);
+    std::vector<std::pair<int, int>> pending(1, std::make_pair(child, 0));
+    while (!pending.empty()) {
+        std::pair<int, int> current = pending.back();
+        pending.pop_back();
+        for (int a = 0; a < MCTS_MAX_ACTIONS; ++a) {
+            int old = tree.nodes[current.first].children[a];
+            if (old < 0) continue;
+            kept.push_back(tree.nodes[old]);
+            kept[current.second].children[a] = static_cast<int>(kept.size()) - 1;
+            pending.push_back(std::make_pair(old, static_cast<int>(kept.size()) - 1));
+        }
+    }
+    tree.nodes.swap(kept);
+}
+
+Action MctsPlayer::chooseAction(World& world, KingdomId self) {
+    KingdomId target = pickTarget(world, self);
+    // Reuse last turn's trees below the move we made, unless we are now looking at a different game
+    bool reuse = lastChoice >= 0 && self == lastSelf && target == lastTarget;
+    for (Tree& tree : trees) reroot(tree, reuse ? tree.nodes[0].children[lastChoice] : -1);
+
+    std::vector<Kingdom> root;
+    root.reserve(world.getKingdomCount());
+    // Rollouts run on worker threads, so neither they nor the clones they copy render status or maps
+    for (KingdomId id = 0; id < world.getKingdomCount(); ++id) {
+        root.push_back(world.getKingdom(id).clone());
+        root.back().setQuiet(true);
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(budgetMs);
+    {
+        ConsoleSilencer silencer;
+        for (Tree& tree : trees) {
+            pool.submit([this, &tree, &root, self, target, deadline] { search(tree, root, self, target, deadline); });
+        }
+        pool.wait();
+    }
+
+    std::vector<long long> visits(actions.size(), 0);
+    lastIterations = 0;
+    for (Tree& tree : trees) {
+        lastIterations += tree.iterations;
+        tree.iterations = 0;
+        for (size_t a = 0; a < actions.size(); ++a) {
+            int child = tree.nodes[0].children[a];
+            if (child >= 0) visits[a] += tree.nodes[child].visits;
+        }
+    }
+    lastChoice = static_cast<int>(std::max_element(visits.begin(), visits.end()) - visits.begin());
+    lastSelf = self;
+    lastTarget = target;
+    Action action = actions[lastChoice];
+    action.target = Simulation::needsTarget(action.type) && target != self ? target : -1;
+    return action;
+}
+
+std::string MctsPlayer::describe(const Action& action) {
+    switch (action.type) {
+    case ACTION_PLAY_TURN: return "Play Turn";
+    case ACTION_TRAIN_ARMY: return "Train Army (" + std::to_string(action.amount) + ")";
+    case ACTION_HOLD_ELECTION: return "Hold Election";
+    case ACTION_LOAN_OR_AUDIT:
+        if (action.choice == 1) return "Take Loan (" + std::to_string(action.amount) + ")";
+        if (action.choice == 2) return "Repay Loan (" + std::to_string(action.amount) + ")";
+        return "Audit Corruption";
+    case ACTION_BUY_RESOURCE:
+        return "Buy " + std::string(RESOURCE_NAMES[action.resource]) + " (" + std::to_string(action.amount) + ")";
+    case ACTION_DIPLOMACY:
+        if (action.choice == 1) return "Form Alliance";
+        if (action.choice == 2) return "Break Alliance";
+        if (action.choice == 3) return "Form Trade Agreement";
+        return "Establish Secure Route";
+    case ACTION_BRIBE_OR_BLACKMAIL: return (action.choice == 1 ? "Bribe " : "Blackmail ") + action.text;
+    case ACTION_SEND_MESSAGE: return "Send Message";
+    case ACTION_FAKE_TRADE_REQUEST: return "Send Fake Trade Request";
+    case ACTION_VIEW_MESSAGES: return "View Messages";
+    case ACTION_UPGRADE_BLACKSMITH: return "Upgrade Blacksmith";
+    case ACTION_PRODUCE_WEAPONS: return "Produce Weapons (" + std::to_string(action.amount) + ")";
+    case ACTION_ESPIONAGE:
+        if (action.choice == 1) return "Spy Mission";
+        if (action.choice == 2) return "Sabotage Weapons";
+        return "Steal Gold";
+    case ACTION_SMUGGLING: return "Conduct Smuggling";
+    case ACTION_HEALTHCARE: return action.choice == 1 ? "Build Hospital" : "Provide Healthcare Services";
+    case ACTION_BUILDINGS: return "Build Barracks";
+    case ACTION_TRADE: return "Trade on Exchange";
+    }
+    return "Unknown Action";
+}
+
+long long MctsPlayer::getLastIterations() const { return lastIterations; }
+int MctsPlayer::getThreadCount() const { return pool.getThreadCount(); }
+
+// KingdomBatch class
+// Each kernel mirrors one deterministic step of Kingdom::playTurn and is written as a
+// branch-free loop over plain arrays so the compiler can vectorize it.
+void KingdomBatch::reserve(int count) {
+    for (std::vector<int>* field : { &gold, &food, &iron, &wood, &stone, &peasants, &merchants, &nobility, &military,
+        &soldiers, &loan, &debtReliance, &progressiveTax, &foodImpact }) {
+        field->reserve(count);
+    }
+    morale.reserve(count);
+    armyMorale.reserve(count);
+    inflationRate.reserve(count);
+    foodAverage.reserve(count);
+}
+
+int KingdomBatch::push(int goldValue, const int stock[RESOURCE_COUNT], const int classSizes[MAX_CLASSES],
+    int soldierCount, int loanValue, int debt, bool progressive, int impact, double moraleValue, double armyMoraleValue, double rate,
+    double averageFoodPrice) {
+    gold.push_back(goldValue);
+    food.push_back(stock[FOOD]);
+    iron.push_back(stock[IRON]);
+    wood.push_back(stock[WOOD]);
+    stone.push_back(stock[STONE]);
+    peasants.push_back(classSizes[PEASANTS]);
+    merchants.push_back(classSizes[MERCHANTS]);
+    nobility.push_back(classSizes[NOBILITY]);
+    military.push_back(classSizes[MILITARY]);
+    soldiers.push_back(soldierCount);
+    loan.push_back(loanValue);
+    debtReliance.push_back(debt);
+    progressiveTax.push_back(progressive ? 1 : 0);
+    foodImpact.push_back(impact);
+    morale.push_back(moraleValue);
+    armyMorale.push_back(armyMoraleValue);
+    inflationRate.push_back(rate);
+    foodAverage.push_back(averageFoodPrice);
+    return size() - 1;
+}
+
+int KingdomBatch::add(const Kingdom& kingdom) {
+    const ResourcePair* classes = kingdom.getPopulation().getClasses();
+    int classSizes[MAX_CLASSES];
+    for (int i = 0; i < MAX_CLASSES; ++i) classSizes[i] = classes[i].size;
+    int stock[RESOURCE_COUNT];
+    for (int i = 0; i < RESOURCE_COUNT; ++i) stock[i] = kingdom.getResource(static_cast<ResourceType>(i)).get();
+    // The deterministic phases record no prices, so the food average stays fixed while the batch runs
+    const PriceHistory& history = kingdom.getMarket().getHistory(FOOD);
+    double average = history.size() >= history.getWindow() ? history.movingAverage() : 0.0;
+    return push(kingdom.getEconomy().getGold(), stock, classSizes, kingdom.getArmy().getSize(), kingdom.getBank().getLoan(),
+        kingdom.getEconomy().getDebtReliance(), kingdom.getEconomy().isProgressiveTax(), kingdom.getWeather().getFoodImpact(),
+        kingdom.getPopulation().getMorale(), kingdom.getArmy().getMorale(), kingdom.getInflation().getRate(), average);
+}
+
+int KingdomBatch::addDefault() {
+    // Same starting values as the Kingdom constructor
+    return push(1000, STARTING_RESOURCES, STARTING_CLASS_SIZES, 100, 0, 0, false, 0, 0.85, 0.8, 1.0, 0.0);
+}
+
+int KingdomBatch::size() const { return static_cast<int>(gold.size()); }
+void KingdomBatch::setFoodImpact(int index, int impact) { foodImpact[index] = impact; }
+
+void KingdomBatch::applyWeatherFood() {
+    int* f = food.data();
+    const int* impact = foodImpact.data();
+    const int n = size();
+    for (int i = 0; i < n; ++i) {
+        f[i] = std::max(0, f[i] + impact[i]);
+    }
+}
+
+void KingdomBatch::collectTaxes() {
+    int* g = gold.data();
+    double* m = morale.data();
+    const int* p = peasants.data();
+    const int* me = merchants.data();
+    const int* no = nobility.data();
+    const int* mi = military.data();
+    const int* progressive = progressiveTax.data();
+    const int n = size();
+    for (int i = 0; i < n; ++i) {
+        int total = p[i] + me[i] + no[i] + mi[i];
+        int tax = progressive[i] ? total / 10 : 100;  // total / 10 == int(total * 0.1) for non-negative totals
+        g[i] = std::max(0, g[i] + tax);
+        m[i] = std::min(1.0, std::max(0.0, m[i] - 0.05));
+    }
+}
+
+void KingdomBatch::checkArmyUpkeep() {
+    const int* g = gold.data();
+    int* s = soldiers.data();
+    double* am = armyMorale.data();
+    const int n = size();
+    for (int i = 0; i < n; ++i) {
+        double mor = am[i] - (g[i] < s[i] * 2 ? 0.1 : 0.0);
+        am[i] = mor;
+        s[i] = mor < 0.3 ? s[i] - s[i] / 10 : s[i];
+    }
+}
+
+void KingdomBatch::updateInflation() {
+    int* g = gold.data();
+    double* r = inflationRate.data();
+    const int* progressive = progressiveTax.data();
+    const int* l = loan.data();
+    const int* debt = debtReliance.data();
+    const double* average = foodAverage.data();
+    const int n = size();
+    for (int i = 0; i < n; ++i) {
+        double rate = r[i] + ((progressive[i] | (l[i] > 1000)) ? 0.05 : 0.0) + (debt[i] > 1000 ? 0.1 : 0.0);
+        rate += average[i] > BASE_PRICES[FOOD] * rate * 1.25 ? 0.02 : 0.0;
+        int bankrupt = rate > 2.0;
+        g[i] -= bankrupt * (g[i] / 2);  // g / 2 == int(g * 0.5), gold is never negative
+        r[i] = bankrupt ? 1.5 : rate;
+    }
+}
+
+void KingdomBatch::clampMorale() {
+    double* m = morale.data();
+    const int n = size();
+    for (int i = 0; i < n; ++i) {
+        m[i] = std::min(1.0, std::max(0.0, m[i]));
+    }
+}
+
+void KingdomBatch::stepDeterministic() {
+    applyWeatherFood();
+    collectTaxes();
+    checkArmyUpkeep();
+    updateInflation();
+    clampMorale();
+}
+
+int KingdomBatch::getGold(int index) const { return gold[index]; }
+int KingdomBatch::getFood(int index) const { return food[index]; }
+int KingdomBatch::getPopulation(int index) const { return peasants[index] + merchants[index] + nobility[index] + military[index]; }
+int KingdomBatch::getSoldiers(int index) const { return soldiers[index]; }
+double KingdomBatch::getMorale(int index) const { return morale[index]; }
+double KingdomBatch::getArmyMorale(int index) const { return armyMorale[index]; }
+double KingdomBatch::getInflationRate(int index) const { return inflationRate[index]; }
+
+// MappedFile class
+MappedFile::MappedFile() : base(nullptr), length(0),
+#ifdef _WIN32
+    fileHandle(INVALID_HANDLE_VALUE), mappingHandle(nullptr) {
+#else
+    fd(-1) {
+#endif
+}
+
+MappedFile::~MappedFile() { close(); }
+
+bool MappedFile::open(const std::string& path, size_t minimumSize) {
+    close();
+#ifdef _WIN32
+    fileHandle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE) throw std::runtime_error("Cannot open snapshot store " + path);
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(fileHandle, &fileSize);
+    length = static_cast<size_t>(fileSize.QuadPart);
+#else
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) throw std::runtime_error("Cannot open snapshot store " + path);
+    struct stat info;
+    fstat(fd, &info);
+    length = static_cast<size_t>(info.st_size);
+#endif
+    bool empty = length == 0;
+    if (!empty && length < minimumSize) {
+        close();
+        throw std::runtime_error("File too short to map: " + path);
+    }
+    if (empty) resize(minimumSize);
+    else map();
+    return empty;
+}
+
+void MappedFile::map() {
+#ifdef _WIN32
+    mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+    if (!mappingHandle) throw std::runtime_error("Cannot map snapshot store");
+    base = static_cast<char*>(MapViewOfFile(mappingHandle, FILE_MAP_ALL_ACCESS, 0, 0, length));
+    if (!base) throw std::runtime_error("Cannot map snapshot store");
+#else
+    void* address = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) throw std::runtime_error("Cannot map snapshot store");
+    base = static_cast<char*>(address);
+#endif
+}
+
+void MappedFile::unmap() {
+    if (!base) return;
+#ifdef _WIN32
+    UnmapViewOfFile(base);
+    CloseHandle(mappingHandle);
+    mappingHandle = nullptr;
+#else
+    munmap(base, length);
+#endif
+    base = nullptr;
+}
+
+void MappedFile::resize(size_t newSize) {
+    unmap();
+#ifdef _WIN32
+    LARGE_INTEGER position;
+    position.QuadPart = static_cast<LONGLONG>(newSize);
+    if (!SetFilePointerEx(fileHandle, position, nullptr, FILE_BEGIN) || !SetEndOfFile(fileHandle))
+        throw std::runtime_error("Cannot grow snapshot store");
+#else
+    if (ftruncate(fd, static_cast<off_t>(newSize)) != 0) throw std::runtime_error("Cannot grow snapshot store");
+#endif
+    length = newSize;
+    map();
+}
+
+void MappedFile::flush() {
+    if (!base) return;
+#ifdef _WIN32
+    FlushViewOfFile(base, length);
+#else
+    msync(base, length, MS_SYNC);
+#endif
+}
+
+void MappedFile::close() {
+    unmap();
+#ifdef _WIN32
+    if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+    fileHandle = INVALID_HANDLE_VALUE;
+#else
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+#endif
+    length = 0;
+}
+
+char* MappedFile::data() { return base; }
+const char* MappedFile::data() const { return base; }
+size_t MappedFile::size() const { return length; }
+bool MappedFile::isOpen() const { return base != nullptr; }
+
+// SnapshotStore class
+static const uint32_t SNAPSHOT_STORE_MAGIC = 0x53525453;  // "STRS"
+static const uint32_t SNAPSHOT_STORE_VERSION = 1;
+
+static uint64_t hashName(const std::string& name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : name) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t mixKey(uint64_t nameHash, uint64_t gameId, int turn) {
+    uint64_t key = nameHash ^ (gameId * 0x9e3779b97f4a7c15ULL) ^ (static_cast<uint64_t>(static_cast<uint32_t>(turn)) << 32);
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+}
+
+SnapshotStore::SnapshotStore(const std::string& path, uint32_t indexCapacity) {
+    uint32_t capacity = 16;
+    while (capacity < indexCapacity) capacity <<= 1;
+    size_t indexOffset = 64;
+    size_t initialSize = indexOffset + capacity * sizeof(IndexEntry) + 64 * 1024;
+    // Only a file that was empty gets a fresh layout; anything else must already be a store
+    if (file.open(path, sizeof(StoreHeader))) {
+        file.resize(initialSize);
+        std::memset(file.data(), 0, initialSize);
+        StoreHeader* head = header();
+        head->magic = SNAPSHOT_STORE_MAGIC;
+        head->version = SNAPSHOT_STORE_VERSION;
+        head->indexCapacity = capacity;
+        head->count = 0;
+        head->indexOffset = indexOffset;
+        head->dataEnd = indexOffset + capacity * sizeof(IndexEntry);
+    }
+    else if (!isValid()) {
+        throw std::runtime_error("Not a valid snapshot store: " + path);
+    }
+}
+
+bool SnapshotStore::isValid() const {
+    // Every offset in the header and index must stay inside the data written so far
+    const StoreHeader* head = header();
+    uint64_t capacity = head->indexCapacity;
+    if (head->magic != SNAPSHOT_STORE_MAGIC || head->version != SNAPSHOT_STORE_VERSION || head->dataEnd > file.size()) return false;
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0 || head->count > capacity) return false;
+    if (head->indexOffset < sizeof(StoreHeader) || head->indexOffset % alignof(IndexEntry) != 0) return false;
+    if (head->indexOffset > head->dataEnd || capacity * sizeof(IndexEntry) > head->dataEnd - head->indexOffset) return false;
+    const IndexEntry* table = entries();
+    uint32_t used = 0;
+    for (uint64_t i = 0; i < capacity; ++i) {
+        const IndexEntry& entry = table[i];
+        if (entry.size == 0) continue;
+        if (entry.size < SNAPSHOT_HEADER_SIZE + sizeof(uint32_t) || entry.offset > head->dataEnd ||
+            entry.size > head->dataEnd - entry.offset) return false;
+        used++;
+    }
+    return used == head->count;
+}
+
+SnapshotStore::StoreHeader* SnapshotStore::header() { return reinterpret_cast<StoreHeader*>(file.data()); }
+const SnapshotStore::StoreHeader* SnapshotStore::header() const { return reinterpret_cast<const StoreHeader*>(file.data()); }
+SnapshotStore::IndexEntry* SnapshotStore::entries() { return reinterpret_cast<IndexEntry*>(file.data() + header()->indexOffset); }
+const SnapshotStore::IndexEntry* SnapshotStore::entries() const { return reinterpret_cast<const IndexEntry*>(file.data() + header()->indexOffset); }
+
+size_t SnapshotStore::findSlot(const std::string& name, uint64_t nameHash, uint64_t gameId, int turn) const {
+    const IndexEntry* table = entries();
+    size_t mask = header()->indexCapacity - 1;
+    size_t slot = static_cast<size_t>(mixKey(nameHash, gameId, turn)) & mask;
+    while (table[slot].size != 0) {
+        const IndexEntry& entry = table[slot];
+        if (entry.nameHash == nameHash && entry.gameId == gameId && entry.turn == turn) {
+            // The snapshot payload starts with the length-prefixed kingdom name
+            const char* payload = file.data() + entry.offset + SNAPSHOT_HEADER_SIZE;
+            uint32_t length;
+            std::memcpy(&length, payload, sizeof(length));
+            if (length == name.size() && std::memcmp(payload + sizeof(length), name.data(), length) == 0) return slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+uint64_t SnapshotStore::allocate(size_t size, size_t alignment) {
+    uint64_t offset = (header()->dataEnd + alignment - 1) / alignment * alignment;
+    if (offset + size > file.size()) {
+        file.resize(std::max<size_t>(static_cast<size_t>(offset + size), file.size() * 2));
+    }
+    header()->dataEnd = offset + size;
+    return offset;
+}
+
+void SnapshotStore::rehash(uint32_t newCapacity) {
+    // The new index is appended after the data; the old block is simply abandoned
+    uint64_t oldOffset = header()->indexOffset;
+    uint32_t oldCapacity = header()->indexCapacity;
+    uint64_t newOffset = allocate(newCapacity * sizeof(IndexEntry), alignof(IndexEntry));
+    std::memset(file.data() + newOffset, 0, newCapacity * sizeof(IndexEntry));
+    const IndexEntry* oldTable = reinterpret_cast<const IndexEntry*>(file.data() + oldOffset);
+    IndexEntry* newTable = reinterpret_cast<IndexEntry*>(file.data() + newOffset);
+    size_t mask = newCapacity - 1;
+    for (uint32_t i = 0; i < oldCapacity; ++i) {
+        if (oldTable[i].size == 0) continue;
+        size_t slot = static_cast<size_t>(mixKey(oldTable[i].nameHash, oldTable[i].gameId, oldTable[i].turn)) & mask;
+        while (newTable[slot].size != 0) slot = (slot + 1) & mask;
+        newTable[slot] = oldTable[i];
     }
-    else {
-        std::cout << RED << "Theft failed! Spies detected.\n" << RESET;
-        target.getDiplomacy().handleEspionageFailure(source.getName());
-        lastAction = "Failed Theft";
+    header()->indexOffset = newOffset;
+    header()->indexCapacity = newCapacity;
+}
+
+void SnapshotStore::put(const Kingdom& kingdom, uint64_t gameId, int turn) {
+    std::string buffer;
+    kingdom.snapshot(buffer);
+    put(kingdom.getName(), gameId, turn, buffer.data(), buffer.size());
+}
+
+void SnapshotStore::put(const std::string& name, uint64_t gameId, int turn, const char* data, size_t size) {
+    // findSlot and load trust the stored record, so it has to be one whole snapshot of this kingdom
+    SnapshotHeader record;
+    if (size > 0xffffffffu || !readSnapshotHeader(data, size, record) || SNAPSHOT_HEADER_SIZE + record.payloadSize != size) {
+        throw std::runtime_error("Invalid snapshot record");
+    }
+    if (Kingdom::snapshotName(data, size) != name) throw std::runtime_error("Snapshot record is not for " + name);
+    // Replacing a snapshot reuses its slot, so only a new key can push the index past its load factor
+    uint64_t nameHash = hashName(name);
+    size_t slot = findSlot(name, nameHash, gameId, turn);
+    bool added = entries()[slot].size == 0;
+    if (added && (header()->count + 1) * 10ULL > header()->indexCapacity * 7ULL) {
+        rehash(header()->indexCapacity * 2);
+        slot = findSlot(name, nameHash, gameId, turn);
     }
+    // A view of this store would be invalidated by the remap allocate may do, so copy it out first
+    std::string copy;
+    if (data >= file.data() && data < file.data() + file.size()) {
+        copy.assign(data, size);
+        data = copy.data();
+    }
+    uint64_t offset = allocate(size, 8);
+    std::memcpy(file.data() + offset, data, size);
+    IndexEntry& entry = entries()[slot];
+    if (added) header()->count++;
+    entry.nameHash = nameHash;
+    entry.gameId = gameId;
+    entry.offset = offset;
+    entry.size = static_cast<uint32_t>(size);
+    entry.turn = turn;
 }
 
-// Smuggling class
-Smuggling::Smuggling() : lastAction("None") {}
+SnapshotView SnapshotStore::find(const std::string& name, uint64_t gameId, int turn) const {
+    SnapshotView view;
+    const IndexEntry& entry = entries()[findSlot(name, hashName(name), gameId, turn)];
+    if (entry.size != 0) {
+        view.data = file.data() + entry.offset;
+        view.size = entry.size;
+    }
+    return view;
+}
 
-void Smuggling::smuggleGoods(Kingdom& source, Kingdom& target) {
-    Economy& econ = source.getEconomy();
-    if (econ.getGold() < 100)
-        throw InsufficientResourcesException("Insufficient gold for smuggling");
-    if (!source.getDiplomacy().hasSecureRoute(target.getName()))
-        throw InsufficientResourcesException("No secure route for smuggling");
-    econ.spend(100);
-    std::cout << "Smuggling goods to " << target.getName() << "...\n";
-    std::this_thread::sleep_for(std::chrono::seconds(3 + source.getWeather().getDelayImpact()));
-    double successChance = 0.8 * (target.getMarket().isSmugglerActive() ? 1.2 : 1.0);
-    if (static_cast<double>(rand()) / RAND_MAX < successChance) {
-        int goods = 200;
-        source.getIron().adjust(goods);
-        target.getIron().adjust(-goods / 2);
-        std::cout << GREEN << "Smuggling successful! Gained " << goods << " iron.\n" << RESET;
-        lastAction = "Smuggle Goods";
+bool SnapshotStore::load(Kingdom& kingdom, uint64_t gameId, int turn) const {
+    SnapshotView view = find(kingdom.getName(), gameId, turn);
+    if (!view.data) return false;
+    kingdom.restore(view.data, view.size);
+    return true;
+}
+
+uint32_t SnapshotStore::getCount() const { return header()->count; }
+void SnapshotStore::flush() { file.flush(); }
+
+// Leaderboard class
+static const uint32_t LEADERBOARD_MAGIC = 0x4c525453;  // "STRL"
+static const uint32_t LEADERBOARD_VERSION = 1;
+static const uint32_t NO_POSITION = 0xffffffffu;
+
+Leaderboard::Leaderboard() : root(-1), maxTreeLeaves(0), maxTreeDirty(false), rng(0x5eed, 7) {}
+
+bool Leaderboard::before(uint32_t a, uint32_t b) const {
+    if (records[a].score != records[b].score) return records[a].score > records[b].score;
+    return a < b;
+}
+
+int Leaderboard::nodeSize(int node) const { return node < 0 ? 0 : nodes[node].size; }
+
+void Leaderboard::update(int node) {
+    nodes[node].size = 1 + nodeSize(nodes[node].left) + nodeSize(nodes[node].right);
+}
+
+void Leaderboard::split(int node, uint32_t record, int& left, int& right) {
+    if (node < 0) {
+        left = right = -1;
+        return;
+    }
+    if (before(nodes[node].record, record)) {
+        split(nodes[node].right, record, nodes[node].right, right);
+        left = node;
     }
     else {
-        std::cout << RED << "Smuggling failed! Goods seized.\n" << RESET;
-        econ.spend(50);
-        lastAction = "Failed Smuggling";
+        split(nodes[node].left, record, left, nodes[node].left);
+        right = node;
     }
+    update(node);
 }
 
-// Kingdom class
-Kingdom::Kingdom(const std::string& kingdomName, const std::string& kingName)
-    : name(kingdomName), food(1000), iron(500), wood(800), stone(600) {
-    population = std::make_unique<Population>();
-    economy = std::make_unique<Economy>(1000);
-    army = std::make_unique<Army>(100, 100);
-    bank = std::make_unique<Bank>();
-    politics = std::make_unique<Politics>(kingName);
-    blacksmith = std::make_unique<Blacksmith>();
-    diplomacy = std::make_unique<Diplomacy>();
-    communication = std::make_unique<Communication>();
-    healthcare = std::make_unique<Healthcare>();
-    buildings = std::make_unique<Buildings>();
-    weather = std::make_unique<Weather>();
-    inflation = std::make_unique<Inflation>();
-    corruption = std::make_unique<Corruption>();
-    map = std::make_unique<Map>();
-    market = std::make_unique<Market>(inflation.get());
+int Leaderboard::merge(int left, int right) {
+    if (left < 0) return right;
+    if (right < 0) return left;
+    if (nodes[left].priority > nodes[right].priority) {
+        nodes[left].right = merge(nodes[left].right, right);
+        update(left);
+        return left;
+    }
+    nodes[right].left = merge(left, nodes[right].left);
+    update(right);
+    return right;
 }
 
-void Kingdom::playTurn() {
-    std::cout << BOLD << "=== Turn in " << name << " ===\n" << RESET;
-    weather->updateWeather();
-    food.adjust(weather->getFoodImpact());
-    if (weather->getFoodImpact() < 0)
-        std::cout << RED << "Weather reduced food by " << -weather->getFoodImpact() << "!\n" << RESET;
-    else if (weather->getFoodImpact() > 0)
-        std::cout << GREEN << "Weather increased food by " << weather->getFoodImpact() << "!\n" << RESET;
-    economy->collectTaxes(*population);
-    economy->triggerMarketCrash(*population);
-    bank->checkCorruption();
-    bank->seizeLand(*economy, *map);
-    army->checkMorale(*economy);
-    army->applyTrainingDelay();
-    corruption->checkCorruption();
-    inflation->update(*economy, *bank);
-    population->handleClassConflict();
-    politics->triggerRebellion(*population, *economy);
-    map->enemyAttack(food);
-    market->handleSmuggler(*economy, iron);
-    market->handleGuildDemands(*economy, *population);
-    randomEvent();
-    Validation::validateKingdom(*this);
-    printStatus();
+int Leaderboard::countHigher(int32_t score) const {
+    int count = 0;
+    int node = root;
+    while (node >= 0) {
+        if (records[nodes[node].record].score > score) {
+            count += nodeSize(nodes[node].left) + 1;
+            node = nodes[node].right;
+        }
+        else {
+            node = nodes[node].left;
+        }
+    }
+    return count;
 }
 
-void Kingdom::randomEvent() {
-    int event = rand() % 10;
-    switch (event) {
-    case 0:
-        population->adjustClassSize("Peasants", -static_cast<int>(population->getTotalSize() / 5 * (1 - healthcare->getPlagueReduction())));
-        population->adjustMorale(-0.15);
-        std::cout << RED << "Plague spreads! Population decreases significantly.\n" << RESET;
-        break;
-    case 1:
-        economy->spend(economy->getGold() / 10);
-        std::cout << RED << "Bandits raid the treasury!\n" << RESET;
-        break;
-    case 2:
-        food.adjust(500);
-        population->adjustMorale(0.1);
-        std::cout << GREEN << "Bumper harvest! Food increases.\n" << RESET;
-        break;
-    case 3:
-        food.adjust(-300);
-        std::cout << RED << "Drought! Food supply decreases.\n" << RESET;
-        break;
-    case 4:
-        market->updatePrices();
-        std::cout << RED << "Sanctions imposed! Market prices increase.\n" << RESET;
-        break;
-    case 5:
-        population->adjustMorale(-0.1);
-        politics->getCandidates()[rand() % politics->getCandidateCount()]->setCorrupted(true);
-        std::cout << RED << "Assassination attempt on king! Candidate corrupted.\n" << RESET;
-        break;
-    case 6:
-        economy->triggerMarketCrash(*population);
-        std::cout << RED << "Market crash! Prices soar.\n" << RESET;
-        break;
-    case 7:
-        population->adjustMorale(-0.05);
-        std::cout << RED << "Revolt risk rises!\n" << RESET;
-        break;
-    case 8:
-        population->adjustClassSize("Nobility", -population->getClasses()[2].size / 2);
-        population->adjustMorale(-0.1);
-        std::cout << RED << "Noble uprising! Nobility population halved.\n" << RESET;
-        break;
-    case 9:
-        army->getGeneral().setCorrupted(true);
-        std::cout << RED << "Spy infiltration! General corrupted.\n" << RESET;
-        break;
+bool Leaderboard::betterPosition(uint32_t a, uint32_t b) const {
+    if (a == NO_POSITION) return false;
+    if (b == NO_POSITION) return true;
+    return before(byTime[a], byTime[b]);
+}
+
+void Leaderboard::setMaxTreeLeaf(size_t position) const {
+    size_t node = maxTreeLeaves + position;
+    maxTree[node] = static_cast<uint32_t>(position);
+    for (node /= 2; node >= 1; node /= 2) {
+        uint32_t left = maxTree[2 * node];
+        uint32_t right = maxTree[2 * node + 1];
+        maxTree[node] = betterPosition(right, left) ? right : left;
     }
 }
 
-void Kingdom::trainArmy(int count) {
-    army->train(count, *population, iron, *blacksmith, buildings->getTrainingEfficiency());
+void Leaderboard::rebuildMaxTree() const {
+    maxTreeLeaves = 1;
+    while (maxTreeLeaves < byTime.size() * 2 || maxTreeLeaves < 16) maxTreeLeaves <<= 1;
+    maxTree.assign(2 * maxTreeLeaves, NO_POSITION);
+    for (size_t i = 0; i < byTime.size(); ++i) maxTree[maxTreeLeaves + i] = static_cast<uint32_t>(i);
+    for (size_t node = maxTreeLeaves - 1; node >= 1; --node) {
+        uint32_t left = maxTree[2 * node];
+        uint32_t right = maxTree[2 * node + 1];
+        maxTree[node] = betterPosition(right, left) ? right : left;
+    }
+    maxTreeDirty = false;
 }
 
-void Kingdom::holdElection() {
-    politics->holdElection(*population, *economy);
+uint32_t Leaderboard::bestInRange(size_t from, size_t to) const {
+    uint32_t best = NO_POSITION;
+    for (size_t left = from + maxTreeLeaves, right = to + maxTreeLeaves; left < right; left /= 2, right /= 2) {
+        if (left & 1) {
+            if (betterPosition(maxTree[left], best)) best = maxTree[left];
+            left++;
+        }
+        if (right & 1) {
+            right--;
+            if (betterPosition(maxTree[right], best)) best = maxTree[right];
+        }
+    }
+    return best;
 }
 
-void Kingdom::manageLoanOrAudit(int choice, int amount) {
-    if (choice == 1) {
-        bank->takeLoan(*economy, amount);
+void Leaderboard::add(const ScoreRecord& record) {
+    uint32_t index = static_cast<uint32_t>(records.size());
+    records.push_back(record);
+    nodes.push_back({ index, rng.next(), -1, -1, 1 });
+    int left, right;
+    split(root, index, left, right);
+    root = merge(merge(left, static_cast<int>(index)), right);
+
+    auto best = bestByKingdom.find(record.kingdom);
+    if (best == bestByKingdom.end()) bestByKingdom.emplace(record.kingdom, index);
+    else if (record.score > records[best->second].score) best->second = index;
+
+    // Scores normally arrive in time order, so the time index is appended and patched in O(log n)
+    if (byTime.empty() || records[byTime.back()].timestamp <= record.timestamp) {
+        byTime.push_back(index);
+        if (!maxTreeDirty && byTime.size() <= maxTreeLeaves) setMaxTreeLeaf(byTime.size() - 1);
+        else maxTreeDirty = true;
     }
-    else if (choice == 2) {
-        bank->repayLoan(*economy, amount);
+    else {
+        auto position = std::upper_bound(byTime.begin(), byTime.end(), record.timestamp,
+            [this](int64_t time, uint32_t other) { return time < records[other].timestamp; });
+        byTime.insert(position, index);
+        maxTreeDirty = true;
     }
-    else if (choice == 3) {
-        corruption->audit(*economy, *army, *politics, *blacksmith);
+}
+
+std::vector<ScoreRecord> Leaderboard::top(int k) const {
+    std::vector<ScoreRecord> result;
+    std::vector<int> stack;
+    int node = root;
+    while ((node >= 0 || !stack.empty()) && static_cast<int>(result.size()) < k) {
+        while (node >= 0) {
+            stack.push_back(node);
+            node = nodes[node].left;
+        }
+        node = stack.back();
+        stack.pop_back();
+        result.push_back(records[nodes[node].record]);
+        node = nodes[node].right;
     }
+    return result;
 }
 
-void Kingdom::buyResource(const std::string& resource, int amount) {
-    if (resource == "Food") market->buyResource(*economy, resource, amount, food);
-    else if (resource == "Iron") market->buyResource(*economy, resource, amount, iron);
-    else if (resource == "Wood") market->buyResource(*economy, resource, amount, wood);
-    else if (resource == "Stone") market->buyResource(*economy, resource, amount, stone);
-    else throw InsufficientResourcesException("Invalid resource");
+int Leaderboard::rankOf(const std::string& kingdom) const {
+    auto best = bestByKingdom.find(kingdom);
+    if (best == bestByKingdom.end()) return 0;
+    return countHigher(records[best->second].score) + 1;
 }
 
-void Kingdom::manageDiplomacy(const std::string& kingdom, int choice) {
-    if (choice == 1) diplomacy->formAlliance(kingdom);
-    else if (choice == 2) diplomacy->breakAlliance(kingdom);
-    else if (choice == 3) diplomacy->formTradeAgreement(kingdom);
-    else if (choice == 4) diplomacy->establishSecureRoute(kingdom);
+int Leaderboard::countInWindow(int64_t from, int64_t to) const {
+    auto first = std::lower_bound(byTime.begin(), byTime.end(), from,
+        [this](uint32_t index, int64_t time) { return records[index].timestamp < time; });
+    auto last = std::upper_bound(byTime.begin(), byTime.end(), to,
+        [this](int64_t time, uint32_t index) { return time < records[index].timestamp; });
+    return last > first ? static_cast<int>(last - first) : 0;
 }
 
-void Kingdom::bribeOrBlackmail(int choice, const std::string& candidate) {
-    if (choice == 1) politics->bribe(*economy, candidate);
-    else if (choice == 2) politics->blackmail(*economy, candidate);
+std::vector<ScoreRecord> Leaderboard::topInWindow(int64_t from, int64_t to, int k) const {
+    std::vector<ScoreRecord> result;
+    if (maxTreeDirty || maxTreeLeaves == 0) rebuildMaxTree();
+    size_t first = std::lower_bound(byTime.begin(), byTime.end(), from,
+        [this](uint32_t index, int64_t time) { return records[index].timestamp < time; }) - byTime.begin();
+    size_t last = std::upper_bound(byTime.begin(), byTime.end(), to,
+        [this](int64_t time, uint32_t index) { return time < records[index].timestamp; }) - byTime.begin();
+    // Repeatedly take the best position and split its range around it: O(k log n)
+    struct Range {
+        uint32_t best;
+        size_t from;
+        size_t to;
+    };
+    auto worse = [this](const Range& a, const Range& b) { return betterPosition(b.best, a.best); };
+    std::priority_queue<Range, std::vector<Range>, decltype(worse)> ranges(worse);
+    if (first < last) ranges.push({ bestInRange(first, last), first, last });
+    while (!ranges.empty() && static_cast<int>(result.size()) < k) {
+        Range range = ranges.top();
+        ranges.pop();
+        result.push_back(records[byTime[range.best]]);
+        if (range.from < range.best) ranges.push({ bestInRange(range.from, range.best), range.from, range.best });
+        if (range.best + 1 < range.to) ranges.push({ bestInRange(range.best + 1, range.to), range.best + 1, range.to });
+    }
+    return result;
 }
 
-void Kingdom::sendMessage(const std::string& recipient, const std::string& message) {
-    communication->sendMessage(recipient, message, false);
+int Leaderboard::size() const { return static_cast<int>(records.size()); }
+
+static void writeScoreRecord(BinaryWriter& out, const ScoreRecord& record) {
+    out.writeUInt64(static_cast<uint64_t>(record.timestamp));
+    out.writeInt(record.score);
+    out.writeInt(record.gold);
+    out.writeInt(record.army);
+    out.writeDouble(record.morale);
+    out.writeString(record.kingdom);
 }
 
-void Kingdom::sendFakeTradeRequest(const std::string& recipient) {
-    communication->sendFakeTradeRequest(recipient);
+// Reads the whole records of a scores.dat image and returns the byte length they end at. A torn
+// append leaves a partial record (or a partial header) after that point.
+static size_t readScoreRecords(const std::string& contents, const std::string& path, std::vector<ScoreRecord>* records) {
+    const size_t headerSize = 2 * sizeof(uint32_t);
+    if (contents.size() < headerSize) return 0;
+    BinaryReader in(contents.data(), contents.size());
+    if (in.readUInt() != LEADERBOARD_MAGIC || in.readUInt() != LEADERBOARD_VERSION)
+        throw std::runtime_error("Not a valid leaderboard file: " + path);
+    size_t whole = headerSize;
+    while (in.remaining() > 0) {
+        ScoreRecord record;
+        try {
+            record.timestamp = static_cast<int64_t>(in.readUInt64());
+            record.score = in.readInt();
+            record.gold = in.readInt();
+            record.army = in.readInt();
+            record.morale = in.readDouble();
+            record.kingdom = in.readString();
+        }
+        catch (const std::runtime_error&) {
+            break;
+        }
+        whole = contents.size() - in.remaining();
+        if (records) records->push_back(record);
+    }
+    return whole;
 }
 
-void Kingdom::viewMessages() {
-    communication->viewMessages(name);
+void Leaderboard::load(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) return;
+    std::string contents = readWholeFile(file);
+    std::vector<ScoreRecord> loaded;
+    size_t whole = readScoreRecords(contents, path, &loaded);
+    for (const ScoreRecord& record : loaded) add(record);
+    if (whole < contents.size()) {
+        // Everything before the partial record is kept; the next append cuts it off
+        std::cout << YELLOW << "Ignoring an incomplete score record at the end of " << path << ".\n" << RESET;
+    }
 }
 
-void Kingdom::upgradeBlacksmith() {
-    blacksmith->upgrade(*economy);
+void Leaderboard::save(const std::string& path) const {
+    std::string buffer;
+    BinaryWriter out(buffer);
+    out.writeUInt(LEADERBOARD_MAGIC);
+    out.writeUInt(LEADERBOARD_VERSION);
+    for (const ScoreRecord& record : records) writeScoreRecord(out, record);
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) throw std::runtime_error("Cannot open " + path);
+    file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
 }
 
-void Kingdom::produceWeapons(int count) {
-    blacksmith->produceWeapons(iron, wood, count);
+void Leaderboard::append(const std::string& path, const ScoreRecord& record) {
+    std::string contents;
+    {
+        std::ifstream existing(path, std::ios::binary);
+        if (existing.is_open()) contents = readWholeFile(existing);
+    }
+    size_t whole = readScoreRecords(contents, path, nullptr);
+    std::string buffer;
+    BinaryWriter out(buffer);
+    if (whole == 0) {
+        out.writeUInt(LEADERBOARD_MAGIC);
+        out.writeUInt(LEADERBOARD_VERSION);
+    }
+    writeScoreRecord(out, record);
+    // Appending after a torn record would leave this and every later score unreadable behind it,
+    // so the file is rewritten up to the last whole record first
+    bool torn = whole < contents.size();
+    if (torn) buffer.insert(0, contents, 0, whole);
+    std::ofstream file(path, std::ios::binary | (torn ? std::ios::trunc : std::ios::app));
+    if (!file.is_open()) throw std::runtime_error("Cannot open " + path);
+    file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
 }
 
-void Kingdom::conductEspionage(int action, Kingdom& target) {
-    Espionage espionage;
-    if (action == 1) espionage.spyMission(*this, target);
-    else if (action == 2) espionage.sabotageWeapons(*this, target);
-    else if (action == 3) espionage.stealGold(*this, target);
-    else throw InsufficientResourcesException("Invalid espionage action");
+int Leaderboard::importScoreText(const std::string& path) {
+    // Legacy score.txt: a ctime() line followed by "Kingdom: X, Score: N, Gold: G, Army: A, Morale: M"
+    std::ifstream file(path);
+    if (!file.is_open()) throw std::runtime_error("Cannot open " + path);
+    // Records already on the board (same time and kingdom) are skipped, so importing twice adds nothing
+    std::set<std::pair<int64_t, std::string>> known;
+    for (const ScoreRecord& record : records) known.emplace(record.timestamp, record.kingdom);
+    std::string timeLine, line;
+    int imported = 0;
+    while (std::getline(file, line)) {
+        // Each "Kingdom: " line pairs with the line just before it, so a missing or extra line costs one record
+        if (line.compare(0, 9, "Kingdom: ") != 0) {
+            timeLine = line;
+            continue;
+        }
+        std::tm parsed = {};
+        std::istringstream timeStream(timeLine);
+        timeLine.clear();
+        timeStream >> std::get_time(&parsed, "%a %b %d %H:%M:%S %Y");
+        size_t scoreAt = line.rfind(", Score: ");
+        if (timeStream.fail() || scoreAt == std::string::npos) continue;
+        parsed.tm_isdst = -1;
+        ScoreRecord record;
+        record.timestamp = static_cast<int64_t>(std::mktime(&parsed));
+        record.kingdom = line.substr(9, scoreAt - 9);
+        char separator;
+        std::string label;
+        std::istringstream fields(line.substr(scoreAt + 9));
+        fields >> record.score >> separator >> label >> record.gold >> separator >> label >> record.army
+            >> separator >> label >> record.morale;
+        if (fields.fail() || !known.emplace(record.timestamp, record.kingdom).second) continue;
+        add(record);
+        imported++;
+    }
+    return imported;
 }
 
-void Kingdom::conductSmuggling(Kingdom& target) {
-    Smuggling smuggling;
-    smuggling.smuggleGoods(*this, target);
+// ScreenRenderer class
+ScreenRenderer::ScreenRenderer() : rows(0), columns(0), interactive(false), pinned(false) {
+#ifdef _WIN32
+    HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD mode = 0;
+    if (console != INVALID_HANDLE_VALUE && GetConsoleMode(console, &mode)) {
+#ifndef ENABLE_VIRTUAL_TERMINAL_PROCESSING
+#define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+#endif
+        interactive = SetConsoleMode(console, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING) != 0;
+    }
+#else
+    interactive = isatty(STDOUT_FILENO) != 0;
+#endif
+    querySize();
 }
 
-void Kingdom::manageHealthcare(int choice) {
-    healthcare->manageHealthcare(choice, *economy, wood, stone, *population);
+ScreenRenderer::~ScreenRenderer() {
+    if (pinned) {
+        // Drop the scroll region so the shell gets the whole terminal back
+        writeOut("\0337\033[r\0338");
+    }
 }
 
-void Kingdom::manageBuildings(int choice) {
-    buildings->manageBuildings(choice, *economy, wood, stone);
+void ScreenRenderer::querySize() {
+    rows = 0;
+    columns = 0;
+    if (!interactive) return;
+#ifdef _WIN32
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &info)) {
+        rows = info.srWindow.Bottom - info.srWindow.Top + 1;
+        columns = info.srWindow.Right - info.srWindow.Left + 1;
+    }
+#else
+    winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0) {
+        rows = size.ws_row;
+        columns = size.ws_col;
+    }
+#endif
 }
 
-void Kingdom::saveState(const std::string& filename) const {
-    std::ofstream file(filename, std::ios::app);
-    if (!file.is_open()) throw std::runtime_error("Cannot open save file");
-    file << "Kingdom: " << name << "\n";
-    file << "Population: " << population->getTotalSize() << "\n";
-    file << "Morale: " << population->getMorale() << "\n";
-    file << "Gold: " << economy->getGold() << "\n";
-    file << "Loan: " << bank->getLoan() << "\n";
-    file << "LandSeized: " << bank->getLandSeized() << "\n";
-    file << "Army: " << army->getSize() << "\n";
-    file << "Weapons: " << army->getWeapons() << "\n";
-    file << "Food: " << food.get() << "\n";
-    file << "Iron: " << iron.get() << "\n";
-    file << "Wood: " << wood.get() << "\n";
-    file << "Stone: " << stone.get() << "\n";
-    file << "BlacksmithLevel: " << blacksmith->getLevel() << "\n";
-    file << "King: " << politics->getCurrentKing() << "\n";
-    file << "Tax: " << (economy->isProgressiveTax() ? "Progressive" : "Flat") << "\n";
-    file << "HealthcareLevel: " << healthcare->getLevel() << "\n";
-    file << "BarracksLevel: " << buildings->getBarracksLevel() << "\n";
-    file << "Inflation: " << inflation->getRate() << "\n";
-    file << "\n";
-    file.close();
-    std::cout << GREEN << "Game state saved for " << name << "!\n" << RESET;
+void ScreenRenderer::writeOut(const std::string& text) {
+    // Anything still buffered in cout must reach the terminal before the frame does
+    std::cout.flush();
+    std::fflush(stdout);
+#ifdef _WIN32
+    DWORD written = 0;
+    WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), text.data(), static_cast<DWORD>(text.size()), &written, nullptr);
+#else
+    size_t offset = 0;
+    while (offset < text.size()) {
+        ssize_t written = write(STDOUT_FILENO, text.data() + offset, text.size() - offset);
+        if (written <= 0) break;
+        offset += static_cast<size_t>(written);
+    }
+#endif
 }
 
-void Kingdom::loadState(const std::string& filename) {
-    std::ifstream file(filename);
-    if (!file.is_open()) {
-        std::cout << YELLOW << "No save file found for " << name << ". Starting new game.\n" << RESET;
+size_t ScreenRenderer::visibleWidth(const std::string& line) {
+    size_t width = 0;
+    for (size_t i = 0; i < line.size(); ++i) {
+        if (line[i] == '\033') {
+            while (i < line.size() && line[i] != 'm') ++i;
+            continue;
+        }
+        width++;
+    }
+    return width;
+}
+
+void ScreenRenderer::appendColumns(std::vector<std::string>& frame, const std::vector<std::string>& left,
+    const std::vector<std::string>& right) const {
+    size_t leftWidth = 0, rightWidth = 0;
+    for (const std::string& line : left) leftWidth = std::max(leftWidth, visibleWidth(line));
+    for (const std::string& line : right) rightWidth = std::max(rightWidth, visibleWidth(line));
+    const size_t gap = 4;
+    if (columns <= 0 || leftWidth + gap + rightWidth > static_cast<size_t>(columns)) {
+        frame.insert(frame.end(), left.begin(), left.end());
+        frame.insert(frame.end(), right.begin(), right.end());
         return;
     }
-    std::string line, savedName;
-    while (std::getline(file, line)) {
-        if (line.find("Kingdom: ") == 0) {
-            savedName = line.substr(9);
-            if (savedName != name) continue;
-            std::cout << GREEN << "Game state loaded for " << name << "!\n" << RESET;
-            break;
-        }
+    size_t height = std::max(left.size(), right.size());
+    for (size_t i = 0; i < height; ++i) {
+        std::string line = i < left.size() ? left[i] : "";
+        line.append(leftWidth + gap - visibleWidth(line), ' ');
+        if (i < right.size()) line += right[i];
+        frame.push_back(line);
     }
-    file.close();
 }
 
-void Kingdom::saveScore() const {
-    std::ofstream file("score.txt", std::ios::app);
-    if (!file.is_open()) throw std::runtime_error("Cannot open score.txt");
-    time_t now = time(nullptr);
-#ifdef _MSC_VER
-    char buffer[26];
-    if (ctime_s(buffer, sizeof(buffer), &now) != 0) {
-        throw std::runtime_error("Failed to format timestamp");
+void ScreenRenderer::invalidate() {
+    previous.clear();
+}
+
+void ScreenRenderer::present(const std::vector<std::string>& frame) {
+    int oldRows = rows, oldColumns = columns;
+    querySize();
+    int height = static_cast<int>(frame.size());
+    bool fits = interactive && rows - height >= MIN_LOG_ROWS;
+    std::string out;
+
+    if (!fits) {
+        // Frame is taller than the terminal (or output is redirected): print it into the log as one block
+        if (pinned) out += "\0337\033[r\0338";
+        pinned = false;
+        previous.clear();
+        for (const std::string& line : frame) out += line + "\n";
+        writeOut(out);
+        return;
     }
-#else
-    char* buffer = ctime(&now);
-    if (!buffer) {
-        throw std::runtime_error("Failed to format timestamp");
+
+    if (!pinned || rows != oldRows || columns != oldColumns || previous.size() != frame.size()) {
+        // Full redraw: clear, reserve the top rows for the frame and scroll everything else below it
+        out += "\033[r\033[2J\033[H";
+        for (const std::string& line : frame) out += line + RESET + "\033[K\r\n";
+        out += "\033[" + std::to_string(height + 1) + ";" + std::to_string(rows) + "r";
+        out += "\033[" + std::to_string(height + 1) + ";1H";
+        pinned = true;
     }
-#endif
-    file << buffer << "Kingdom: " << name << ", Score: " << calculateScore()
-        << ", Gold: " << economy->getGold() << ", Army: " << army->getSize()
-        << ", Morale: " << population->getMorale() << "\n";
-    file.close();
-    std::cout << GREEN << "Score saved to score.txt for " << name << "!\n" << RESET;
+    else {
+        bool changed = false;
+        for (int i = 0; i < height; ++i) {
+            if (frame[i] == previous[i]) continue;
+            if (!changed) out += "\0337";
+            changed = true;
+            out += "\033[" + std::to_string(i + 1) + ";1H" + frame[i] + RESET + "\033[K";
+        }
+        if (!changed) {
+            previous = frame;
+            return;
+        }
+        out += "\0338";
+    }
+    previous = frame;
+    writeOut(out);
 }
 
-int Kingdom::calculateScore() const {
-    int moraleScore = static_cast<int>(population->getMorale() * 300);
-    int goldScore = std::min(1000, economy->getGold() / 10) * 250;
-    int armyScore = army->getSize() * 2;
-    int resourceScore = (food.get() + iron.get() + wood.get() + stone.get()) / 10;
-    int diplomacyScore = diplomacy->getAllianceCount() * 50;
-    int landPenalty = bank->getLandSeized() * 100;
-    return moraleScore + goldScore + armyScore + resourceScore + diplomacyScore - landPenalty;
+// Benchmark class
+Benchmark::Benchmark(double sampleSeconds, int samples) : sampleSeconds(sampleSeconds), samples(samples) {}
+
+void Benchmark::add(const std::string& name, const std::function<void()>& op, const std::function<void()>& teardown) {
+    cases.push_back({ name, op, teardown });
 }
 
-void Kingdom::printStatus() const {
-    std::cout << YELLOW << "Kingdom Status (" << name << "):\n" << RESET;
-    std::cout << "Population: " << population->getTotalSize() << ", Morale: " << population->getMorale() << "\n";
-    ResourcePair* classes = population->getClasses();
-    for (int i = 0; i < MAX_CLASSES; ++i) {
-        std::cout << "  " << classes[i].name << ": " << classes[i].size << ", Satisfaction: " << classes[i].satisfaction << "\n";
-    }
-    std::cout << "Gold: " << economy->getGold() << ", Loan: " << bank->getLoan() << ", Debt Reliance: " << economy->getDebtReliance() << "\n";
-    std::cout << "Army: " << army->getSize() << ", Morale: " << army->getMorale() << ", Weapons: " << army->getWeapons() << "\n";
-    std::cout << "Resources: Food=" << food.get() << ", Iron=" << iron.get()
-        << ", Wood=" << wood.get() << ", Stone=" << stone.get() << "\n";
-    std::cout << "Blacksmith: Level=" << blacksmith->getLevel() << ", Weapons in stock=" << blacksmith->getWeaponsInStock() << "\n";
-    std::cout << "Healthcare: Level=" << healthcare->getLevel() << ", Plague Reduction=" << healthcare->getPlagueReduction() * 100 << "%\n";
-    std::cout << "Barracks: Level=" << buildings->getBarracksLevel() << ", Training Efficiency="
-        << buildings->getTrainingEfficiency() * 100 << "%\n";
-    std::cout << "Weather: " << weather->getSeason() << ", " << weather->getWeather() << "\n";
-    std::cout << "Inflation: " << inflation->getRate() << "\n";
-    std::cout << "King: " << politics->getCurrentKing() << "\n";
-    std::cout << "Tax: " << (economy->isProgressiveTax() ? "Progressive" : "Flat") << "\n";
-    std::cout << "Land Seized by Bank: " << bank->getLandSeized() << "\n";
-    std::cout << "Score: " << calculateScore() << " points\n";
-    map->display();
+static double timeBatch(const std::function<void()>& op, long long iterations) {
+    auto start = std::chrono::steady_clock::now();
+    for (long long i = 0; i < iterations; ++i) op();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 }
 
-Bank& Kingdom::getBank() { return *bank; }
-const Bank& Kingdom::getBank() const { return *bank; }
-Resource<int>& Kingdom::getIron() { return iron; }
-const Resource<int>& Kingdom::getIron() const { return iron; }
-Economy& Kingdom::getEconomy() { return *economy; }
-const Economy& Kingdom::getEconomy() const { return *economy; }
-Population& Kingdom::getPopulation() { return *population; }
-const Population& Kingdom::getPopulation() const { return *population; }
-Army& Kingdom::getArmy() { return *army; }
-const Army& Kingdom::getArmy() const { return *army; }
-Blacksmith& Kingdom::getBlacksmith() { return *blacksmith; }
-const Blacksmith& Kingdom::getBlacksmith() const { return *blacksmith; }
-Diplomacy& Kingdom::getDiplomacy() { return *diplomacy; }
-const Diplomacy& Kingdom::getDiplomacy() const { return *diplomacy; }
-Weather& Kingdom::getWeather() { return *weather; }
-const Weather& Kingdom::getWeather() const { return *weather; }
-Market& Kingdom::getMarket() { return *market; }
-const Market& Kingdom::getMarket() const { return *market; }
-std::string Kingdom::getName() const { return name; }
+std::vector<BenchmarkResult> Benchmark::run(std::ostream& out) {
+    std::vector<BenchmarkResult> results;
+    InstantClock clock;
+    ClockScope clockScope(clock);
+    for (const Case& benchmark : cases) {
+        BenchmarkResult result;
+        result.name = benchmark.name;
+        std::vector<double> perOp;
+        {
+            ConsoleSilencer silencer;
+            // Grow the batch until it is long enough to time reliably, then size samples from it
+            long long batch = 1;
+            double elapsed = timeBatch(benchmark.op, batch);
+            while (elapsed < 0.01 && batch < (1LL << 40)) {
+                batch *= 2;
+                elapsed = timeBatch(benchmark.op, batch);
+            }
+            result.iterations += batch;
+            batch = std::max(1LL, static_cast<long long>(sampleSeconds / (elapsed / batch)));
+            for (int i = 0; i < samples; ++i) {
+                perOp.push_back(timeBatch(benchmark.op, batch) * 1e9 / batch);
+                result.iterations += batch;
+            }
+            if (benchmark.teardown) benchmark.teardown();
+        }
+        // Noise from the scheduler only ever adds time, so the fastest sample is the most repeatable
+        result.nanosecondsPerOp = *std::min_element(perOp.begin(), perOp.end());
+        out << "  " << benchmark.name << ": " << result.nanosecondsPerOp << " ns/op\n" << std::flush;
+        results.push_back(result);
+    }
+    return results;
+}
 
-// Validation class
-void Validation::validateKingdom(const Kingdom& kingdom) {
-    if (kingdom.getEconomy().getGold() < 0)
-        std::cout << RED << "Warning: Negative gold detected!\n" << RESET;
-    if (kingdom.getPopulation().getMorale() < 0 || kingdom.getPopulation().getMorale() > 1)
-        std::cout << RED << "Warning: Invalid morale!\n" << RESET;
-    if (kingdom.getArmy().getSize() < 0)
-        std::cout << RED << "Warning: Negative army size!\n" << RESET;
-    if (kingdom.getBank().getLoan() > 5000)
-        std::cout << RED << "Warning: Excessive loan detected!\n" << RESET;
+Benchmark Benchmark::standard() {
+    Benchmark suite;
+    auto sink = std::make_shared<long long>(0);
+
+    auto kingdom = std::make_shared<std::unique_ptr<Kingdom>>(new Kingdom("Bench", "King", 1, 1));
+    auto seed = std::make_shared<uint64_t>(1);
+    suite.add("Kingdom::playTurn", [kingdom, seed]() {
+        // A turn can throw once the kingdom runs dry; start a fresh one like a new game would
+        bool failed = false;
+        try {
+            (*kingdom)->playTurn();
+        }
+        catch (const std::exception&) {
+            failed = true;
+        }
+        if (failed || (*kingdom)->isCollapsed()) kingdom->reset(new Kingdom("Bench", "King", ++*seed, 1));
+    });
+
+    auto scored = std::make_shared<Kingdom>("Bench", "King", 2, 1);
+    suite.add("Kingdom::calculateScore", [scored, sink]() { *sink += scored->calculateScore(); });
+    suite.add("Kingdom::clone (train what-if)", [scored, sink]() {
+        Kingdom what = scored->clone();
+        try {
+            what.trainArmy(10);
+        }
+        catch (const InsufficientResourcesException&) {}
+        *sink += what.calculateScore();
+    });
+
+    suite.add("Kingdom::Kingdom", [sink]() {
+        Kingdom built("Bench", "King", 4, 1);
+        *sink += built.getArmy().getSize();
+    });
+
+    auto arena = std::make_shared<MonotonicArena>();
+    auto graph = std::make_shared<DiplomacyGraph>();
+    suite.add("Kingdom::Kingdom (arena)", [arena, graph, sink]() {
+        {
+            Kingdom built("Bench", "King", 4, 1, arena.get(), graph);
+            *sink += built.getArmy().getSize();
+        }
+        arena->release();
+    });
+
+    auto electing = std::make_shared<Kingdom>("Bench", "King", 3, 1);
+    suite.add("Politics::holdElection", [electing]() { electing->holdElection(); });
+
+    auto inflation = std::make_shared<Inflation>();
+    auto market = std::make_shared<Market>(inflation.get());
+    suite.add("Market::getPrice", [inflation, market, sink]() {
+        double total = 0;
+        for (int r = 0; r < RESOURCE_COUNT; ++r) total += market->getPrice(static_cast<ResourceType>(r));
+        *sink += static_cast<long long>(total);
+    });
+
+    auto sharedTreasury = std::make_shared<SharedTreasury>(ResourceBundle().withGold(1000).with(WOOD, 200).with(STONE, 200));
+    suite.add("SharedTreasury::tryWithdraw+deposit", [sharedTreasury, sink]() {
+        ResourceBundle cost = ResourceBundle().withGold(500).with(WOOD, 100).with(STONE, 100);
+        if (sharedTreasury->tryWithdraw(cost) == STATUS_OK) sharedTreasury->deposit(cost);
+        *sink += sharedTreasury->getBalance().getGold();
+    });
+
+    auto prices = std::make_shared<PriceHistory>();
+    auto tick = std::make_shared<int>(0);
+    suite.add("PriceHistory::record+stats", [prices, tick, sink]() {
+        prices->record(4.0 + (++*tick % 17) * 0.05);
+        *sink += static_cast<long long>(prices->movingAverage() + prices->volatility() + prices->windowMax());
+    });
+
+    auto treasury = std::make_shared<Economy>(1 << 30);
+    auto stock = std::make_shared<Resource<int>>(0);
+    suite.add("Market::buyResource", [inflation, market, treasury, stock]() {
+        if (treasury->getGold() < 1000) *treasury = Economy(1 << 30);
+        market->buyResource(*treasury, FOOD, 1, *stock);
+        stock->adjust(-1);
+    });
+
+    auto population = std::make_shared<Population>();
+    suite.add("Population::adjustClassSize", [population]() {
+        population->adjustClassSize(MERCHANTS, 1);
+        population->adjustClassSize(MERCHANTS, -1);
+    });
+
+    auto territory = std::make_shared<Map>(256, 256);
+    {
+        OwnerId owners[3] = { territory->registerOwner("North"), territory->registerOwner("South"), territory->registerOwner("Bank") };
+        Random layout(5, 1);
+        for (int i = 0; i < 20000; ++i) territory->setOwner(layout.nextInt(256), layout.nextInt(256), owners[layout.nextInt(3)]);
+        territory->compact();
+    }
+    suite.add("Map territory (border+shared+capturable)", [territory, sink]() {
+        *sink += territory->borderLength(1) + territory->sharedBorder(1, 2) + territory->countCapturable(3);
+    });
+
+    auto exchange = std::make_shared<Exchange>();
+    auto traders = std::make_shared<std::vector<Kingdom>>();
+    for (int i = 0; i < 4; ++i) {
+        traders->emplace_back("Trader " + std::to_string(i + 1), "King", 6, i + 1);
+        traders->back().getEconomy().spend(-(1 << 29));
+        traders->back().getIron().adjust(1 << 29);
+    }
+    for (Kingdom& trader : *traders) trader.attachExchange(exchange.get());
+    auto flow = std::make_shared<Random>(6, 0);
+    suite.add("Exchange order (place+match)", [exchange, traders, flow]() {
+        Kingdom& trader = (*traders)[flow->nextInt(4)];
+        trader.placeOrder(IRON, flow->nextInt(2) ? SIDE_BUY : SIDE_SELL, 90 + flow->nextInt(21), 1 + flow->nextInt(20));
+    });
+
+    const std::string stateFile = "bench_state.dat";
+    auto saved = std::make_shared<Kingdom>("Bench", "King", 4, 1);
+    suite.add("Kingdom::saveState", [saved, stateFile]() { saved->saveState(stateFile); });
+    suite.add("Kingdom::loadState", [saved, stateFile]() { saved->loadState(stateFile); },
+        [stateFile]() { std::remove(stateFile.c_str()); });
+
+    // The same deterministic phases over 1024 kingdoms, as structure-of-arrays kernels and as live objects
+    auto batch = std::make_shared<KingdomBatch>();
+    auto live = std::make_shared<std::vector<Kingdom>>();
+    batch->reserve(1024);
+    live->reserve(1024);
+    for (int i = 0; i < 1024; ++i) {
+        live->emplace_back("Batch " + std::to_string(i + 1), "King", 7, i + 1);
+        batch->add(live->back());
+    }
+    suite.add("KingdomBatch::stepDeterministic (1024 kingdoms)", [batch, sink]() {
+        batch->stepDeterministic();
+        *sink += batch->getGold(0);
+    });
+    suite.add("Kingdom::stepDeterministic (1024 kingdoms)", [live, sink]() {
+        for (Kingdom& kingdom : *live) kingdom.stepDeterministic();
+        *sink += live->front().getEconomy().getGold();
+    });
+
+    // Stores are opened on first use; the writer starts a fresh file every 4096 snapshots since
+    // the store only ever appends
+    const std::string storeFile = "bench_snapshots.dat";
+    auto store = std::make_shared<std::unique_ptr<SnapshotStore>>();
+    auto storeTurn = std::make_shared<int>(0);
+    suite.add("SnapshotStore::put", [saved, storeFile, store, storeTurn]() {
+        if (!*store || *storeTurn % 4096 == 0) {
+            store->reset();
+            std::remove(storeFile.c_str());
+            store->reset(new SnapshotStore(storeFile));
+        }
+        (*store)->put(*saved, 1, (*storeTurn)++);
+    }, [storeFile, store]() {
+        store->reset();
+        std::remove(storeFile.c_str());
+    });
+    auto archive = std::make_shared<std::unique_ptr<SnapshotStore>>();
+    auto lookup = std::make_shared<Random>(8, 0);
+    suite.add("SnapshotStore::load", [saved, storeFile, archive, lookup]() {
+        if (!*archive) {
+            std::remove(storeFile.c_str());
+            archive->reset(new SnapshotStore(storeFile));
+            for (int turn = 0; turn < 1024; ++turn) (*archive)->put(*saved, 1, turn);
+        }
+        (*archive)->load(*saved, 1, lookup->nextInt(1024));
+    }, [storeFile, archive]() {
+        archive->reset();
+        std::remove(storeFile.c_str());
+    });
+
+    auto gameSeed = std::make_shared<uint64_t>(1);
+    suite.add("Simulation (2 kingdoms, 100 turns)", [gameSeed, sink]() {
+        Simulation sim(2, (*gameSeed)++);
+        sim.run(100, Simulation::randomAction);
+        *sink += sim.getTurnCount();
+    });
+    return suite;
+}
+
+std::vector<BenchmarkResult> Benchmark::loadBaseline(const std::string& path) {
+    std::vector<BenchmarkResult> results;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        size_t tab = line.rfind('\t');
+        if (tab == std::string::npos) continue;
+        BenchmarkResult result;
+        result.name = line.substr(0, tab);
+        result.nanosecondsPerOp = std::atof(line.c_str() + tab + 1);
+        results.push_back(result);
+    }
+    return results;
+}
+
+void Benchmark::saveBaseline(const std::string& path, const std::vector<BenchmarkResult>& results) {
+    std::ofstream file(path, std::ios::trunc);
+    if (!file.is_open()) throw std::runtime_error("Cannot open " + path);
+    file << "# Stronghold benchmark baseline: name<TAB>nanoseconds per op\n";
+    for (const BenchmarkResult& result : results) file << result.name << "\t" << result.nanosecondsPerOp << "\n";
+}
+
+int Benchmark::compare(const std::vector<BenchmarkResult>& current, const std::vector<BenchmarkResult>& baseline,
+    double threshold, std::ostream& out) {
+    int regressions = 0;
+    char line[160];
+    snprintf(line, sizeof(line), "%-36s %14s %14s %9s\n", "Benchmark", "ns/op", "baseline", "change");
+    out << BOLD << line << RESET;
+    for (const BenchmarkResult& result : current) {
+        auto match = std::find_if(baseline.begin(), baseline.end(),
+            [&result](const BenchmarkResult& b) { return b.name == result.name; });
+        if (match == baseline.end() || match->nanosecondsPerOp <= 0) {
+            snprintf(line, sizeof(line), "%-36s %14.1f %14s %9s\n", result.name.c_str(), result.nanosecondsPerOp, "-", "new");
+            out << line;
+            continue;
+        }
+        double change = result.nanosecondsPerOp / match->nanosecondsPerOp - 1.0;
+        snprintf(line, sizeof(line), "%-36s %14.1f %14.1f %+8.1f%%", result.name.c_str(), result.nanosecondsPerOp,
+            match->nanosecondsPerOp, change * 100);
+        if (change > threshold) {
+            out << RED << line << "  REGRESSION\n" << RESET;
+            regressions++;
+        }
+        else if (change < -threshold) {
+            out << GREEN << line << "  faster\n" << RESET;
+        }
+        else {
+            out << line << "\n";
+        }
+    }
+    return regressions;
 }
\ No newline at end of file
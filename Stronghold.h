@@ -4,13 +4,36 @@
 #include <string>
 #include <memory>
 #include <exception>
+#include <vector>
+#include <functional>
+#include <iosfwd>
+#include <cstdint>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <unordered_map>
+#include <chrono>
+#include <bitset>
+#include <map>
 
 const int MAX_CLASSES = 4;
 const int MAX_CANDIDATES = 3;
-const int MAX_MESSAGES = 10;
+const int MAX_MESSAGES = 10;          // default mailbox capacity per recipient
+const int POST_OFFICE_CAPACITY = 256; // in-flight messages per recipient between kingdoms
 const int MAX_ALLIANCES = 2;
+const int MAX_KINGDOMS = 256;
+const int MIN_PLAYERS = 2;
+const int MAX_PLAYERS = 64;           // seats in an interactive game
 const int MAX_PRICES = 4;
 const int GRID_SIZE = 5;
+const int CHUNK_SHIFT = 6;
+const int CHUNK_SIZE = 1 << CHUNK_SHIFT;  // map chunks are 64x64 tiles
+const int MAP_VIEW_SIZE = 16;            // largest map window drawn in the status panel
+const int PRICE_HISTORY_CAPACITY = 256;  // price samples kept per resource
+const int PRICE_WINDOW = 20;             // samples in the rolling statistics window
+const size_t ARENA_BLOCK_SIZE = 1 << 16; // bytes per monotonic arena block
 
 // ANSI color codes
 #define RED "\033[31m"
@@ -19,9 +42,29 @@ const int GRID_SIZE = 5;
 #define RESET "\033[0m"
 #define BOLD "\033[1m"
 
+// Resource and population class registry
+enum ResourceType { FOOD = 0, IRON, WOOD, STONE, RESOURCE_COUNT };
+enum PopulationClass { PEASANTS = 0, MERCHANTS, NOBILITY, MILITARY, CLASS_COUNT };
+
+constexpr const char* RESOURCE_NAMES[RESOURCE_COUNT] = { "Food", "Iron", "Wood", "Stone" };
+constexpr double BASE_PRICES[RESOURCE_COUNT] = { 2.0, 5.0, 3.0, 4.0 };
+constexpr int STARTING_RESOURCES[RESOURCE_COUNT] = { 1000, 500, 800, 600 };
+constexpr const char* CLASS_NAMES[CLASS_COUNT] = { "Peasants", "Merchants", "Nobility", "Military" };
+constexpr int STARTING_CLASS_SIZES[CLASS_COUNT] = { 700, 200, 50, 50 };
+constexpr double STARTING_SATISFACTION[CLASS_COUNT] = { 0.75, 0.85, 0.95, 0.9 };
+static_assert(CLASS_COUNT == MAX_CLASSES, "population classes must match MAX_CLASSES");
+static_assert(RESOURCE_COUNT == MAX_PRICES, "market prices must match the resource registry");
+
+// Name lookups for input parsing only; the game itself works on the enums
+bool parseResourceType(const std::string& name, ResourceType& type);
+bool parsePopulationClass(const std::string& name, PopulationClass& populationClass);
+
 // Forward declarations
 class Kingdom;
 class Map;
+class Market;
+class Communication;
+class Economy;
 
 // Utility functions
 int getValidInt(const std::string& prompt);
@@ -42,6 +85,217 @@ public:
     const char* what() const noexcept override { return message.c_str(); }
 };
 
+// Action results for the non-throwing tryX API. Failed actions are routine for simulated
+// players, so they get a status code; the throwing versions turn it back into the exception.
+enum ActionStatus {
+    STATUS_OK = 0,
+    STATUS_INSUFFICIENT_GOLD,
+    STATUS_INSUFFICIENT_RESOURCES,
+    STATUS_INSUFFICIENT_WEAPON_MATERIALS,
+    STATUS_NOT_ENOUGH_WEAPONS,
+    STATUS_INSUFFICIENT_RECRUITS,
+    STATUS_INSUFFICIENT_WEAPON_STOCK,
+    STATUS_NOT_ENOUGH_SOLDIERS,
+    STATUS_LOAN_EXCEEDED,
+    STATUS_AUDIT_FAILED,
+    STATUS_BANK_AUDIT_FAILED,
+    STATUS_HOSPITAL_UNDER_CONSTRUCTION,
+    STATUS_BARRACKS_UNDER_CONSTRUCTION,
+    STATUS_INSUFFICIENT_SPY_RESOURCES,
+    STATUS_INSUFFICIENT_SABOTAGE_RESOURCES,
+    STATUS_INSUFFICIENT_THEFT_RESOURCES,
+    STATUS_INSUFFICIENT_SMUGGLING_GOLD,
+    STATUS_NO_SECURE_ROUTE,
+    STATUS_INVALID_HEALTHCARE_CHOICE,
+    STATUS_INVALID_BUILDINGS_CHOICE,
+    STATUS_INVALID_ESPIONAGE_ACTION,
+    STATUS_INVALID_TARGET,
+    STATUS_INVALID_ACTION,
+    STATUS_NO_ALLIANCE,
+    STATUS_UNKNOWN_RECIPIENT,
+    STATUS_NO_EXCHANGE,
+    STATUS_UNKNOWN_TRADER,
+    STATUS_INVALID_ORDER,
+    STATUS_ORDER_TOO_LARGE,
+    STATUS_NO_SUCH_ORDER,
+    STATUS_COUNT
+};
+
+constexpr const char* STATUS_MESSAGES[STATUS_COUNT] = {
+    "OK", "Insufficient gold", "Insufficient resources", "Insufficient resources for weapon production",
+    "Not enough weapons", "Insufficient population or iron", "Insufficient weapons in stock", "Not enough soldiers",
+    "Cannot repay more than loan", "Audit failed: Insufficient gold", "Bank audit failed: Insufficient gold",
+    "Hospital already under construction", "Barracks already under construction", "Insufficient resources for spying",
+    "Insufficient resources for sabotage", "Insufficient resources for theft", "Insufficient gold for smuggling",
+    "No secure route for smuggling", "Invalid healthcare choice", "Invalid buildings choice",
+    "Invalid espionage action", "Invalid target kingdom", "Invalid action", "No alliance exists",
+    "Unknown recipient kingdom", "No exchange available", "Unknown trader", "Invalid order", "Order too large",
+    "No such open order"
+};
+
+const char* statusMessage(ActionStatus status);
+// Throws the exception the status stands for: CorruptionException for failed audits,
+// InsufficientResourcesException otherwise
+void requireSuccess(ActionStatus status);
+
+// Binary snapshot helpers (little-endian, length-prefixed strings)
+const uint32_t SAVE_FORMAT_MAGIC = 0x48525453;  // "STRH"
+const uint32_t SAVE_FORMAT_VERSION = 4;  // 2: per-recipient mailboxes, 3: chunked map, 4: price history
+
+class BinaryWriter {
+    std::string& buffer;
+public:
+    explicit BinaryWriter(std::string& buffer);
+    void writeBytes(const void* data, size_t size);
+    void writeByte(uint8_t value);
+    void writeBool(bool value);
+    void writeInt(int32_t value);
+    void writeUInt(uint32_t value);
+    void writeUInt64(uint64_t value);
+    void writeVarUInt(uint64_t value);  // LEB128: 7 bits per byte, high bit set on all but the last
+    void writeVarInt(int64_t value);    // zigzag, so small negative deltas stay short
+    void writeDouble(double value);
+    void writeString(const std::string& value);
+    size_t size() const;
+};
+
+class BinaryReader {
+    const char* data;
+    size_t size;
+    size_t offset;
+public:
+    BinaryReader(const char* data, size_t size);
+    void readBytes(void* target, size_t count);
+    uint8_t readByte();
+    bool readBool();
+    int32_t readInt();
+    uint32_t readUInt();
+    uint64_t readUInt64();
+    uint64_t readVarUInt();
+    int64_t readVarInt();
+    double readDouble();
+    std::string readString();
+    size_t remaining() const;
+};
+
+// Snapshot record: header followed by a checksummed payload
+struct SnapshotHeader {
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    uint64_t payloadSize = 0;
+    uint32_t checksum = 0;
+};
+const size_t SNAPSHOT_HEADER_SIZE = 20;
+
+uint32_t snapshotChecksum(const char* data, size_t size);
+bool readSnapshotHeader(const char* data, size_t size, SnapshotHeader& header);
+
+// Clock classes
+class Clock {
+public:
+    virtual ~Clock() = default;
+    virtual void wait(double seconds) = 0;
+    virtual double now() const = 0;
+};
+
+class RealTimeClock : public Clock {
+    double start;
+public:
+    RealTimeClock();
+    void wait(double seconds) override;
+    double now() const override;
+};
+
+class ScaledClock : public Clock {
+    double scale;
+    double start;
+public:
+    ScaledClock(double scale);
+    void wait(double seconds) override;
+    double now() const override;
+    double getScale() const;
+};
+
+class InstantClock : public Clock {
+    double elapsed;
+public:
+    InstantClock();
+    void wait(double seconds) override;
+    double now() const override;
+};
+
+Clock& activeClock();
+
+class ClockScope {
+    Clock* previous;
+public:
+    explicit ClockScope(Clock& clock);
+    ~ClockScope();
+    ClockScope(const ClockScope&) = delete;
+    ClockScope& operator=(const ClockScope&) = delete;
+};
+
+// Profiler class
+// Build with -DSTRONGHOLD_PROFILE to time turn phases and player actions. Otherwise
+// PROFILE_SCOPE expands to nothing and none of this is compiled.
+#ifdef STRONGHOLD_PROFILE
+class Profiler {
+public:
+    static const int HISTOGRAM_BUCKETS = 40;  // bucket b holds durations in [2^(b-1), 2^b) ns
+    static const size_t MAX_TRACE_EVENTS = 1 << 20;  // per thread; histograms keep counting past it
+    struct Event {
+        const char* name;
+        uint64_t start;
+        uint64_t duration;
+    };
+    struct Histogram {
+        uint64_t buckets[HISTOGRAM_BUCKETS] = {};
+        uint64_t count = 0;
+        uint64_t total = 0;
+        uint64_t maximum = 0;
+        void add(uint64_t nanoseconds);
+        void merge(const Histogram& other);
+        uint64_t percentile(double fraction) const;
+    };
+private:
+    // Each thread records into its own buffer so timing never takes a lock
+    struct ThreadBuffer {
+        uint32_t id;
+        std::vector<Event> events;
+        std::unordered_map<const char*, Histogram> histograms;
+    };
+    std::mutex lock;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    std::chrono::steady_clock::time_point epoch;
+    Profiler();
+    ThreadBuffer& localBuffer();
+public:
+    static Profiler& instance();
+    uint64_t now() const;
+    void record(const char* name, uint64_t start, uint64_t duration);
+    void reset();
+    // Call these only once the profiled threads have finished
+    void writeChromeTrace(const std::string& path);
+    void printHistograms(std::ostream& out);
+};
+
+class ProfileScope {
+    const char* name;
+    uint64_t start;
+public:
+    explicit ProfileScope(const char* scopeName);
+    ~ProfileScope();
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#else
+#define PROFILE_SCOPE(name) do {} while (0)
+#endif
+
 // Resource class
 template <typename T>
 class Resource {
@@ -52,6 +306,140 @@ public:
     T get() const { return value; }
 };
 
+// ResourceBundle class
+// A cost across every resource and gold: lanes follow ResourceType and the last one is gold, so a
+// whole cost is checked with one branch-free pass over a small array the compiler can vectorize.
+const int BUNDLE_GOLD = RESOURCE_COUNT;
+const int BUNDLE_LANES = RESOURCE_COUNT + 1;
+
+class ResourceBundle {
+    int lanes[BUNDLE_LANES];
+public:
+    ResourceBundle();
+    ResourceBundle& with(ResourceType type, int amount);
+    ResourceBundle& withGold(int amount);
+    ResourceBundle scaled(int factor) const;
+    int get(ResourceType type) const;
+    int getGold() const;
+    int lane(int index) const;
+    // stock points at RESOURCE_COUNT resources; econ may be null when the cost has no gold
+    bool coveredBy(const Resource<int>* stock, const Economy* econ) const;
+    void withdraw(Resource<int>* stock, Economy* econ) const;  // callers check coveredBy first
+    ActionStatus tryWithdraw(Resource<int>* stock, Economy* econ, ActionStatus shortfall = STATUS_INSUFFICIENT_RESOURCES) const;
+};
+
+// SharedTreasury class
+// Resources and gold several threads draw on at once without a lock. A withdrawal reserves each
+// lane with compare-and-swap and gives back what it took if a later lane falls short, so a cost
+// is paid in full or not at all and no lane ever goes negative. While a withdrawal is in flight
+// others may see its reservation and fail, as if it had gone through.
+class SharedTreasury {
+    std::atomic<int> lanes[BUNDLE_LANES];
+public:
+    explicit SharedTreasury(const ResourceBundle& initial = ResourceBundle());
+    SharedTreasury(const SharedTreasury&) = delete;
+    SharedTreasury& operator=(const SharedTreasury&) = delete;
+    ActionStatus tryWithdraw(const ResourceBundle& cost);
+    void deposit(const ResourceBundle& amount);
+    ResourceBundle getBalance() const;
+};
+
+// CowPtr class
+// Copy-on-write handle. Copies share one T; a non-const access first takes a private copy if the
+// T is still shared, while const access never copies. Null until assigned, like a smart pointer.
+template <typename T>
+class CowPtr {
+    std::shared_ptr<T> ptr;
+    void detach() {
+        if (ptr && ptr.use_count() > 1) ptr = std::make_shared<T>(*ptr);
+    }
+public:
+    CowPtr() {}
+    CowPtr(std::shared_ptr<T> shared) : ptr(std::move(shared)) {}
+    explicit CowPtr(T* raw) : ptr(raw) {}
+    const T* get() const { return ptr.get(); }
+    const T& operator*() const { return *ptr; }
+    const T* operator->() const { return ptr.get(); }
+    T& operator*() { detach(); return *ptr; }
+    T* operator->() { detach(); return ptr.get(); }
+    explicit operator bool() const { return static_cast<bool>(ptr); }
+    void reset(T* raw = nullptr) { ptr.reset(raw); }
+    bool isShared() const { return ptr.use_count() > 1; }
+};
+
+// MonotonicArena class
+// Hands out memory by bumping a pointer through large blocks and only frees it all at once, so
+// objects that live as long as their world cost no malloc each. Anything built in an arena must
+// be destroyed before the arena is, or before release() hands the memory out again.
+class MonotonicArena {
+    struct Block {
+        std::unique_ptr<char[]> memory;
+        size_t size;
+    };
+    std::vector<Block> blocks;
+    int current;       // block being carved up; -1 before the first allocation
+    char* cursor;
+    size_t remaining;
+    size_t blockSize;
+    size_t bytesUsed;
+    void nextBlock(size_t minimum);
+public:
+    explicit MonotonicArena(size_t blockSize = ARENA_BLOCK_SIZE);
+    MonotonicArena(const MonotonicArena&) = delete;
+    MonotonicArena& operator=(const MonotonicArena&) = delete;
+    void* allocate(size_t size, size_t alignment);
+    void release();    // reuse every block from the start; keeps them allocated
+    size_t getBytesUsed() const;
+    size_t getBlockCount() const;
+};
+
+// Standard allocator over a MonotonicArena; deallocation is a no-op
+template <typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+    MonotonicArena* arena;
+    explicit ArenaAllocator(MonotonicArena* arena) : arena(arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+    T* allocate(size_t count) { return static_cast<T*>(arena->allocate(count * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+};
+
+// make_shared, or allocate_shared into the arena when there is one (object and count share one block)
+template <typename T, typename... Args>
+std::shared_ptr<T> makeShared(MonotonicArena* arena, Args&&... args) {
+    if (!arena) return std::make_shared<T>(std::forward<Args>(args)...);
+    return std::allocate_shared<T>(ArenaAllocator<T>(arena), std::forward<Args>(args)...);
+}
+
+// AllocationCounter class
+// Build with -DSTRONGHOLD_COUNT_ALLOCS to replace the global operator new with one that counts
+// heap allocations, to check which paths allocate. Otherwise the count stays at zero.
+class AllocationCounter {
+public:
+    static bool isEnabled();
+    static uint64_t getCount();  // allocations so far, all threads
+};
+
+// Random class (PCG32; each stream id gives an independent sequence)
+class Random {
+    uint64_t state;
+    uint64_t increment;
+public:
+    Random(uint64_t seed = 0x853c49e6748fea9bULL, uint64_t stream = 0);
+    void seed(uint64_t seed, uint64_t stream);
+    uint32_t next();
+    int nextInt(int bound);
+    double nextDouble();
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in);
+};
+
 // General class
 class General {
     std::string name;
@@ -62,6 +450,8 @@ public:
     std::string getName() const;
     bool isCorrupted() const;
     void setCorrupted(bool val);
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in);
 };
 
 // King class
@@ -75,11 +465,13 @@ public:
     std::string getName() const;
     bool isCorrupted() const;
     void setCorrupted(bool val);
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in);
 };
 
 // Population class
 struct ResourcePair {
-    std::string name = "";
+    const char* name = "";
     int size = 0;
     double satisfaction = 0.0;
 };
@@ -90,11 +482,15 @@ class Population {
 public:
     Population();
     void adjustMorale(double delta);
+    void adjustClassSize(PopulationClass populationClass, int delta);
     void adjustClassSize(const std::string& className, int delta);
-    void handleClassConflict();
+    void handleClassConflict(Random& rng);
     int getTotalSize() const;
     double getMorale() const;
     ResourcePair* getClasses();
+    const ResourcePair* getClasses() const;
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in);
 };
 
 // Economy class
@@ -104,13 +500,17 @@ class Economy {
     int debtReliance;
 public:
     Economy(int initialGold);
+    bool canAfford(int amount) const;
+    ActionStatus trySpend(int amount);
     void spend(int amount);
     void collectTaxes(Population& pop);
-    void triggerMarketCrash(Population& pop);
+    void triggerMarketCrash(Population& pop, Random& rng);
     int getGold() const;
     bool isProgressiveTax() const;
     int getDebtReliance() const;
     void increaseDebtReliance(int amount);
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in);
 };
 
 // Blacksmith class
@@ -120,13 +520,19 @@ class Blacksmith {
     bool corrupted;
 public:
     Blacksmith();
+    ActionStatus tryUpgrade(Economy& econ);
     void upgrade(Economy& econ);
-    void produceWeapons(Resource<int>& iron, Resource<int>& wood, int count);
+    ActionStatus checkProduceWeapons(const Resource<int>* stock, int count) const;
+    ActionStatus tryProduceWeapons(Resource<int>* stock, int count);
+    void produceWeapons(Resource<int>* stock, int count);
+    ActionStatus tryUseWeapons(int count);
     void useWeapons(int count);
     int getWeaponsInStock() const;
     int getLevel() const;
     bool isCorrupted() const;
     void setCorrupted(bool val);
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in);
 };
 
 // Army class
@@ -135,10 +541,13 @@ class Army {
     double morale;
     int weapons;
     int trainingDelay;
-    std::unique_ptr<General> general;
+    General general;
 public:
     Army(int size, int weap);
-    void train(int count, Population& pop, Resource<int>& iron, Blacksmith& blacksmith, double efficiency);
+    ActionStatus checkTrain(int count, const Population& pop, const Resource<int>* stock, const Blacksmith& blacksmith) const;
+    ActionStatus tryTrain(int count, Population& pop, Resource<int>* stock, Blacksmith& blacksmith, double efficiency);
+    void train(int count, Population& pop, Resource<int>* stock, Blacksmith& blacksmith, double efficiency);
+    ActionStatus tryUseSpies(int count);
     void useSpies(int count);
     void checkMorale(Economy& econ);
     void applyTrainingDelay();
@@ -147,24 +556,30 @@ public:
     int getSize() const;
     int getWeapons() const;
     double getMorale() const;
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in);
 };
 
 // Politics class
 class Politics {
     std::string currentKing;
     int candidateCount;
-    std::unique_ptr<King> candidates[MAX_CANDIDATES];
+    King candidates[MAX_CANDIDATES];
     bool corrupted;
 public:
     Politics(const std::string& kingName);
-    void holdElection(Population& pop, Economy& econ);
+    void holdElection(Population& pop, Economy& econ, Random& rng);
     void bribe(Economy& econ, const std::string& candidate);
     void blackmail(Economy& econ, const std::string& candidate);
-    void triggerRebellion(Population& pop, Economy& econ);
-    std::unique_ptr<King>* getCandidates();
+    void triggerRebellion(Population& pop, Economy& econ, Random& rng);
+    ActionStatus tryBribe(Economy& econ, const std::string& candidate);
+    ActionStatus tryBlackmail(Economy& econ, const std::string& candidate);
+    King* getCandidates();
     int getCandidateCount() const;
     std::string getCurrentKing() const;
     void setCorrupted(bool val);
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in);
 };
 
 // Corruption class
@@ -174,8 +589,11 @@ class Corruption {
     bool blacksmithCorrupted;
 public:
     Corruption();
-    void checkCorruption();
+    void checkCorruption(Random& rng);
+    ActionStatus tryAudit(Economy& econ, Army& army, Politics& politics, Blacksmith& blacksmith);
     void audit(Economy& econ, Army& army, Politics& politics, Blacksmith& blacksmith);
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in);
 };
 
 // Bank class
@@ -187,36 +605,94 @@ class Bank {
 public:
     Bank();
     void takeLoan(Economy& econ, int amount);
+    ActionStatus tryRepayLoan(Economy& econ, int amount);
     void repayLoan(Economy& econ, int amount);
-    void checkCorruption();
+    void checkCorruption(Random& rng);
+    ActionStatus tryAudit(Economy& econ);
     void audit(Economy& econ);
-    void seizeLand(Economy& econ, Map& map);
+    void seizeLand(Economy& econ, Map& map, Random& rng);
     int getLoan() const;
     int getLandSeized() const;
     bool isCorrupted() const;
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in);
 };
 
 // Diplomacy class
-struct Alliance {
-    std::string kingdom = "";
-    bool active = false;
-    bool trade = false;
-    bool secureRoute = false;
+typedef uint16_t KingdomId;
+const KingdomId NO_KINGDOM = 0xffff;
+
+enum Relation : uint8_t {
+    RELATION_ALLIANCE,
+    RELATION_TRADE,
+    RELATION_SECURE_ROUTE,
+    RELATION_COUNT
+};
+
+// World-level diplomacy: one adjacency bitset row per kingdom and relation. Relations are
+// symmetric, so a row is also the column; membership tests are a bit lookup and counts a popcount.
+class DiplomacyGraph {
+    struct Row {
+        std::bitset<MAX_KINGDOMS> relation[RELATION_COUNT];
+    };
+    std::vector<std::string> names;
+    std::unordered_map<std::string, KingdomId> ids;
+    std::vector<Row> rows;
+public:
+    KingdomId addKingdom(const std::string& name);
+    KingdomId find(const std::string& name) const;
+    bool contains(KingdomId id) const;
+    const std::string& getName(KingdomId id) const;
+    int getKingdomCount() const;
+    void link(Relation relation, KingdomId a, KingdomId b);
+    void unlink(Relation relation, KingdomId a, KingdomId b);
+    void unlinkAll(KingdomId a, KingdomId b);
+    bool has(Relation relation, KingdomId a, KingdomId b) const;
+    const std::bitset<MAX_KINGDOMS>& neighbours(Relation relation, KingdomId id) const;
+    int degree(Relation relation, KingdomId id) const;
 };
 
+// One kingdom's view of the graph. A kingdom starts on a private graph; attach a shared one
+// so that relations are seen from both sides. Only a private graph learns kingdoms by name: the
+// world registers every kingdom on a shared one, so an unknown name there is rejected.
 class Diplomacy {
-    Alliance alliances[MAX_ALLIANCES];
-    int allianceCount;
+    std::shared_ptr<DiplomacyGraph> graph;
+    KingdomId self;
+    bool forked;      // graph is still the live one; copy it before the first change
+    bool standalone;  // graph is this kingdom's own rather than a world's
+    DiplomacyGraph& edit();
+    KingdomId resolve(const std::string& kingdom);
 public:
-    Diplomacy();
+    Diplomacy(const std::string& owner);
+    Diplomacy(const std::string& owner, const std::shared_ptr<DiplomacyGraph>& shared);
+    void attach(const std::shared_ptr<DiplomacyGraph>& shared);
+    void setOwner(const std::string& owner);
+    void fork();
     void formAlliance(const std::string& kingdom);
+    ActionStatus tryFormAlliance(KingdomId other);
+    void formAlliance(KingdomId other);
     void breakAlliance(const std::string& kingdom);
+    ActionStatus tryBreakAlliance(KingdomId other);
+    void breakAlliance(KingdomId other);
     void formTradeAgreement(const std::string& kingdom);
+    ActionStatus tryFormTradeAgreement(KingdomId other);
+    void formTradeAgreement(KingdomId other);
     void establishSecureRoute(const std::string& kingdom);
+    ActionStatus tryEstablishSecureRoute(KingdomId other);
+    void establishSecureRoute(KingdomId other);
     void handleEspionageFailure(const std::string& sourceKingdom);
+    void handleEspionageFailure(KingdomId source);
     bool hasAlliance(const std::string& kingdom) const;
+    bool hasAlliance(KingdomId other) const;
     bool hasSecureRoute(const std::string& kingdom) const;
+    bool hasSecureRoute(KingdomId other) const;
     int getAllianceCount() const;
+    const std::bitset<MAX_KINGDOMS>& getAllies() const;
+    DiplomacyGraph& getGraph();
+    const DiplomacyGraph& getGraph() const;
+    KingdomId getId() const;
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in);
 };
 
 // Communication class
@@ -226,14 +702,126 @@ struct Message {
     bool isFake = false;
 };
 
+// Ring buffer holding the newest messages for one recipient; a full mailbox drops its oldest message
+class Mailbox {
+    std::vector<Message> slots;
+    size_t start;
+    size_t count;
+    uint64_t dropped;
+public:
+    explicit Mailbox(size_t capacity = MAX_MESSAGES);
+    bool push(const Message& message);
+    const Message& at(size_t index) const;  // 0 is the oldest
+    size_t size() const;
+    size_t capacity() const;
+    uint64_t getDropped() const;
+    void setDropped(uint64_t count);
+};
+
+// Bounded lock-free queue (Vyukov): any number of threads may push, one thread pops.
+// Each cell's sequence number says whether it is free for the producer at that position
+// or ready for the consumer.
+template <typename T>
+class MpscQueue {
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    char padBefore[64];
+    std::atomic<size_t> tail;  // shared by producers
+    char padAfter[64];
+    size_t head;               // owned by the consumer
+public:
+    explicit MpscQueue(size_t minimumCapacity) : mask(0), tail(0), head(0) {
+        size_t capacity = 2;
+        while (capacity < minimumCapacity) capacity <<= 1;
+        mask = capacity - 1;
+        cells.reset(new Cell[capacity]);
+        for (size_t i = 0; i < capacity; ++i) cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    bool tryPush(const T& value) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (difference == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0) {
+                return false;  // full
+            }
+            else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool tryPop(T& value) {
+        Cell& cell = cells[head & mask];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        if (static_cast<intptr_t>(sequence) - static_cast<intptr_t>(head + 1) < 0) return false;  // empty
+        value = std::move(cell.value);
+        cell.sequence.store(head + mask + 1, std::memory_order_release);
+        ++head;
+        return true;
+    }
+
+    size_t capacity() const { return mask + 1; }
+};
+
+// Shared between kingdoms: one lock-free inbound queue per registered recipient. Register every
+// recipient before the office is used from several threads; after that post() never locks and
+// each recipient drains its own queue.
+class PostOffice {
+    size_t capacity;
+    std::vector<std::unique_ptr<MpscQueue<Message>>> inboxes;  // indexed by recipient id
+    std::vector<std::string> names;
+    std::unordered_map<std::string, KingdomId> ids;
+public:
+    explicit PostOffice(size_t capacity = POST_OFFICE_CAPACITY);
+    KingdomId registerRecipient(const std::string& name);
+    KingdomId find(const std::string& name) const;
+    bool knows(const std::string& name) const;
+    bool knows(KingdomId recipient) const;
+    const std::string& getName(KingdomId recipient) const;
+    bool post(const Message& message);
+    bool post(KingdomId recipient, const Message& message);
+    int collect(const std::string& recipient, Communication& into);
+    int collect(KingdomId recipient, Communication& into);
+};
+
 class Communication {
-    Message messages[MAX_MESSAGES];
-    int messageCount;
+    size_t capacity;
+    CowPtr<std::unordered_map<std::string, Mailbox>> mailboxes;  // keyed by recipient
+    PostOffice* postOffice;
+    bool isolated;  // the post office is only a directory: nothing is posted or collected
+    Mailbox& mailboxFor(const std::string& recipient);
+    void deliver(const Message& letter, KingdomId recipient);
 public:
-    Communication();
+    explicit Communication(size_t capacity = MAX_MESSAGES);
+    void attach(PostOffice* office);
+    void isolate();
     void sendMessage(const std::string& recipient, const std::string& message, bool isFake);
+    ActionStatus trySendMessage(KingdomId recipient, const std::string& message, bool isFake);
+    void sendMessage(KingdomId recipient, const std::string& message, bool isFake);
+    bool receive(const Message& message);
     void viewMessages(const std::string& kingdom);
     void sendFakeTradeRequest(const std::string& recipient);
+    ActionStatus trySendFakeTradeRequest(KingdomId recipient);
+    void sendFakeTradeRequest(KingdomId recipient);
+    const Mailbox* getMailbox(const std::string& recipient) const;
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in, uint32_t version = SAVE_FORMAT_VERSION);
 };
 
 // Healthcare class
@@ -244,11 +832,16 @@ class Healthcare {
     double plagueReduction;
 public:
     Healthcare();
-    void build(Economy& econ, Resource<int>& wood, Resource<int>& stone);
+    ActionStatus checkBuild(const Economy& econ, const Resource<int>* stock) const;
+    ActionStatus tryBuild(Economy& econ, Resource<int>* stock);
+    void build(Economy& econ, Resource<int>* stock);
     void provideServices(Population& pop);
-    void manageHealthcare(int choice, Economy& econ, Resource<int>& wood, Resource<int>& stone, Population& pop);
+    ActionStatus tryManageHealthcare(int choice, Economy& econ, Resource<int>* stock, Population& pop);
+    void manageHealthcare(int choice, Economy& econ, Resource<int>* stock, Population& pop);
     int getLevel() const;
     double getPlagueReduction() const;
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in);
 };
 
 // Buildings class
@@ -258,24 +851,61 @@ class Buildings {
     double trainingEfficiency;
 public:
     Buildings();
-    void buildBarracks(Economy& econ, Resource<int>& wood, Resource<int>& stone);
-    void manageBuildings(int choice, Economy& econ, Resource<int>& wood, Resource<int>& stone);
+    ActionStatus checkBuildBarracks(const Economy& econ, const Resource<int>* stock) const;
+    ActionStatus tryBuildBarracks(Economy& econ, Resource<int>* stock);
+    void buildBarracks(Economy& econ, Resource<int>* stock);
+    ActionStatus tryManageBuildings(int choice, Economy& econ, Resource<int>* stock);
+    void manageBuildings(int choice, Economy& econ, Resource<int>* stock);
     int getBarracksLevel() const;
     double getTrainingEfficiency() const;
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in);
 };
 
 // Weather class
+enum Season : uint8_t { SPRING = 0, SUMMER, AUTUMN, WINTER, SEASON_COUNT };
+enum WeatherState : uint8_t { CLEAR = 0, RAIN, SNOW, FLOOD, WEATHER_COUNT };
+
+constexpr const char* SEASON_NAMES[SEASON_COUNT] = { "Spring", "Summer", "Autumn", "Winter" };
+constexpr const char* WEATHER_NAMES[WEATHER_COUNT] = { "Clear", "Rain", "Snow", "Flood" };
+constexpr int WEATHER_FOOD_IMPACT[SEASON_COUNT][WEATHER_COUNT] = {
+    { 0, 150, 0, -200 },  // Spring rain boosts the harvest
+    { 0, 0, 0, -200 },
+    { 0, 0, 0, -200 },
+    { 0, 0, 0, -200 }
+};
+constexpr int WEATHER_DELAY_IMPACT[WEATHER_COUNT] = { 0, 0, 1, 0 };
+
+// Markov chain over weather states, one transition matrix per season.
+// Rows are stored as cumulative thresholds scaled to 2^32 so sampling is three compares.
+class WeatherModel {
+    // Cumulative cut points over the 2^32 samples; 2^32 itself lies above every sample
+    uint64_t thresholds[SEASON_COUNT][WEATHER_COUNT][WEATHER_COUNT - 1];
+public:
+    WeatherModel();
+    void setTransitions(Season season, WeatherState from, const double probabilities[WEATHER_COUNT]);
+    void setTransitions(Season season, const double matrix[WEATHER_COUNT][WEATHER_COUNT]);
+    WeatherState next(Season season, WeatherState from, uint32_t sample) const;
+    static const WeatherModel& standard();
+};
+
 class Weather {
-    std::string season;
-    std::string currentWeather;
+    const WeatherModel* model;
     int turnCount;
+    Season season;
+    WeatherState currentWeather;
 public:
-    Weather();
-    void updateWeather();
+    Weather(const WeatherModel* model = &WeatherModel::standard());
+    void updateWeather(Random& rng);
+    void setModel(const WeatherModel* newModel);
     int getFoodImpact() const;
     int getDelayImpact() const;
-    std::string getSeason() const;
-    std::string getWeather() const;
+    Season getSeasonId() const;
+    WeatherState getWeatherId() const;
+    const char* getSeason() const;
+    const char* getWeather() const;
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in);
 };
 
 // Inflation class
@@ -283,41 +913,270 @@ class Inflation {
     double rate;
 public:
     Inflation();
-    void update(Economy& econ, Bank& bank);
+    void update(Economy& econ, Bank& bank, const Market& market);
     double getRate() const;
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in);
 };
 
 // Map class
+typedef uint16_t OwnerId;
+const OwnerId UNOWNED = 0;
+
+// Tiles live in 64x64 chunks that are only allocated once something in them is owned, so
+// large worlds cost memory in proportion to claimed land. Owners are registered once and
+// referred to by id. Scoring reads the per-owner tile counts kept up to date by setOwner, and
+// compact() releases whatever emptied out since the last call. Copies share chunks across
+// kingdoms and threads, so const members never write to the map.
 class Map {
-    char grid[GRID_SIZE][GRID_SIZE];
+public:
+    // One bit per tile of a chunk: bit c of rows[r] is the tile at (r, c)
+    struct Bitboard {
+        uint64_t rows[CHUNK_SIZE] = {};
+    };
+private:
+    struct Chunk {
+        OwnerId tiles[CHUNK_SIZE * CHUNK_SIZE] = {};
+        std::vector<std::pair<OwnerId, Bitboard>> boards;  // one per owner present in the chunk
+        int owned = 0;
+        bool touched = false;  // listed in touchedChunks
+    };
+    // An owner's rows for one chunk plus the neighbouring tiles from the chunks around it
+    struct Neighbourhood {
+        uint64_t rows[CHUNK_SIZE + 2];  // rows[0] and rows[CHUNK_SIZE + 1] come from the chunks above and below
+        uint64_t left;                  // bit r: tile left of row r's first column
+        uint64_t right;                 // bit r: tile right of row r's last column
+    };
+    int rows;
+    int columns;
+    int chunkColumns;
+    std::vector<CowPtr<Chunk>> chunks;  // copies of a map share chunks until one side changes them
+    std::vector<std::string> ownerNames;  // indexed by OwnerId; 0 is unowned
+    std::vector<char> ownerSymbols;
+    std::vector<int64_t> ownerTiles;
+    std::vector<std::vector<int>> ownerChunks;  // by OwnerId: sorted chunks holding a board for that owner
+    std::unordered_map<std::string, OwnerId> ownerIds;
+    std::vector<int> touchedChunks;  // changed since the last compact()
+    int viewRow;
+    int viewColumn;
+    void reset(int mapRows, int mapColumns);
+    char pickSymbol(const std::string& name) const;
+    void markTouched(int chunk);
+    const Bitboard* board(int chunk, OwnerId owner) const;
+    Bitboard& boardFor(int chunk, OwnerId owner);
+    void dropBoard(int chunk, OwnerId owner);
+    void neighbourhood(int chunk, OwnerId owner, Neighbourhood& out) const;
+    void chunkMasks(int chunk, uint64_t& columnMask, int& rowCount) const;
+    const std::vector<int>& chunksWith(OwnerId owner) const;
+    int64_t countEdges(OwnerId owner, OwnerId other, bool border) const;
+    template <typename Visit>
+    void forEachCapturable(OwnerId attacker, Visit visit) const;
 public:
     Map();
+    Map(int rows, int columns);
+    OwnerId registerOwner(const std::string& name);
+    OwnerId findOwner(const std::string& name) const;
+    const std::string& getOwnerName(OwnerId owner) const;
+    char getOwnerSymbol(OwnerId owner) const;
+    int getOwnerCount() const;
+    OwnerId getOwner(int row, int column) const;
+    void setOwner(int row, int column, OwnerId owner);
+    int64_t getTileCount(OwnerId owner) const;
+    int getRows() const;
+    int getColumns() const;
+    int getChunkColumns() const;
+    int getChunkCount() const;
+    int getAllocatedChunks() const;
+    const OwnerId* chunkTiles(int chunk) const;  // nullptr while the chunk is unallocated
+    const Bitboard* chunkBoard(int chunk, OwnerId owner) const;
+    // Territory analytics on the per-owner bitboards
+    int64_t countTiles(OwnerId owner) const;
+    int64_t borderLength(OwnerId owner) const;
+    int64_t sharedBorder(OwnerId a, OwnerId b) const;
+    bool isAdjacent(OwnerId a, OwnerId b) const;
+    int countRegions(OwnerId owner) const;
+    bool isContiguous(OwnerId owner) const;
+    int64_t countCapturable(OwnerId attacker) const;
+    void capturableCells(OwnerId attacker, std::vector<std::pair<int, int>>& cells) const;
+    void compact();
+    void setViewport(int row, int column);
     void display() const;
-    void capture(const std::string& kingdom, int x, int y);
-    void enemyAttack(Resource<int>& resource);
+    void render(std::vector<std::string>& lines) const;
+    void capture(const std::string& kingdom, int row, int column);
+    void enemyAttack(Resource<int>& resource, Random& rng);
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in, uint32_t version = SAVE_FORMAT_VERSION);
+};
+
+// Exchange class
+enum OrderSide : uint8_t {
+    SIDE_BUY,
+    SIDE_SELL
+};
+
+typedef uint64_t OrderId;
+const OrderId NO_ORDER = 0;
+const size_t TRADE_LOG_SIZE = 256;
+const double EXCHANGE_PRICE_BAND = 2.0;  // traded prices move shop prices at most this factor off the inflation price
+
+struct Trade {
+    uint64_t sequence = 0;
+    ResourceType resource = FOOD;
+    int price = 0;
+    int quantity = 0;
+    int buyer = -1;
+    int seller = -1;
+};
+
+// Shared limit-order exchange: one price-time-priority book per resource, integer gold prices.
+// Placing an order escrows its gold (bids) or goods (asks) up front; fills and refunds are
+// credited to the trader's account and moved back into the kingdom by collect(). A trader never
+// trades with itself: an order that would cross its own resting order cancels that order instead.
+class Exchange {
+    struct Order {
+        OrderId id;
+        int trader;
+        int price;
+        int remaining;
+        int32_t prev;  // previous order at the same price level, -1 at the head
+        int32_t next;  // next order at the same price level, -1 at the tail
+        ResourceType resource;
+        OrderSide side;
+    };
+    struct Level {
+        int32_t head = -1;
+        int32_t tail = -1;
+        int64_t quantity = 0;
+    };
+    struct Book {
+        std::map<int, Level, std::greater<int>> bids;  // best (highest) first
+        std::map<int, Level> asks;                     // best (lowest) first
+        int lastPrice = 0;
+        int64_t volume = 0;
+        int64_t loggedValue = 0;     // gold and quantity of this resource's trades still in recentTrades
+        int64_t loggedQuantity = 0;
+    };
+    struct Account {
+        std::string name;
+        int64_t gold = 0;
+        int64_t resources[RESOURCE_COUNT] = {};
+    };
+    std::vector<Order> orders;
+    std::vector<int32_t> freeOrders;
+    std::unordered_map<OrderId, int32_t> resting;
+    Book books[RESOURCE_COUNT];
+    std::vector<Account> accounts;
+    std::unordered_map<std::string, int> traderIds;
+    std::deque<Trade> recentTrades;
+    OrderId nextOrderId;
+    uint64_t tradeCount;
+    int32_t allocateOrder();
+    void releaseOrder(int32_t index);
+    void recordTrade(ResourceType resource, int price, int quantity, int buyer, int seller);
+    template <typename Levels, typename Crosses>
+    int match(Levels& levels, Crosses crosses, int trader, OrderSide side, ResourceType resource, int limit, int quantity);
+public:
+    Exchange();
+    int registerTrader(const std::string& name);
+    int findTrader(const std::string& name) const;
+    ActionStatus tryPlaceOrder(int trader, OrderSide side, ResourceType resource, int price, int quantity,
+        Economy& econ, Resource<int>& stock, OrderId& id);
+    OrderId placeOrder(int trader, OrderSide side, ResourceType resource, int price, int quantity,
+        Economy& econ, Resource<int>& stock);
+    bool cancelOrder(int trader, OrderId id);
+    int collect(int trader, Economy& econ, Resource<int> stock[RESOURCE_COUNT]);
+    int getBestBid(ResourceType resource) const;
+    int getBestAsk(ResourceType resource) const;
+    int getLastPrice(ResourceType resource) const;
+    double getAveragePrice(ResourceType resource) const;  // volume-weighted over the trade log, 0 with no trades
+    int64_t getVolume(ResourceType resource) const;
+    int64_t getDepth(ResourceType resource, OrderSide side, int price) const;
+    int getOpenOrderCount() const;
+    int getOpenOrderCount(int trader) const;
+    uint64_t getTradeCount() const;
+    const std::deque<Trade>& getRecentTrades() const;
+};
+
+// PriceHistory class
+// Fixed-capacity ring of price samples with rolling statistics over the newest `window` samples.
+// Prices are kept as integer thousandths of a gold piece so the running sums stay exact; min and
+// max come from monotonic queues, so every statistic is O(1) per query and amortized O(1) per sample.
+class PriceHistory {
+    // Sequence numbers of the samples that can still become the window minimum or maximum, oldest first
+    struct Candidates {
+        size_t offset = 0;
+        size_t head = 0;
+        size_t count = 0;
+    };
+    // Sample ring (thousandths of a gold piece) followed by both candidate rings; allocated on first use
+    std::vector<int64_t> buffer;
+    size_t slots;
+    size_t window;
+    uint64_t recorded;             // total samples ever recorded
+    int64_t windowSum;
+    double windowSquares;
+    double returnSum;
+    double returnSquares;
+    Candidates minimums;           // values increasing
+    Candidates maximums;           // values decreasing
+    void allocate();
+    int64_t sample(uint64_t sequence) const;
+    double stepReturn(uint64_t sequence) const;
+    uint64_t front(const Candidates& queue) const;
+    void push(Candidates& queue, uint64_t sequence, bool lowest);
+    void expire(Candidates& queue, uint64_t oldest);
+    void rebuildSums();
+public:
+    explicit PriceHistory(size_t capacity = PRICE_HISTORY_CAPACITY, size_t window = PRICE_WINDOW);
+    void record(double price);
+    void clear();
+    size_t size() const;
+    size_t capacity() const;
+    size_t getWindow() const;
+    double at(size_t index) const;  // 0 is the oldest sample still held
+    double latest() const;
+    double movingAverage() const;
+    double standardDeviation() const;
+    double volatility() const;      // standard deviation of step returns in the window
+    double windowMin() const;
+    double windowMax() const;
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in);
 };
 
 // Market class
 struct Price {
-    std::string resource = "";
+    const char* resource = "";
     double value = 0.0;
 };
 
 class Market {
-    Inflation* inflation;
+    const Inflation* inflation;
+    const Exchange* exchange;
     bool boycott;
     bool sanctions;
     bool smugglerActive;
     bool guildDemands;
     Price prices[MAX_PRICES];
+    PriceHistory history[RESOURCE_COUNT];
 public:
-    Market(Inflation* inf);
-    void updatePrices();
+    Market(const Inflation* inf);
+    void updatePrices(Random& rng);
+    double getPrice(ResourceType resource) const;
     double getPrice(const std::string& resource) const;
-    void buyResource(Economy& econ, const std::string& resource, int amount, Resource<int>& res);
+    bool canAfford(const Economy& econ, ResourceType resource, int amount) const;
+    ActionStatus tryBuyResource(Economy& econ, ResourceType resource, int amount, Resource<int>& res);
+    void buyResource(Economy& econ, ResourceType resource, int amount, Resource<int>& res);
     void handleSmuggler(Economy& econ, Resource<int>& resource);
     void handleGuildDemands(Economy& econ, Population& pop);
     bool isSmugglerActive() const;
+    void attachExchange(const Exchange* shared);
+    void attachInflation(const Inflation* rate);
+    const Inflation* getInflation() const;
+    void recordPrices();
+    const PriceHistory& getHistory(ResourceType resource) const;
+    void serialize(BinaryWriter& out) const;
+    void deserialize(BinaryReader& in, uint32_t version = SAVE_FORMAT_VERSION);
 };
 
 // Espionage class
@@ -325,8 +1184,12 @@ class Espionage {
     std::string lastAction;
 public:
     Espionage();
+    static ActionStatus checkMission(int action, const Kingdom& source);  // 1 spy, 2 sabotage, 3 theft
+    ActionStatus trySpyMission(Kingdom& source, Kingdom& target);
     void spyMission(Kingdom& source, Kingdom& target);
+    ActionStatus trySabotageWeapons(Kingdom& source, Kingdom& target);
     void sabotageWeapons(Kingdom& source, Kingdom& target);
+    ActionStatus tryStealGold(Kingdom& source, Kingdom& target);
     void stealGold(Kingdom& source, Kingdom& target);
 };
 
@@ -335,58 +1198,114 @@ class Smuggling {
     std::string lastAction;
 public:
     Smuggling();
+    ActionStatus trySmuggleGoods(Kingdom& source, Kingdom& target);
     void smuggleGoods(Kingdom& source, Kingdom& target);
 };
 
 // Kingdom class
 class Kingdom {
     std::string name;
-    Resource<int> food, iron, wood, stone;
-    std::unique_ptr<Population> population;
-    std::unique_ptr<Economy> economy;
-    std::unique_ptr<Army> army;
-    std::unique_ptr<Bank> bank;
-    std::unique_ptr<Politics> politics;
-    std::unique_ptr<Blacksmith> blacksmith;
-    std::unique_ptr<Diplomacy> diplomacy;
-    std::unique_ptr<Communication> communication;
-    std::unique_ptr<Healthcare> healthcare;
-    std::unique_ptr<Buildings> buildings;
-    std::unique_ptr<Weather> weather;
-    std::unique_ptr<Inflation> inflation;
-    std::unique_ptr<Corruption> corruption;
-    std::unique_ptr<Map> map;
-    std::unique_ptr<Market> market;
-
-public:
-    Kingdom(const std::string& kingdomName, const std::string& kingName);
+    Resource<int> resources[RESOURCE_COUNT];
+    CowPtr<Population> population;
+    CowPtr<Economy> economy;
+    CowPtr<Army> army;
+    CowPtr<Bank> bank;
+    CowPtr<Politics> politics;
+    CowPtr<Blacksmith> blacksmith;
+    CowPtr<Diplomacy> diplomacy;
+    CowPtr<Communication> communication;
+    CowPtr<Healthcare> healthcare;
+    CowPtr<Buildings> buildings;
+    CowPtr<Weather> weather;
+    CowPtr<Inflation> inflation;
+    CowPtr<Corruption> corruption;
+    CowPtr<Map> map;
+    CowPtr<Market> market;
+    Random rng;
+    Exchange* exchange;
+    int traderId;
+    bool quiet;  // printStatus renders nothing; set on look-ahead copies, which worker threads share
+    // Copies share every subsystem copy-on-write; clone() is the public way to make one
+    Kingdom(const Kingdom& other) = default;
+    void bindMarket();
+
+public:
+    Kingdom(const std::string& kingdomName, const std::string& kingName, uint64_t seed = 1, uint64_t stream = 0);
+    // Builds the subsystems in the arena and joins the shared diplomacy graph directly; with names
+    // short enough for the small-string buffer this makes no heap allocations at all
+    Kingdom(const std::string& kingdomName, const std::string& kingName, uint64_t seed, uint64_t stream,
+        MonotonicArena* arena, const std::shared_ptr<DiplomacyGraph>& graph);
+    Kingdom(Kingdom&& other) = default;
+    Kingdom& operator=(Kingdom&& other) = default;
+    Kingdom clone() const;
     void playTurn();
+    // The phases of playTurn that draw no random numbers, in turn order; KingdomBatch mirrors these
+    void stepDeterministic();
     void randomEvent();
+    // The tryX actions report failure as a status and leave the kingdom as the throwing versions would
+    ActionStatus tryTrainArmy(int count);
     void trainArmy(int count);
     void holdElection();
+    ActionStatus tryManageLoanOrAudit(int choice, int amount);
     void manageLoanOrAudit(int choice, int amount);
+    ActionStatus tryBuyResource(ResourceType resource, int amount);
+    void buyResource(ResourceType resource, int amount);
     void buyResource(const std::string& resource, int amount);
     void manageDiplomacy(const std::string& kingdom, int choice);
+    ActionStatus tryManageDiplomacy(KingdomId kingdom, int choice);
+    void manageDiplomacy(KingdomId kingdom, int choice);
+    ActionStatus tryBribeOrBlackmail(int choice, const std::string& candidate);
     void bribeOrBlackmail(int choice, const std::string& candidate);
     void sendMessage(const std::string& recipient, const std::string& message);
+    ActionStatus trySendMessage(KingdomId recipient, const std::string& message);
+    void sendMessage(KingdomId recipient, const std::string& message);
     void sendFakeTradeRequest(const std::string& recipient);
+    ActionStatus trySendFakeTradeRequest(KingdomId recipient);
+    void sendFakeTradeRequest(KingdomId recipient);
     void viewMessages();
+    ActionStatus tryUpgradeBlacksmith();
     void upgradeBlacksmith();
+    ActionStatus tryProduceWeapons(int count);
     void produceWeapons(int count);
+    ActionStatus tryConductEspionage(int action, Kingdom& target);
     void conductEspionage(int action, Kingdom& target);
+    ActionStatus tryConductSmuggling(Kingdom& target);
     void conductSmuggling(Kingdom& target);
+    ActionStatus tryManageHealthcare(int choice);
     void manageHealthcare(int choice);
+    ActionStatus tryManageBuildings(int choice);
     void manageBuildings(int choice);
     void saveState(const std::string& filename) const;
     void loadState(const std::string& filename);
+    std::string snapshot() const;
+    void snapshot(std::string& out) const;
+    void restore(const char* data, size_t size);
+    static std::string snapshotName(const char* data, size_t size);
     void saveScore() const;
     int calculateScore() const;
+    bool isCollapsed() const;
+    void setQuiet(bool silent);
+    bool isQuiet() const;
     void printStatus() const;
+    void renderStatus(std::vector<std::string>& lines) const;
+    void attachPostOffice(PostOffice* office);
+    void attachDiplomacyGraph(const std::shared_ptr<DiplomacyGraph>& graph);
+    void attachExchange(Exchange* shared);
+    ActionStatus tryPlaceOrder(ResourceType resource, OrderSide side, int price, int quantity, OrderId* id = nullptr);
+    OrderId placeOrder(ResourceType resource, OrderSide side, int price, int quantity);
+    ActionStatus tryCancelOrder(OrderId id);
+    void cancelOrder(OrderId id);
+    void collectTrades();
 
     Bank& getBank();
     const Bank& getBank() const;
+    Resource<int>& getResource(ResourceType type);
+    const Resource<int>& getResource(ResourceType type) const;
     Resource<int>& getIron();
     const Resource<int>& getIron() const;
+    const Resource<int>& getFood() const;
+    const Resource<int>& getWood() const;
+    const Resource<int>& getStone() const;
     Economy& getEconomy();
     const Economy& getEconomy() const;
     Population& getPopulation();
@@ -399,9 +1318,39 @@ public:
     const Diplomacy& getDiplomacy() const;
     Weather& getWeather();
     const Weather& getWeather() const;
+    const Inflation& getInflation() const;
     Market& getMarket();
     const Market& getMarket() const;
+    Random& getRandom();
     std::string getName() const;
+    KingdomId getId() const;
+};
+
+// World class
+// Every kingdom in a game, stored contiguously and addressed by a stable KingdomId. The ids match
+// the kingdoms' ids in the shared diplomacy graph and post office, so names are resolved once,
+// through the hash index, where the player types them.
+class World {
+    uint64_t seed;
+    MonotonicArena arena;            // kingdom subsystems; declared first so it outlives them
+    std::vector<Kingdom> kingdoms;
+    std::unordered_map<std::string, KingdomId> ids;
+    std::unique_ptr<PostOffice> postOffice;
+    std::shared_ptr<DiplomacyGraph> diplomacyGraph;
+    std::unique_ptr<Exchange> exchange;
+public:
+    explicit World(uint64_t seed = 1);
+    void reserve(int count);
+    KingdomId addKingdom(const std::string& kingdomName, const std::string& kingName);
+    KingdomId find(const std::string& name) const;
+    bool contains(KingdomId id) const;
+    int getKingdomCount() const;
+    Kingdom& getKingdom(KingdomId id);
+    const Kingdom& getKingdom(KingdomId id) const;
+    PostOffice& getPostOffice();
+    DiplomacyGraph& getDiplomacyGraph();
+    Exchange& getExchange();
+    const MonotonicArena& getArena() const;
 };
 
 // Validation class
@@ -410,4 +1359,428 @@ public:
     static void validateKingdom(const Kingdom& kingdom);
 };
 
+// ConsoleSilencer class
+class ConsoleSilencer {
+    std::streambuf* saved;
+public:
+    ConsoleSilencer();
+    ~ConsoleSilencer();
+    ConsoleSilencer(const ConsoleSilencer&) = delete;
+    ConsoleSilencer& operator=(const ConsoleSilencer&) = delete;
+};
+
+// Simulation actions, numbered like the main menu
+enum ActionType {
+    ACTION_PLAY_TURN = 1,
+    ACTION_TRAIN_ARMY,
+    ACTION_HOLD_ELECTION,
+    ACTION_LOAN_OR_AUDIT,
+    ACTION_BUY_RESOURCE,
+    ACTION_DIPLOMACY,
+    ACTION_BRIBE_OR_BLACKMAIL,
+    ACTION_SEND_MESSAGE,
+    ACTION_FAKE_TRADE_REQUEST,
+    ACTION_VIEW_MESSAGES,
+    ACTION_UPGRADE_BLACKSMITH,
+    ACTION_PRODUCE_WEAPONS,
+    ACTION_ESPIONAGE,
+    ACTION_SMUGGLING,
+    ACTION_HEALTHCARE,
+    ACTION_BUILDINGS,
+    ACTION_TRADE = 20  // 17-19 are save/load/score, which are not simulated
+};
+
+struct Action {
+    ActionType type = ACTION_PLAY_TURN;
+    int choice = 0;         // sub-menu choice
+    int amount = 0;         // count or amount
+    int target = -1;        // index of the target kingdom
+    ResourceType resource = FOOD;
+    int price = 0;          // limit price for exchange orders
+    std::string text = "";  // candidate or message
+};
+
+// Simulation class
+class Simulation;
+using ActionPolicy = std::function<Action(Simulation&, int)>;
+
+class Simulation {
+    std::vector<Kingdom> kingdoms;
+    int turnCount;
+    long long actionCount;
+    long long failedActions;
+    bool quiet;
+    uint64_t seed;
+    InstantClock clock;
+    Random rng;
+    World world;
+    bool perform(int kingdom, const Action& action);
+public:
+    Simulation(int count, uint64_t seed = 1, bool quiet = true);
+    int addKingdom(const std::string& kingdomName, const std::string& kingName);
+    bool apply(int kingdom, const Action& action);
+    void step();
+    void run(int turns, const ActionPolicy& policy);
+    static bool needsTarget(ActionType type);
+    static ActionStatus tryExecute(Kingdom& current, Kingdom* target, const Action& action);
+    static void execute(Kingdom& current, Kingdom* target, const Action& action);  // throws when the action fails
+    static Action randomAction(Simulation& sim, int kingdom);
+    Kingdom& getKingdom(int index);
+    const Kingdom& getKingdom(int index) const;
+    int getKingdomCount() const;
+    int getTurnCount() const;
+    long long getActionCount() const;
+    long long getFailedActions() const;
+    double getSimulatedSeconds() const;
+    Random& getRandom();
+    Exchange& getExchange();
+    World& getWorld();
+};
+
+// ThreadPool class (work-stealing: each worker owns a deque and steals from the others when idle)
+class ThreadPool {
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<std::thread> threads;
+    std::mutex waitMutex;
+    std::condition_variable taskAvailable;
+    std::condition_variable allDone;
+    std::atomic<int> queued;
+    std::atomic<int> pending;
+    std::atomic<unsigned> nextQueue;
+    bool stopping;
+    std::exception_ptr failure;
+    bool popTask(int index, std::function<void()>& task);
+    void workerLoop(int index);
+public:
+    explicit ThreadPool(int threadCount = 0);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    void submit(std::function<void()> task);
+    void wait();
+    int getThreadCount() const;
+};
+
+// Monte Carlo runner
+struct GameResult {
+    int scores[2] = { 0, 0 };
+    int survivalTurns[2] = { 0, 0 };
+    int winner = -1;  // seat index, -1 for a draw
+};
+
+class MonteCarloStats {
+    long long games;
+    long long wins[2];
+    long long draws;
+    double scoreMean[2];
+    double scoreM2[2];
+    int scoreMin[2];
+    int scoreMax[2];
+    double survivalMean[2];
+public:
+    MonteCarloStats();
+    void add(const GameResult& result);
+    void merge(const MonteCarloStats& other);
+    long long getGames() const;
+    long long getDraws() const;
+    double getWinRate(int seat) const;
+    double getDrawRate() const;
+    double getScoreMean(int seat) const;
+    double getScoreStdDev(int seat) const;
+    int getScoreMin(int seat) const;
+    int getScoreMax(int seat) const;
+    double getSurvivalMean(int seat) const;
+};
+
+class MonteCarloRunner {
+    int maxTurns;
+    uint64_t seed;
+    int threadCount;
+    int gamesPerTask;
+    ActionPolicy policy;
+public:
+    MonteCarloRunner(int maxTurns = 100, uint64_t seed = 1, int threadCount = 0);
+    void setPolicy(const ActionPolicy& newPolicy);
+    GameResult playGame(long long gameIndex) const;
+    MonteCarloStats run(long long games);
+};
+
+// MctsPlayer class
+// Computer seat driven by open-loop Monte Carlo Tree Search over its own menu actions. Rivals move
+// at random between plies and the dice are reseeded every iteration, so a node's value averages
+// over what the world might do. Each worker grows a private tree from clones of the world (root
+// parallelism) and the root visits are summed when the time budget runs out. After a move, the
+// chosen child becomes each tree's new root, so the next search starts from what this one learned.
+const int MCTS_BUDGET_MS = 200;
+const int MCTS_HORIZON = 8;            // plies simulated ahead of the real state
+const int MCTS_MAX_ACTIONS = 32;
+const int MCTS_MAX_NODES = 1 << 20;    // per worker tree; search stops expanding beyond this
+const double MCTS_EXPLORATION = 1.4;
+const double MCTS_SCORE_SCALE = 1000.0;  // score lead that counts as a clear advantage
+const int MCTS_PLAY_TURN = 0;          // index of Play Turn in the candidate actions
+
+class MctsPlayer {
+    struct Node {
+        int visits;
+        double reward;
+        int children[MCTS_MAX_ACTIONS];  // -1 until expanded
+        Node();
+    };
+    struct Tree {
+        std::vector<Node> nodes;  // nodes[0] is the root
+        Random rng;
+        long long iterations;
+    };
+    int budgetMs;
+    ThreadPool pool;
+    std::vector<Tree> trees;
+    std::vector<Action> actions;  // candidates for the current target
+    int lastChoice;
+    KingdomId lastSelf;
+    KingdomId lastTarget;
+    long long lastIterations;
+    void buildActions();
+    void search(Tree& tree, const std::vector<Kingdom>& root, KingdomId self, KingdomId target,
+        std::chrono::steady_clock::time_point deadline) const;
+    void play(std::vector<Kingdom>& state, KingdomId self, KingdomId target, int choice, Random& rng) const;
+    static double netScore(const Kingdom& kingdom);
+    static double evaluate(const std::vector<Kingdom>& state, KingdomId self);
+    static void reroot(Tree& tree, int child);
+public:
+    MctsPlayer(int budgetMs = MCTS_BUDGET_MS, int threadCount = 0, uint64_t seed = 1);
+    Action chooseAction(World& world, KingdomId self);
+    static KingdomId pickTarget(const World& world, KingdomId self);
+    static std::string describe(const Action& action);
+    long long getLastIterations() const;
+    int getThreadCount() const;
+};
+
+// KingdomBatch class (structure-of-arrays copy of the deterministic turn state)
+class KingdomBatch {
+    std::vector<int> gold;
+    std::vector<int> food;
+    std::vector<int> iron;
+    std::vector<int> wood;
+    std::vector<int> stone;
+    std::vector<int> peasants;
+    std::vector<int> merchants;
+    std::vector<int> nobility;
+    std::vector<int> military;
+    std::vector<int> soldiers;
+    std::vector<int> loan;
+    std::vector<int> debtReliance;
+    std::vector<int> progressiveTax;
+    std::vector<int> foodImpact;
+    std::vector<double> morale;
+    std::vector<double> armyMorale;
+    std::vector<double> inflationRate;
+    std::vector<double> foodAverage;  // rolling food price once the history window is full, else 0
+    int push(int gold, const int stock[RESOURCE_COUNT], const int classSizes[MAX_CLASSES], int soldiers,
+        int loan, int debtReliance, bool progressiveTax, int foodImpact, double morale, double armyMorale, double inflationRate,
+        double foodAverage);
+public:
+    void reserve(int count);
+    int add(const Kingdom& kingdom);
+    int addDefault();
+    int size() const;
+    void setFoodImpact(int index, int impact);
+    void applyWeatherFood();
+    void collectTaxes();
+    void checkArmyUpkeep();
+    void updateInflation();
+    void clampMorale();
+    void stepDeterministic();
+    int getGold(int index) const;
+    int getFood(int index) const;
+    int getPopulation(int index) const;
+    int getSoldiers(int index) const;
+    double getMorale(int index) const;
+    double getArmyMorale(int index) const;
+    double getInflationRate(int index) const;
+};
+
+// MappedFile class (read/write memory mapping that can grow)
+class MappedFile {
+    char* base;
+    size_t length;
+#ifdef _WIN32
+    void* fileHandle;
+    void* mappingHandle;
+#else
+    int fd;
+#endif
+    void map();
+    void unmap();
+public:
+    MappedFile();
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    // Creates the file if needed and grows an empty one to minimumSize; returns whether it was empty.
+    // A non-empty file shorter than minimumSize is rejected rather than padded.
+    bool open(const std::string& path, size_t minimumSize);
+    void resize(size_t newSize);
+    void flush();
+    void close();
+    char* data();
+    const char* data() const;
+    size_t size() const;
+    bool isOpen() const;
+};
+
+// SnapshotStore class (memory-mapped file of Kingdom snapshots keyed by name, game id and turn)
+// Points straight into the mapping: the next put may grow and remap the file, which invalidates
+// every view taken before it. Copy the bytes out first if they must outlive a put.
+struct SnapshotView {
+    const char* data = nullptr;
+    size_t size = 0;
+};
+
+class SnapshotStore {
+    struct StoreHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t indexCapacity;
+        uint32_t count;
+        uint64_t indexOffset;
+        uint64_t dataEnd;
+    };
+    struct IndexEntry {
+        uint64_t nameHash;
+        uint64_t gameId;
+        uint64_t offset;
+        uint32_t size;  // 0 marks an empty slot
+        int32_t turn;
+    };
+    MappedFile file;
+    StoreHeader* header();
+    const StoreHeader* header() const;
+    IndexEntry* entries();
+    const IndexEntry* entries() const;
+    size_t findSlot(const std::string& name, uint64_t nameHash, uint64_t gameId, int turn) const;
+    uint64_t allocate(size_t size, size_t alignment);
+    void rehash(uint32_t newCapacity);
+    bool isValid() const;
+public:
+    explicit SnapshotStore(const std::string& path, uint32_t indexCapacity = 1024);
+    void put(const Kingdom& kingdom, uint64_t gameId, int turn);
+    void put(const std::string& name, uint64_t gameId, int turn, const char* data, size_t size);
+    SnapshotView find(const std::string& name, uint64_t gameId, int turn) const;  // valid until the next put
+    bool load(Kingdom& kingdom, uint64_t gameId, int turn) const;
+    uint32_t getCount() const;
+    void flush();
+};
+
+// Leaderboard class (append-only scores.dat plus in-memory order-statistic indexes)
+struct ScoreRecord {
+    int64_t timestamp = 0;
+    int32_t score = 0;
+    int32_t gold = 0;
+    int32_t army = 0;
+    double morale = 0.0;
+    std::string kingdom = "";
+};
+
+class Leaderboard {
+    // Treap ordered by score (highest first), ties broken by insertion order
+    struct Node {
+        uint32_t record;
+        uint32_t priority;
+        int left;
+        int right;
+        int size;
+    };
+    std::vector<ScoreRecord> records;
+    std::vector<Node> nodes;
+    int root;
+    std::unordered_map<std::string, uint32_t> bestByKingdom;
+    std::vector<uint32_t> byTime;          // record indices sorted by timestamp
+    mutable std::vector<uint32_t> maxTree; // segment tree over byTime holding the best position per range
+    mutable size_t maxTreeLeaves;
+    mutable bool maxTreeDirty;
+    Random rng;
+    bool before(uint32_t a, uint32_t b) const;
+    int nodeSize(int node) const;
+    void update(int node);
+    void split(int node, uint32_t record, int& left, int& right);
+    int merge(int left, int right);
+    int countHigher(int32_t score) const;
+    bool betterPosition(uint32_t a, uint32_t b) const;
+    void setMaxTreeLeaf(size_t position) const;
+    void rebuildMaxTree() const;
+    uint32_t bestInRange(size_t from, size_t to) const;
+public:
+    Leaderboard();
+    void add(const ScoreRecord& record);
+    std::vector<ScoreRecord> top(int k) const;
+    int rankOf(const std::string& kingdom) const;
+    int countInWindow(int64_t from, int64_t to) const;
+    std::vector<ScoreRecord> topInWindow(int64_t from, int64_t to, int k) const;
+    int size() const;
+    void load(const std::string& path);
+    void save(const std::string& path) const;
+    int importScoreText(const std::string& path);
+    static void append(const std::string& path, const ScoreRecord& record);
+};
+
+// ScreenRenderer class
+// Keeps the status frame pinned to the top rows of the terminal and redraws only the lines that
+// changed since the previous frame; everything else scrolls in the region below it.
+class ScreenRenderer {
+    std::vector<std::string> previous;
+    int rows;
+    int columns;
+    bool interactive;
+    bool pinned;
+    void querySize();
+    static void writeOut(const std::string& text);
+public:
+    static const int MIN_LOG_ROWS = 8;
+    ScreenRenderer();
+    ~ScreenRenderer();
+    ScreenRenderer(const ScreenRenderer&) = delete;
+    ScreenRenderer& operator=(const ScreenRenderer&) = delete;
+    void present(const std::vector<std::string>& frame);
+    void invalidate();
+    void appendColumns(std::vector<std::string>& frame, const std::vector<std::string>& left,
+        const std::vector<std::string>& right) const;
+    static size_t visibleWidth(const std::string& line);
+};
+
+// Benchmark class
+const double BENCH_REGRESSION_THRESHOLD = 0.10;  // flag anything more than 10% slower than baseline
+
+struct BenchmarkResult {
+    std::string name = "";
+    double nanosecondsPerOp = 0.0;
+    long long iterations = 0;
+};
+
+class Benchmark {
+    struct Case {
+        std::string name;
+        std::function<void()> op;
+        std::function<void()> teardown;
+    };
+    std::vector<Case> cases;
+    double sampleSeconds;
+    int samples;
+public:
+    Benchmark(double sampleSeconds = 0.1, int samples = 9);
+    void add(const std::string& name, const std::function<void()>& op,
+        const std::function<void()>& teardown = std::function<void()>());
+    // Runs with the console silenced and delays on an InstantClock; reports the fastest sample
+    std::vector<BenchmarkResult> run(std::ostream& out);
+    static Benchmark standard();
+    static std::vector<BenchmarkResult> loadBaseline(const std::string& path);
+    static void saveBaseline(const std::string& path, const std::vector<BenchmarkResult>& results);
+    // Prints current against baseline and returns the number of regressions beyond threshold
+    static int compare(const std::vector<BenchmarkResult>& current, const std::vector<BenchmarkResult>& baseline,
+        double threshold, std::ostream& out);
+};
+
 #endif
\ No newline at end of file
@@ -1,7 +1,15 @@
 #include "stronghold.h"
 #include <iostream>
 #include <cstdlib>
+#include <cstdio>
+#include <cmath>
 #include <ctime>
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include <map>
+#include <atomic>
+#include <thread>
 
 void clearInputBuffer() {
     std::cin.clear();
@@ -42,41 +50,641 @@ void displayMenu() {
     std::cout << "17. Save Game State\n";
     std::cout << "18. Load Game State\n";
     std::cout << "19. Save Score\n";
-    std::cout << "20. Exit\n";
+    std::cout << "20. Trade on Exchange\n";
+    std::cout << "21. Exit\n";
 }
 
-int main() {
-    srand(static_cast<unsigned>(time(nullptr)));
+// Asks for a rival kingdom by name until the name is one in the world; with a single rival there is nothing to ask
+KingdomId chooseTarget(const World& world, KingdomId self, const std::string& prompt) {
+    if (world.getKingdomCount() == 2) return self == 0 ? 1 : 0;
+    while (true) {
+        std::string name = getValidString(prompt);
+        KingdomId target = world.find(name);
+        if (target != NO_KINGDOM && target != self) return target;
+        std::cout << RED << "No rival kingdom named " << name << ". Kingdoms:";
+        for (KingdomId id = 0; id < world.getKingdomCount(); ++id) {
+            if (id != self) std::cout << " " << world.getKingdom(id).getName();
+        }
+        std::cout << "\n" << RESET;
+    }
+}
+
+int runSimulation(int kingdomCount, int turns, uint64_t seed) {
+    Simulation sim(kingdomCount, seed);
+    auto start = std::chrono::steady_clock::now();
+    sim.run(turns, Simulation::randomAction);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << GREEN << "Simulated " << turns << " turns for " << kingdomCount << " kingdoms in "
+        << seconds << "s (" << sim.getActionCount() << " actions, " << sim.getFailedActions() << " failed, "
+        << sim.getSimulatedSeconds() << "s of simulated delays).\n" << RESET;
+    for (int i = 0; i < sim.getKingdomCount(); ++i) {
+        std::cout << sim.getKingdom(i).getName() << ": Score " << sim.getKingdom(i).calculateScore() << "\n";
+    }
+    return 0;
+}
+
+int runMonteCarlo(long long games, int turns, uint64_t seed, int threads) {
+    MonteCarloRunner runner(turns, seed, threads);
+    auto start = std::chrono::steady_clock::now();
+    MonteCarloStats stats = runner.run(games);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << GREEN << "Played " << stats.getGames() << " games of up to " << turns << " turns in " << seconds << "s.\n" << RESET;
+    for (int seat = 0; seat < 2; ++seat) {
+        std::cout << "Seat " << seat + 1 << ": Win rate " << stats.getWinRate(seat) * 100 << "%, Score "
+            << stats.getScoreMean(seat) << " +/- " << stats.getScoreStdDev(seat)
+            << " [" << stats.getScoreMin(seat) << ", " << stats.getScoreMax(seat) << "]"
+            << ", Survival " << stats.getSurvivalMean(seat) << " turns\n";
+    }
+    std::cout << "Draws: " << stats.getDrawRate() * 100 << "%\n";
+    return 0;
+}
+
+int runLeaderboard(int k) {
+    Leaderboard board;
+    board.load("scores.dat");
+    std::vector<ScoreRecord> best = board.top(k);
+    std::cout << BOLD << "Leaderboard (" << board.size() << " scores)\n" << RESET;
+    for (size_t i = 0; i < best.size(); ++i) {
+        std::cout << i + 1 << ". " << best[i].kingdom << " - Score: " << best[i].score << ", Gold: " << best[i].gold
+            << ", Army: " << best[i].army << ", Morale: " << best[i].morale << "\n";
+    }
+    return 0;
+}
+
+int importScores(const std::string& path) {
+    Leaderboard board;
+    board.load("scores.dat");
+    int imported = board.importScoreText(path);
+    board.save("scores.dat");
+    std::cout << GREEN << "Imported " << imported << " scores from " << path << " into scores.dat.\n" << RESET;
+    return 0;
+}
+
+int runBenchmarks(const std::string& baselinePath, bool update, double threshold) {
+    std::cout << BOLD << "Running benchmarks...\n" << RESET;
+    std::vector<BenchmarkResult> results = Benchmark::standard().run(std::cout);
+    std::vector<BenchmarkResult> baseline = Benchmark::loadBaseline(baselinePath);
+    int regressions = Benchmark::compare(results, baseline, threshold, std::cout);
+    if (update || baseline.empty()) {
+        Benchmark::saveBaseline(baselinePath, results);
+        std::cout << GREEN << "Baseline written to " << baselinePath << ".\n" << RESET;
+        return 0;
+    }
+    if (regressions > 0) {
+        std::cout << RED << regressions << " benchmark(s) regressed by more than "
+            << threshold * 100 << "%.\n" << RESET;
+        return 1;
+    }
+    return 0;
+}
+
+// Steps kingdoms through the deterministic turn phases both as a KingdomBatch and as live objects
+bool checkKingdomBatch(int kingdoms, int steps) {
+    InstantClock clock;
+    ClockScope clockScope(clock);
+    std::vector<Kingdom> live;
+    live.reserve(kingdoms);
+    {
+        // A few full turns spread the kingdoms across taxes, loans, weather and morale
+        ConsoleSilencer silencer;
+        for (int i = 0; i < kingdoms; ++i) {
+            live.emplace_back("Kingdom " + std::to_string(i + 1), "King", 100 + i, i + 1);
+            for (int turn = 0; turn < i % 32 && !live.back().isCollapsed(); ++turn) {
+                try {
+                    live.back().playTurn();
+                }
+                catch (const std::exception&) {
+                    break;
+                }
+            }
+        }
+    }
+    KingdomBatch batch;
+    batch.reserve(kingdoms);
+    for (const Kingdom& kingdom : live) batch.add(kingdom);
+
+    int mismatches = 0;
+    for (int step = 0; step < steps; ++step) {
+        batch.stepDeterministic();
+        for (int i = 0; i < kingdoms; ++i) {
+            Kingdom& kingdom = live[i];
+            {
+                ConsoleSilencer silencer;
+                kingdom.stepDeterministic();
+            }
+            if (batch.getGold(i) != kingdom.getEconomy().getGold() || batch.getFood(i) != kingdom.getResource(FOOD).get() ||
+                batch.getPopulation(i) != kingdom.getPopulation().getTotalSize() ||
+                batch.getSoldiers(i) != kingdom.getArmy().getSize() ||
+                batch.getMorale(i) != kingdom.getPopulation().getMorale() ||
+                batch.getArmyMorale(i) != kingdom.getArmy().getMorale() ||
+                batch.getInflationRate(i) != kingdom.getInflation().getRate()) {
+                if (mismatches++ < 5) {
+                    std::cout << YELLOW << "  " << kingdom.getName() << " differs after step " << step + 1 << "\n" << RESET;
+                }
+            }
+        }
+    }
+    return mismatches == 0;
+}
+
+// Eight threads withdraw from one SharedTreasury until the gold runs out; nothing may be lost or spent twice
+bool checkSharedTreasury() {
+    const int threadCount = 8;
+    const int attempts = 20000;
+    ResourceBundle start = ResourceBundle().withGold(500000).with(WOOD, 123457).with(STONE, 100000).with(IRON, 7);
+    ResourceBundle cost = ResourceBundle().withGold(500).with(WOOD, 100).with(STONE, 100);
+    // A negative withdrawal is a deposit, so one thread also trades 3 iron in for 1 wood out
+    ResourceBundle trade = ResourceBundle().with(IRON, -3).with(WOOD, 1);
+    SharedTreasury treasury(start);
+    std::atomic<long long> withdrawals(0), trades(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; ++t) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < attempts; ++i) {
+                if (treasury.tryWithdraw(cost) == STATUS_OK) ++withdrawals;
+                if (t == 0 && i % 10 == 0 && treasury.tryWithdraw(trade) == STATUS_OK) ++trades;
+            }
+        });
+    }
+    for (std::thread& thread : threads) thread.join();
+
+    ResourceBundle balance = treasury.getBalance();
+    long long spent = withdrawals.load(), traded = trades.load();
+    return balance.getGold() == start.getGold() - 500 * spent && balance.get(WOOD) == start.get(WOOD) - 100 * spent - traded &&
+        balance.get(STONE) == start.get(STONE) - 100 * spent && balance.get(IRON) == start.get(IRON) + 3 * traded &&
+        balance.getGold() >= 0 && balance.getGold() < cost.getGold();
+}
+
+// Four threads post numbered messages into one small MpscQueue while this thread drains it; every
+// message must arrive exactly once and each producer's messages in the order they were posted
+bool checkMpscQueue() {
+    const int producerCount = 4;
+    const int messages = 20000;
+    MpscQueue<Message> queue(64);
+    std::vector<std::thread> producers;
+    for (int p = 0; p < producerCount; ++p) {
+        producers.emplace_back([&queue, p]() {
+            Message message;
+            message.recipient = std::to_string(p);
+            for (int i = 0; i < messages; ++i) {
+                message.content = std::to_string(i);
+                while (!queue.tryPush(message)) std::this_thread::yield();  // full: wait for the consumer
+            }
+        });
+    }
+
+    std::vector<int> expected(producerCount, 0);
+    bool ordered = true;
+    Message message;
+    for (int received = 0; received < producerCount * messages;) {
+        if (!queue.tryPop(message)) {
+            std::this_thread::yield();
+            continue;
+        }
+        int producer = std::stoi(message.recipient);
+        if (producer < 0 || producer >= producerCount || std::stoi(message.content) != expected[producer]) ordered = false;
+        else expected[producer]++;
+        received++;
+    }
+    for (std::thread& producer : producers) producer.join();
+
+    bool drained = !queue.tryPop(message);
+    for (int count : expected) ordered = ordered && count == messages;
+    return ordered && drained;
+}
+
+// Random orders and cancels from four kingdoms; once everything is cancelled and collected no gold or
+// food may have appeared or vanished, and no kingdom may have filled against its own order
+bool checkExchange() {
+    InstantClock clock;
+    ClockScope clockScope(clock);
+    ConsoleSilencer silencer;
+    World world(3);
+    const int traders = 4;
+    for (int i = 0; i < traders; ++i) {
+        world.addKingdom("Trader " + std::to_string(i + 1), "King");
+        world.getKingdom(i).getEconomy().spend(-100000);
+        world.getKingdom(i).getResource(FOOD).adjust(100000);
+    }
+    auto totals = [&world, traders](int64_t& gold, int64_t& food) {
+        gold = food = 0;
+        for (int i = 0; i < traders; ++i) {
+            gold += world.getKingdom(i).getEconomy().getGold();
+            food += world.getKingdom(i).getResource(FOOD).get();
+        }
+    };
+    int64_t startGold, startFood;
+    totals(startGold, startFood);
+
+    Random flow(9, 1);
+    std::vector<std::pair<KingdomId, OrderId>> open;
+    bool selfTraded = false;
+    for (int step = 0; step < 20000; ++step) {
+        if (flow.nextInt(3) == 0 && !open.empty()) {
+            size_t at = static_cast<size_t>(flow.nextInt(static_cast<int>(open.size())));
+            world.getKingdom(open[at].first).tryCancelOrder(open[at].second);
+            open[at] = open.back();
+            open.pop_back();
+            continue;
+        }
+        KingdomId trader = flow.nextInt(traders);
+        OrderId id = NO_ORDER;
+        OrderSide side = flow.nextInt(2) ? SIDE_BUY : SIDE_SELL;
+        if (world.getKingdom(trader).tryPlaceOrder(FOOD, side, 8 + flow.nextInt(5), 1 + flow.nextInt(20), &id) == STATUS_OK)
+            open.emplace_back(trader, id);
+        for (const Trade& trade : world.getExchange().getRecentTrades()) selfTraded |= trade.buyer == trade.seller;
+    }
+    for (const auto& order : open) world.getKingdom(order.first).tryCancelOrder(order.second);
+    // On the emptied book, crossing its own one-unit order at price 1 must not print a trade (and so
+    // cannot drag prices down); the resting sell is cancelled and the buy rests until cancelled here
+    uint64_t trades = world.getExchange().getTradeCount();
+    OrderId id = NO_ORDER;
+    world.getKingdom(0).tryPlaceOrder(FOOD, SIDE_SELL, 1, 1);
+    world.getKingdom(0).tryPlaceOrder(FOOD, SIDE_BUY, 1, 1, &id);
+    world.getKingdom(0).tryCancelOrder(id);
+    bool crossedSelf = world.getExchange().getTradeCount() != trades;
+    for (int i = 0; i < traders; ++i) world.getKingdom(i).collectTrades();
+    int64_t endGold, endFood;
+    totals(endGold, endFood);
+    return trades > 0 && !selfTraded && !crossedSelf && world.getExchange().getOpenOrderCount() == 0 &&
+        endGold == startGold && endFood == startFood;
+}
+
+// Snapshots of three kingdoms over 40 turns go into a small store (forcing rehashes), some are
+// replaced, and after reopening the file every one must read back and restore byte for byte
+bool checkSnapshotStore() {
+    const std::string path = "selfcheck_snapshots.dat";
+    InstantClock clock;
+    ClockScope clockScope(clock);
+    std::map<std::pair<std::string, int>, std::string> expected;
+    std::remove(path.c_str());
+    bool consistent = true;
+    {
+        ConsoleSilencer silencer;
+        SnapshotStore store(path, 16);
+        for (int k = 0; k < 3; ++k) {
+            Kingdom kingdom("Archive " + std::to_string(k + 1), "King", 20 + k, k + 1);
+            for (int turn = 0; turn < 40 && !kingdom.isCollapsed(); ++turn) {
+                try {
+                    kingdom.playTurn();
+                }
+                catch (const std::exception&) {
+                    break;
+                }
+                store.put(kingdom, 9, turn);
+                expected[std::make_pair(kingdom.getName(), turn)] = kingdom.snapshot();
+            }
+        }
+        // Replacing existing keys, here straight from the store's own views, must not add entries
+        uint32_t count = store.getCount();
+        for (const auto& entry : expected) {
+            if (entry.first.second % 5 != 0) continue;
+            SnapshotView view = store.find(entry.first.first, 9, entry.first.second);
+            if (view.data) store.put(entry.first.first, 9, entry.first.second, view.data, view.size);
+        }
+        consistent = store.getCount() == count && count == expected.size();
+        store.flush();
+    }
+    {
+        SnapshotStore store(path);
+        consistent &= store.getCount() == expected.size() && !store.find("Archive 1", 9, 1000).data;
+        for (const auto& entry : expected) {
+            SnapshotView view = store.find(entry.first.first, 9, entry.first.second);
+            consistent &= view.data && std::string(view.data, view.size) == entry.second;
+            Kingdom restored(entry.first.first, "King");
+            consistent &= store.load(restored, 9, entry.first.second) && restored.snapshot() == entry.second;
+        }
+    }
+    std::remove(path.c_str());
+    return consistent;
+}
+
+// Scans every tile of the map the slow way and compares the bitboard territory analytics against it
+bool matchesBruteForce(const Map& map, const std::vector<OwnerId>& owners) {
+    const int rows = map.getRows(), columns = map.getColumns();
+    const int dr[4] = { -1, 1, 0, 0 }, dc[4] = { 0, 0, -1, 1 };
+    for (OwnerId owner : owners) {
+        int64_t tiles = 0, border = 0;
+        std::map<OwnerId, int64_t> shared;
+        std::vector<std::pair<int, int>> capturable;
+        for (int r = 0; r < rows; ++r) {
+            for (int c = 0; c < columns; ++c) {
+                bool mine = map.getOwner(r, c) == owner;
+                bool touching = false;
+                for (int d = 0; d < 4; ++d) {
+                    int nr = r + dr[d], nc = c + dc[d];
+                    if (nr < 0 || nr >= rows || nc < 0 || nc >= columns) continue;
+                    OwnerId next = map.getOwner(nr, nc);
+                    if (mine && next != owner) {
+                        border++;
+                        shared[next]++;
+                    }
+                    touching |= next == owner;
+                }
+                tiles += mine;
+                if (!mine && touching) capturable.push_back(std::make_pair(r, c));
+            }
+        }
+        // Regions by flood fill over 4-connected tiles
+        int regions = 0;
+        std::vector<char> seen(static_cast<size_t>(rows) * columns, 0);
+        std::vector<int> stack;
+        for (int start = 0; start < rows * columns; ++start) {
+            if (seen[start] || map.getOwner(start / columns, start % columns) != owner) continue;
+            regions++;
+            seen[start] = 1;
+            stack.assign(1, start);
+            while (!stack.empty()) {
+                int at = stack.back();
+                stack.pop_back();
+                for (int d = 0; d < 4; ++d) {
+                    int nr = at / columns + dr[d], nc = at % columns + dc[d];
+                    if (nr < 0 || nr >= rows || nc < 0 || nc >= columns) continue;
+                    int next = nr * columns + nc;
+                    if (!seen[next] && map.getOwner(nr, nc) == owner) {
+                        seen[next] = 1;
+                        stack.push_back(next);
+                    }
+                }
+            }
+        }
+        std::vector<std::pair<int, int>> cells;
+        map.capturableCells(owner, cells);
+        std::sort(cells.begin(), cells.end());
+        if (map.countTiles(owner) != tiles || map.getTileCount(owner) != tiles || map.borderLength(owner) != border ||
+            map.countRegions(owner) != regions || map.isContiguous(owner) != (regions <= 1) ||
+            map.countCapturable(owner) != static_cast<int64_t>(capturable.size()) || cells != capturable)
+            return false;
+        for (OwnerId other : owners) {
+            if (other == owner) continue;
+            if (map.sharedBorder(owner, other) != shared[other] || map.isAdjacent(owner, other) != (shared[other] > 0)) return false;
+        }
+    }
+    return true;
+}
+
+// Random maps of up to 200x200, scattered or painted in rectangles with compactions in between,
+// and a 4096x4096 diagonal whose figures are known in closed form
+bool checkMapAnalytics() {
+    Random layout(17, 1);
+    for (int round = 0; round < 100; ++round) {
+        int rows = 1 + layout.nextInt(200), columns = 1 + layout.nextInt(200);
+        Map map(rows, columns);
+        std::vector<OwnerId> owners = { map.registerOwner("North"), map.registerOwner("South"), map.registerOwner("East") };
+        int strokes = 1 + layout.nextInt(round % 2 ? 40 : rows * columns);
+        for (int i = 0; i < strokes; ++i) {
+            OwnerId owner = layout.nextInt(5) ? owners[layout.nextInt(3)] : UNOWNED;
+            int top = layout.nextInt(rows), left = layout.nextInt(columns);
+            int height = round % 2 ? 1 + layout.nextInt(rows - top) : 1, width = round % 2 ? 1 + layout.nextInt(columns - left) : 1;
+            for (int r = top; r < top + height; ++r) {
+                for (int c = left; c < left + width; ++c) map.setOwner(r, c, owner);
+            }
+            if (layout.nextInt(64) == 0) map.compact();
+        }
+        if (!matchesBruteForce(map, owners)) return false;
+    }
+
+    const int size = 4096;
+    Map diagonal(size, size);
+    OwnerId line = diagonal.registerOwner("Line");
+    for (int i = 0; i < size; ++i) diagonal.setOwner(i, i, line);
+    // Each tile is its own region with four open sides, less the two corners' map edges; the
+    // capturable tiles are those just above and below the line
+    return diagonal.countTiles(line) == size && diagonal.countRegions(line) == size &&
+        diagonal.borderLength(line) == 4LL * size - 4 && diagonal.countCapturable(line) == 2LL * (size - 1);
+}
+
+// Root-parallel MCTS on four threads: every search must leave the real kingdoms exactly as it found them
+bool checkParallelMcts() {
+    InstantClock clock;
+    ClockScope clockScope(clock);
+    World world(11);
+    {
+        ConsoleSilencer silencer;
+        for (int i = 0; i < 3; ++i) world.addKingdom("Kingdom " + std::to_string(i + 1), "King");
+    }
+    MctsPlayer computer(30, 4, 5);
+    bool consistent = computer.getThreadCount() == 4;
+    for (int move = 0; move < 8 && consistent; ++move) {
+        std::vector<std::string> before;
+        for (KingdomId id = 0; id < world.getKingdomCount(); ++id) before.push_back(world.getKingdom(id).snapshot());
+        Action action = computer.chooseAction(world, 0);
+        for (KingdomId id = 0; id < world.getKingdomCount(); ++id) consistent &= world.getKingdom(id).snapshot() == before[id];
+        consistent &= computer.getLastIterations() > 0;
+        ConsoleSilencer silencer;
+        Simulation::tryExecute(world.getKingdom(0), action.target >= 0 ? &world.getKingdom(action.target) : nullptr, action);
+        Action turn;
+        turn.type = ACTION_PLAY_TURN;
+        for (KingdomId id = 1; id < world.getKingdomCount(); ++id) Simulation::tryExecute(world.getKingdom(id), nullptr, turn);
+    }
+    return consistent;
+}
+
+int runSelfCheck() {
+    struct Check {
+        const char* name;
+        bool (*run)();
+    };
+    const Check checks[] = {
+        { "KingdomBatch matches live kingdoms (64 kingdoms, 20 steps)", []() { return checkKingdomBatch(64, 20); } },
+        { "SharedTreasury conserves resources (8 threads)", checkSharedTreasury },
+        { "MpscQueue delivers every message once, in order per producer (4 threads)", checkMpscQueue },
+        { "Exchange conserves gold and goods, no self-trades (20000 orders)", checkExchange },
+        { "Map analytics match a brute-force scan (100 maps + 4096x4096 diagonal)", checkMapAnalytics },
+        { "SnapshotStore round-trips kingdom snapshots", checkSnapshotStore },
+        { "Parallel MCTS leaves the world untouched (4 threads)", checkParallelMcts },
+    };
+    int failed = 0;
+    for (const Check& check : checks) {
+        bool passed = check.run();
+        failed += !passed;
+        std::cout << (passed ? GREEN "PASS " : RED "FAIL ") << RESET << check.name << "\n";
+    }
+    return failed > 0 ? 1 : 0;
+}
+
+#ifdef STRONGHOLD_PROFILE
+// Writes the Chrome trace (STRONGHOLD_TRACE, default stronghold_trace.json) and the phase
+// histograms however main() exits
+struct ProfileReport {
+    ~ProfileReport() {
+        const char* path = std::getenv("STRONGHOLD_TRACE");
+        try {
+            Profiler::instance().writeChromeTrace(path ? path : "stronghold_trace.json");
+        }
+        catch (const std::exception& e) {
+            std::cout << RED << "Error: " << e.what() << "\n" << RESET;
+        }
+        Profiler::instance().printHistograms(std::cout);
+    }
+};
+#endif
+
+// Heap allocations per kingdom for each way of building one; needs a -DSTRONGHOLD_COUNT_ALLOCS build
+int countAllocations(int kingdoms) {
+    if (!AllocationCounter::isEnabled()) {
+        std::cout << YELLOW << "Rebuild with -DSTRONGHOLD_COUNT_ALLOCS to count heap allocations.\n" << RESET;
+        return 1;
+    }
+    std::vector<std::string> names;
+    for (int i = 0; i < kingdoms; ++i) names.push_back("Kingdom " + std::to_string(i + 1));
+    auto perKingdom = [kingdoms](uint64_t before) {
+        return static_cast<double>(AllocationCounter::getCount() - before) / kingdoms;
+    };
+
+    uint64_t before = AllocationCounter::getCount();
+    for (int i = 0; i < kingdoms; ++i) Kingdom kingdom(names[i], "King", 1, i);
+    double standalone = perKingdom(before);
+
+    MonotonicArena arena;
+    auto graph = std::make_shared<DiplomacyGraph>();
+    for (int i = 0; i < kingdoms; ++i) graph->addKingdom(names[i]);
+    before = AllocationCounter::getCount();
+    for (int i = 0; i < kingdoms; ++i) Kingdom kingdom(names[i], "King", 1, i, &arena, graph);
+    double arenaBuilt = perKingdom(before);
+
+    World world(1);
+    world.reserve(kingdoms);
+    before = AllocationCounter::getCount();
+    for (int i = 0; i < kingdoms; ++i) world.addKingdom(names[i], "King");
+    double registered = perKingdom(before);
+
+    std::cout << BOLD << "Heap allocations per kingdom (" << kingdoms << " kingdoms)\n" << RESET;
+    std::cout << "  Kingdom constructor:         " << standalone << "\n";
+    std::cout << "  Kingdom constructor (arena): " << arenaBuilt << " (" << arena.getBlockCount() << " arena blocks, "
+        << arena.getBytesUsed() / kingdoms << " bytes each)\n";
+    std::cout << "  World::addKingdom:           " << registered << " (post office, exchange and name registries)\n";
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+#ifdef STRONGHOLD_PROFILE
+    ProfileReport profileReport;
+#endif
+    if (argc >= 2 && std::string(argv[1]) == "--simulate") {
+        int kingdomCount = argc >= 3 ? std::atoi(argv[2]) : 2;
+        int turns = argc >= 4 ? std::atoi(argv[3]) : 100;
+        uint64_t seed = argc >= 5 ? std::strtoull(argv[4], nullptr, 10) : static_cast<uint64_t>(time(nullptr));
+        if (kingdomCount < 1 || turns < 0) {
+            std::cout << RED << "Usage: " << argv[0] << " --simulate <kingdoms> <turns> [seed]\n" << RESET;
+            return 1;
+        }
+        return runSimulation(kingdomCount, turns, seed);
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "--monte-carlo") {
+        long long games = argc >= 3 ? std::atoll(argv[2]) : 1000;
+        int turns = argc >= 4 ? std::atoi(argv[3]) : 100;
+        uint64_t seed = argc >= 5 ? std::strtoull(argv[4], nullptr, 10) : static_cast<uint64_t>(time(nullptr));
+        int threads = argc >= 6 ? std::atoi(argv[5]) : 0;
+        if (games < 1 || turns < 1) {
+            std::cout << RED << "Usage: " << argv[0] << " --monte-carlo <games> <turns> [seed] [threads]\n" << RESET;
+            return 1;
+        }
+        return runMonteCarlo(games, turns, seed, threads);
+    }
+
+    try {
+        if (argc >= 2 && std::string(argv[1]) == "--leaderboard")
+            return runLeaderboard(argc >= 3 ? std::atoi(argv[2]) : 10);
+        if (argc >= 3 && std::string(argv[1]) == "--import-scores")
+            return importScores(argv[2]);
+        if (argc >= 2 && std::string(argv[1]) == "--self-check")
+            return runSelfCheck();
+        if (argc >= 2 && std::string(argv[1]) == "--allocations")
+            return countAllocations(argc >= 3 ? std::max(1, std::min(MAX_KINGDOMS, std::atoi(argv[2]))) : MAX_KINGDOMS);
+        if (argc >= 2 && std::string(argv[1]) == "--bench") {
+            // --bench [baseline file] [--update] [--threshold <percent>]
+            std::string baselinePath = "bench_baseline.txt";
+            bool update = false;
+            double threshold = BENCH_REGRESSION_THRESHOLD;
+            for (int i = 2; i < argc; ++i) {
+                if (std::string(argv[i]) == "--update") update = true;
+                else if (std::string(argv[i]) == "--threshold" && i + 1 < argc) threshold = std::atof(argv[++i]) / 100.0;
+                else baselinePath = argv[i];
+            }
+            return runBenchmarks(baselinePath, update, threshold);
+        }
+    }
+    catch (const std::exception& e) {
+        std::cout << RED << "Error: " << e.what() << "\n" << RESET;
+        return 1;
+    }
+
+    // Optional "--time-scale <factor>" shortens (or stretches) build and training delays; 0 skips them entirely
+    double timeScale = 1.0;
+    if (argc >= 2 && std::string(argv[1]) == "--time-scale") {
+        char* end = nullptr;
+        timeScale = argc >= 3 ? std::strtod(argv[2], &end) : -1.0;
+        if (argc < 3 || end == argv[2] || *end != '\0' || !(timeScale >= 0.0) || std::isinf(timeScale)) {
+            std::cout << RED << "Usage: " << argv[0] << " --time-scale <factor>  (factor >= 0, 0 = no delays)\n" << RESET;
+            return 1;
+        }
+    }
+    ScaledClock scaledClock(timeScale > 0.0 ? timeScale : 1.0);
+    InstantClock instantClock;
+    ClockScope clockScope(timeScale > 0.0 ? static_cast<Clock&>(scaledClock) : instantClock);
 
     std::cout << GREEN << "Welcome to Stronghold!\n" << RESET;
-    std::cout << "Player 1:\n";
-    std::string kingdomName1 = getValidString("Enter your kingdom's name: ");
-    std::string kingName1 = getValidString("Enter your king's name: ");
-    std::cout << "Player 2:\n";
-    std::string kingdomName2 = getValidString("Enter your kingdom's name (e.g., Ironhold): ");
-    std::string kingName2 = getValidString("Enter your king's name: ");
-
-    Kingdom player1(kingdomName1, kingName1);
-    Kingdom player2(kingdomName2, kingName2);
-    bool player1Turn = true;
+    int playerCount = getValidChoice(MIN_PLAYERS, MAX_PLAYERS, "Enter number of players (" + std::to_string(MIN_PLAYERS) +
+        "-" + std::to_string(MAX_PLAYERS) + "): ");
+    World world(static_cast<uint64_t>(time(nullptr)));
+    world.reserve(playerCount);
+    std::vector<std::unique_ptr<MctsPlayer>> computers(playerCount);
+    for (int i = 0; i < playerCount; ++i) {
+        std::cout << "Player " << i + 1 << ":\n1. Human\n2. Computer\n";
+        if (getValidChoice(1, 2, "Choose seat (1-2): ") == 2) {
+            std::string kingdomName = "Computer " + std::to_string(i + 1);
+            while (world.find(kingdomName) != NO_KINGDOM) kingdomName += "'";
+            world.addKingdom(kingdomName, "King " + std::to_string(i + 1));
+            computers[i] = std::make_unique<MctsPlayer>(MCTS_BUDGET_MS, 0, static_cast<uint64_t>(time(nullptr)) + i);
+            continue;
+        }
+        std::string kingdomName = getValidString(i == 1 ? "Enter your kingdom's name (e.g., Ironhold): " : "Enter your kingdom's name: ");
+        while (world.find(kingdomName) != NO_KINGDOM) {
+            std::cout << RED << kingdomName << " is already taken.\n" << RESET;
+            kingdomName = getValidString("Enter your kingdom's name: ");
+        }
+        std::string kingName = getValidString("Enter your king's name: ");
+        world.addKingdom(kingdomName, kingName);
+    }
+    Exchange& exchange = world.getExchange();
+    KingdomId current = 0;
     int turnCount = 1;
+    ScreenRenderer screen;
 
     while (true) {
-        std::cout << BOLD << "\n=== Turn " << turnCount << " ===\n" << RESET;
-        Kingdom& currentPlayer = player1Turn ? player1 : player2;
-        Kingdom& otherPlayer = player1Turn ? player2 : player1;
-        std::string playerLabel = player1Turn ? "Player 1" : "Player 2";
-
-        std::cout << GREEN << playerLabel << "'s Turn (" << currentPlayer.getName() << ")\n" << RESET;
-        std::cout << YELLOW << "Status of both kingdoms:\n" << RESET;
-        player1.printStatus();
-        player2.printStatus();
-
-        displayMenu();
-        int choice = getValidChoice(1, 20, "Enter your choice (1-20): ");
+        Kingdom& currentPlayer = world.getKingdom(current);
+        KingdomId next = static_cast<KingdomId>((current + 1) % playerCount);
+        std::string playerLabel = "Player " + std::to_string(current + 1);
+
+        // The current kingdom and the next one to move, in seat order
+        std::vector<std::string> frame, left, right;
+        frame.push_back(std::string(BOLD) + "=== Turn " + std::to_string(turnCount) + " ===" + RESET);
+        frame.push_back(std::string(GREEN) + playerLabel + "'s Turn (" + currentPlayer.getName() + ")" + RESET);
+        world.getKingdom(std::min(current, next)).renderStatus(left);
+        world.getKingdom(std::max(current, next)).renderStatus(right);
+        screen.appendColumns(frame, left, right);
+        screen.present(frame);
+
+        MctsPlayer* computer = computers[current].get();
+        int choice = 0;
+        if (!computer) {
+            displayMenu();
+            choice = getValidChoice(1, 21, "Enter your choice (1-21): ");
+        }
 
         try {
             switch (choice) {
+            case 0: { // Computer seat
+                Action action = computer->chooseAction(world, current);
+                std::cout << YELLOW << currentPlayer.getName() << " chooses: " << MctsPlayer::describe(action);
+                if (action.target >= 0) std::cout << " (" << world.getKingdom(static_cast<KingdomId>(action.target)).getName() << ")";
+                std::cout << " after " << computer->getLastIterations() << " simulations\n" << RESET;
+                Simulation::execute(currentPlayer, action.target >= 0 ? &world.getKingdom(static_cast<KingdomId>(action.target)) : nullptr, action);
+                break;
+            }
+
             case 1: // Play Turn
                 currentPlayer.playTurn();
                 break;
@@ -113,10 +721,10 @@ int main() {
             }
 
             case 6: { // Manage Diplomacy
-                std::string targetKingdom = getValidString("Enter target kingdom (e.g., " + otherPlayer.getName() + "): ");
+                KingdomId target = chooseTarget(world, current, "Enter target kingdom (e.g., " + world.getKingdom(next).getName() + "): ");
                 std::cout << "1. Form Alliance\n2. Break Alliance\n3. Form Trade Agreement\n4. Establish Secure Route\n";
                 int subChoice = getValidChoice(1, 4, "Choose action (1-4): ");
-                currentPlayer.manageDiplomacy(targetKingdom, subChoice);
+                currentPlayer.manageDiplomacy(target, subChoice);
                 break;
             }
 
@@ -129,14 +737,14 @@ int main() {
             }
 
             case 8: { // Send Message
-                std::string recipient = getValidString("Enter recipient kingdom (e.g., " + otherPlayer.getName() + "): ");
+                KingdomId recipient = chooseTarget(world, current, "Enter recipient kingdom (e.g., " + world.getKingdom(next).getName() + "): ");
                 std::string message = getValidString("Enter message: ");
                 currentPlayer.sendMessage(recipient, message);
                 break;
             }
 
             case 9: { // Send Fake Trade Request
-                std::string recipient = getValidString("Enter recipient kingdom (e.g., " + otherPlayer.getName() + "): ");
+                KingdomId recipient = chooseTarget(world, current, "Enter recipient kingdom (e.g., " + world.getKingdom(next).getName() + "): ");
                 currentPlayer.sendFakeTradeRequest(recipient);
                 break;
             }
@@ -158,12 +766,14 @@ int main() {
             case 13: { // Conduct Espionage
                 std::cout << "1. Spy Mission\n2. Sabotage Weapons\n3. Steal Gold\n";
                 int subChoice = getValidChoice(1, 3, "Choose espionage action (1-3): ");
-                currentPlayer.conductEspionage(subChoice, otherPlayer);
+                KingdomId target = chooseTarget(world, current, "Enter target kingdom: ");
+                currentPlayer.conductEspionage(subChoice, world.getKingdom(target));
                 break;
             }
 
             case 14: { // Conduct Smuggling
-                currentPlayer.conductSmuggling(otherPlayer);
+                KingdomId target = chooseTarget(world, current, "Enter target kingdom: ");
+                currentPlayer.conductSmuggling(world.getKingdom(target));
                 break;
             }
 
@@ -197,7 +807,33 @@ int main() {
                 currentPlayer.saveScore();
                 break;
 
-            case 20: // Exit
+            case 20: { // Trade on Exchange
+                std::cout << "1. Place Buy Order\n2. Place Sell Order\n3. Cancel Order\n4. View Order Books\n";
+                int subChoice = getValidChoice(1, 4, "Choose action (1-4): ");
+                if (subChoice == 4) {
+                    for (int r = 0; r < RESOURCE_COUNT; ++r) {
+                        ResourceType type = static_cast<ResourceType>(r);
+                        std::cout << RESOURCE_NAMES[r] << ": Bid " << exchange.getBestBid(type) << ", Ask " << exchange.getBestAsk(type)
+                            << ", Last " << exchange.getLastPrice(type) << ", Volume " << exchange.getVolume(type) << "\n";
+                    }
+                }
+                else if (subChoice == 3) {
+                    int id = getValidChoice(1, 2000000000, "Enter order number: ");
+                    currentPlayer.cancelOrder(static_cast<OrderId>(id));
+                }
+                else {
+                    std::cout << "Resources: Food, Iron, Wood, Stone\n";
+                    std::string resource = getValidString("Enter resource: ");
+                    ResourceType type;
+                    if (!parseResourceType(resource, type)) throw InsufficientResourcesException("Invalid resource");
+                    int price = getValidChoice(1, 100000, "Enter limit price per unit (1-100000): ");
+                    int quantity = getValidChoice(1, 10000, "Enter quantity (1-10000): ");
+                    currentPlayer.placeOrder(type, subChoice == 1 ? SIDE_BUY : SIDE_SELL, price, quantity);
+                }
+                break;
+            }
+
+            case 21: // Exit
                 std::cout << GREEN << "Thank you for playing Stronghold!\n" << RESET;
                 return 0;
 
@@ -215,8 +851,8 @@ int main() {
             std::cout << RED << "Unexpected error: " << e.what() << "\n" << RESET;
         }
 
-        player1Turn = !player1Turn;
-        if (player1Turn) turnCount++;
+        current = next;
+        if (current == 0) turnCount++;
     }
 
     return 0;